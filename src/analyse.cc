@@ -3,6 +3,7 @@
 #include <fstream>
 #include <cstdarg>
 #include <cstring>
+#include <cctype>
 #include <cstdlib>
 #include <string>
 #include <vector>
@@ -20,6 +21,9 @@
 #include <unistd.h>
 #include <sstream>
 #include <cassert>
+#ifndef __APPLE__
+# include <elf.h>
+#endif
 //#include <pcre.h>
 
 #ifndef iggetc
@@ -261,10 +265,12 @@ const char USAGE[] = "igprof-analyse\n"
     "  [-p/--paths] [-c/--calls] [--value peak|normal]\n"
     "  [-mr/--merge-regexp REGEXP]\n"
     "  [-ml/--merge-libraries REGEXP]\n"
+    "  [-tg/--thread-groups]\n"
     "  [-nf/--no-filter]\n"
     "  { [-t/--text], [-s/--sqlite], [--top <n>], [--tree] }\n"
     "  [--libs] [--demangle] [--gdb] [-v/--verbose]\n"
     "  [-b/--baseline FILE [--diff-mode]]\n"
+    "  [--delta-dump <n>]\n"
     "  [-Mc/--max-count-value <value>] [-mc/--min-count-value <value>]\n"
     "  [-Mf/--max-calls-value <value>] [-mc/--min-calls-value <value>]\n"
     "  [-Ma/--max-average-value <value>] [-ma/--min-average-value <value>]\n"
@@ -698,6 +704,9 @@ public:
   void setMergeLibraries(bool value) { m_mergeLibraries = value; }
   bool mergeLibraries(void) { return m_mergeLibraries; }
 
+  void setThreadGroups(bool value) { m_threadGroups = value; }
+  bool threadGroups(void) { return m_threadGroups; }
+
   void setBaseline(const std::string &baseline)
     {
       m_baseline = baseline;
@@ -740,6 +749,7 @@ private:
   bool m_verbose;
   bool m_normalValue;
   bool m_mergeLibraries;
+  bool m_threadGroups;
   std::string m_baseline;
   bool m_diffMode;
 public:
@@ -766,6 +776,7 @@ Configuration::Configuration()
    m_verbose(false),
    m_normalValue(true),
    m_mergeLibraries(false),
+   m_threadGroups(false),
    m_diffMode(false),
    minCountValue(-1),
    maxCountValue(-1),
@@ -1058,6 +1069,10 @@ private:
   SymbolFilter m_filter;
 };
 
+struct DumpReadState;
+struct DeltaNode;
+class BinaryDumpReader;
+
 class IgProfAnalyzerApplication
 {
   typedef std::vector<FlatInfo *> FlatVector;
@@ -1077,6 +1092,18 @@ public:
   void topN(ProfileInfo &prof);
   void tree(ProfileInfo &prof);
   void readDump(ProfileInfo *prof, const std::string &filename, StackTraceFilter *filter);
+  void readTextDump(DumpReadState &state, FILE *inFile, const std::string &filename);
+  void readBinaryDump(DumpReadState &state, FILE *inFile, const std::string &filename);
+  void readBinaryHeader(BinaryDumpReader &r, const std::string &filename);
+  NodeInfo *addDumpNode(DumpReadState &state, int64_t position, SymbolInfo *sym);
+  NodeInfo *addDumpChild(DumpReadState &state, NodeInfo *parent, SymbolInfo *sym);
+  void readDeltaCounters(DumpReadState &state, BinaryDumpReader &r, DeltaNode &node);
+  void addDeltaNodes(DumpReadState &state);
+  void addDumpCounterDef(DumpReadState &state, size_t ctrId, const std::string &ctrname);
+  bool addDumpCounter(DumpReadState &state, NodeInfo *node, size_t ctrId,
+                      int64_t ctrfreq, int64_t ctrvalNormal, int64_t ctrvalPeak);
+  void addDumpLeak(DumpReadState &state, int64_t leakAddress, int64_t leakSize);
+  void endDumpLeaks(DumpReadState &state, NodeInfo *node, size_t ctrId);
   void dumpAllocations(ProfileInfo &prof);
   void prepdata(ProfileInfo &prof);
   void summarizePageInfo(FlatVector &sorted);
@@ -1125,6 +1152,7 @@ private:
   bool                          m_showPages;
   bool                          m_showLocalityMetrics;
   size_t                        m_topN;
+  int64_t                       m_deltaDump;
   float                         m_tickPeriod;
 };
 
@@ -1140,6 +1168,7 @@ IgProfAnalyzerApplication::IgProfAnalyzerApplication(Configuration *config, int
    m_showPages(false),
    m_showLocalityMetrics(false),
    m_topN(0),
+   m_deltaDump(-1),
    m_tickPeriod(0.01)
 {}
 
@@ -1253,7 +1282,8 @@ public:
     {
       assert(node);
       Counter &counter = node->COUNTER;
-      if (counter.freq != 0)
+      // Zero size allocations take no room, leave the count at zero.
+      if (counter.freq != 0 && counter.cnt != 0)
         counter.cnt = 4096 * counter.freq / counter.cnt;
     }
   virtual std::string name(void) const { return "average allocation size"; }
@@ -1572,6 +1602,91 @@ private:
   std::vector<Regexp> m_regexps;
 };
 
+/** Merges the thread root frames recorded with the profiler option
+    "igprof:threads" by thread group.  The group of a thread is its
+    name without the thread id and any trailing instance number, so
+    for example frames "thread 1234 worker-1" and "thread 1235
+    worker-2" merge into one frame "threads worker".  */
+class ThreadGroupFilter : public IgProfFilter
+{
+  typedef std::map<std::string, SymbolInfo *> GroupSymbols;
+public:
+  ThreadGroupFilter(bool isMax)
+  : m_isMax(isMax)
+  {}
+
+  virtual std::string name(void) const { return "merge threads by group"; }
+  virtual enum FilterType type(void) const { return PRE; }
+
+  /** Thread frames are children of the root only, so there is
+      nothing to do for other nodes.  */
+  virtual void pre(NodeInfo *parent, NodeInfo *node)
+    {
+      if (parent)
+        return;
+
+      NodeInfo::Nodes children;
+      children.swap(node->CHILDREN);
+      for (size_t i = 0, e = children.size(); i != e; ++i)
+      {
+        NodeInfo *child = children[i];
+        SymbolInfo *sym = child->symbol();
+        std::string group;
+        if (sym && sym->FILE && sym->FILE->NAME == "<igprof>"
+            && threadGroup(sym->NAME, group))
+        {
+          child->setSymbol(groupSymbol(group, sym->FILE));
+          if (NodeInfo *same = node->getChildrenBySymbol(child->symbol()))
+          {
+            same->COUNTER.add(child->COUNTER, m_isMax);
+            mergeRanges(same->RANGES, child->RANGES);
+            mergeToNode(same, child, m_isMax);
+            continue;
+          }
+        }
+        node->CHILDREN.push_back(child);
+      }
+    }
+
+private:
+  /** Get the group of thread frame @a name into @a group.  Returns
+      false if the name is not that of a thread frame.  */
+  static bool threadGroup(const std::string &name, std::string &group)
+    {
+      if (name.compare(0, 7, "thread ") != 0)
+        return false;
+
+      size_t start = name.find(' ', 7);
+      if (start == std::string::npos)
+        return false;
+
+      size_t end = name.size();
+      while (end > start+1 && isdigit((unsigned char) name[end-1]))
+        --end;
+      while (end > start+1 && strchr("-_.:# ", name[end-1]))
+        --end;
+
+      group = "threads " + (end > start+1
+                            ? name.substr(start+1, end-start-1)
+                            : std::string("unnamed"));
+      return true;
+    }
+
+  SymbolInfo *groupSymbol(const std::string &group, FileInfo *file)
+    {
+      GroupSymbols::iterator i = m_groups.find(group);
+      if (i != m_groups.end())
+        return i->second;
+
+      SymbolInfo *sym = new SymbolInfo(group.c_str(), file, 0);
+      m_groups.insert(GroupSymbols::value_type(group, sym));
+      return sym;
+    }
+
+  GroupSymbols m_groups;
+  bool m_isMax;
+};
+
 /** Filter to merge use by C++ std namespace entities to parents.
  */
 class RemoveStdFilter : public IgProfFilter
@@ -1713,6 +1828,107 @@ protected:
   }
 };
 
+#ifndef __APPLE__
+/** Reads the GNU build-id note of the ELF file open in @a f.  */
+template <class Ehdr, class Phdr>
+static std::string
+readBuildId(FILE *f)
+{
+  Ehdr eh;
+  if (fseek(f, 0, SEEK_SET) || fread(&eh, sizeof(eh), 1, f) != 1
+      || eh.e_phentsize != sizeof(Phdr))
+    return "";
+
+  for (size_t i = 0; i < eh.e_phnum; ++i)
+  {
+    Phdr ph;
+    if (fseek(f, eh.e_phoff + i * sizeof(Phdr), SEEK_SET)
+        || fread(&ph, sizeof(ph), 1, f) != 1)
+      return "";
+
+    if (ph.p_type != PT_NOTE || ! ph.p_filesz || ph.p_filesz > 65536)
+      continue;
+
+    std::vector<char> notes(ph.p_filesz);
+    if (fseek(f, ph.p_offset, SEEK_SET)
+        || fread(&notes[0], notes.size(), 1, f) != 1)
+      return "";
+
+    // Notes have the same layout for 32 and 64-bit objects.
+    for (size_t pos = 0; pos + sizeof(Elf32_Nhdr) <= notes.size(); )
+    {
+      Elf32_Nhdr *note = (Elf32_Nhdr *) &notes[pos];
+      size_t name = pos + sizeof(Elf32_Nhdr);
+      size_t desc = name + ((note->n_namesz + 3) & ~3);
+      pos = desc + ((note->n_descsz + 3) & ~3);
+      if (pos > notes.size())
+        break;
+
+      if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4
+          && ! memcmp(&notes[name], "GNU", 4))
+      {
+        std::string result;
+        char hex[3];
+        for (size_t j = 0; j < note->n_descsz; ++j)
+        {
+          sprintf(hex, "%02x", (unsigned char) notes[desc + j]);
+          result += hex;
+        }
+        return result;
+      }
+    }
+  }
+
+  return "";
+}
+
+#endif /* __APPLE__ */
+
+/** @return the GNU build-id of the ELF file @a path as a hex string,
+    or an empty string if it has none or is not an ELF file.  */
+static std::string
+elfBuildId(const std::string &path)
+{
+#ifdef __APPLE__
+  return "";
+#else
+  FILE *f = fopen(path.c_str(), "r");
+  if (! f)
+    return "";
+
+  unsigned char ident[EI_NIDENT];
+  std::string result;
+  if (fread(ident, sizeof(ident), 1, f) == 1
+      && ! memcmp(ident, ELFMAG, SELFMAG))
+  {
+    if (ident[EI_CLASS] == ELFCLASS64)
+      result = readBuildId<Elf64_Ehdr, Elf64_Phdr>(f);
+    else if (ident[EI_CLASS] == ELFCLASS32)
+      result = readBuildId<Elf32_Ehdr, Elf32_Phdr>(f);
+  }
+
+  fclose(f);
+  return result;
+#endif /* __APPLE__ */
+}
+
+/** An object listed in the module map of a raw address dump.  */
+struct RawModule
+{
+  uint64_t      START;
+  uint64_t      END;
+  FileInfo      *FILE;
+
+  RawModule(uint64_t start, uint64_t end, FileInfo *file)
+    : START(start), END(end), FILE(file)
+    {}
+
+  bool operator<(const RawModule &other) const
+    {
+      return START < other.START;
+    }
+};
+
 class SymbolInfoFactory
 {
 public:
@@ -1724,7 +1940,7 @@ public:
       filenames in one single place.
     */
   SymbolInfoFactory(ProfileInfo *prof, bool useGdb)
-    : m_prof(prof), m_useGdb(useGdb)
+    : m_rawFileId(0), m_rawSorted(true), m_prof(prof), m_useGdb(useGdb)
     {
       char *paths = 0;
       if (const char *p = getenv("PATH"))
@@ -1847,6 +2063,85 @@ public:
     }
 
 
+  /** Registers object @a name, mapped at [@a start, @a end) in the
+      profiled process, from the module map of a raw address dump.  The
+      symbol table of the file is used to symbolise addresses only if
+      its GNU build-id matches the @a buildid recorded in the dump.  */
+  void addRawModule(const std::string &name, unsigned int fileid,
+                    uint64_t start, uint64_t end, const std::string &buildid)
+    {
+      FileInfo *file = createFileInfo(name, fileid);
+      struct stat st;
+      if (::stat(file->NAME.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      {
+        if (buildid.empty() || buildid == elfBuildId(file->NAME))
+          file->loadSymbols();
+        else
+          std::cerr << "Warning: " << file->NAME << " has changed since"
+                    << " the profile was taken, not symbolising it." << std::endl;
+      }
+
+      m_rawModules.push_back(RawModule(start, end, file));
+      m_rawFileId = std::max(m_rawFileId, fileid + 1);
+      m_rawSorted = false;
+    }
+
+  /** Registers the name of an address with no object behind it in
+      a raw address dump, such as the profiler's synthetic frames.  */
+  void addRawName(uint64_t address, const std::string &name)
+    {
+      m_rawNames[address] = name;
+    }
+
+  /** Returns the symbol for @a address in a raw address dump.  */
+  SymbolInfo *getRawSymbol(uint64_t address)
+    {
+      RawSymbols::iterator cached = m_rawSymbols.find(address);
+      if (cached != m_rawSymbols.end())
+        return cached->second;
+
+      if (! m_rawSorted)
+      {
+        std::sort(m_rawModules.begin(), m_rawModules.end());
+        m_rawSorted = true;
+      }
+
+      std::string symname;
+      FileInfo *file = 0;
+      int64_t fileoff = 0;
+      std::map<uint64_t, std::string>::iterator named = m_rawNames.find(address);
+      std::vector<RawModule>::iterator mod
+        = std::upper_bound(m_rawModules.begin(), m_rawModules.end(),
+                           RawModule(address, address, 0));
+
+      if (named != m_rawNames.end())
+      {
+        file = rawFile("<igprof>");
+        symname = named->second;
+      }
+      else if (mod != m_rawModules.begin() && address < (--mod)->END)
+      {
+        char buf[32];
+        file = mod->FILE;
+        fileoff = address - mod->START;
+        const char *name = file->symbolByOffset(fileoff);
+        sprintf(buf, "@?0x%" PRIx64, address);
+        symname = name ? name : buf;
+      }
+      else
+      {
+        char buf[32];
+        file = rawFile("");
+        fileoff = address;
+        sprintf(buf, "@?0x%" PRIx64, address);
+        symname = buf;
+      }
+
+      SymbolInfo *sym = createSymbolInfo(symname, fileoff, file, m_symbols.size());
+      m_rawSymbols[address] = sym;
+      return sym;
+    }
+
   static SymbolsByName &namedSymbols(void)
     {
       static SymbolsByName s_namedSymbols;
@@ -1876,9 +2171,22 @@ private:
   typedef std::vector<FileInfo *> Files;
   typedef std::map<std::string, FileInfo *> FilesByName;
   typedef std::vector<SymbolInfo *> Symbols;
+  /** Returns the file for objects which are not in the module map.  */
+  FileInfo *rawFile(const std::string &name)
+    {
+      FilesByName::iterator i = m_namedFiles.find(name.empty() ? "<dynamically generated>" : name);
+      return i != m_namedFiles.end() ? i->second : createFileInfo(name, m_rawFileId++);
+    }
+
+  typedef std::map<uint64_t, SymbolInfo *> RawSymbols;
   Files m_files;
   Symbols m_symbols;
   FilesByName m_namedFiles;
+  std::vector<RawModule> m_rawModules;
+  std::map<uint64_t, std::string> m_rawNames;
+  RawSymbols m_rawSymbols;
+  unsigned int m_rawFileId;
+  bool m_rawSorted;
   ProfileInfo *m_prof;
   bool m_useGdb;
   std::vector<std::string>      m_paths;
@@ -2456,6 +2764,251 @@ symremap(ProfileInfo &prof, std::vector<FlatInfo *> infos, bool usegdb, bool dem
   }
 }
 
+/** A counter of a node in a delta dump, with the leaks if needed.  */
+struct DeltaCounter
+{
+  size_t                        id;
+  int64_t                       freq;
+  int64_t                       normal;
+  int64_t                       peak;
+  std::vector<std::pair<int64_t, int64_t> > leaks;
+};
+
+/** A stack node in a delta dump, by its stable id.  Buffer roots have
+    themselves as the root and no symbol.  */
+struct DeltaNode
+{
+  DeltaNode(void)
+    : parent(0), root(0), sym(0)
+    {}
+
+  size_t                        parent;
+  size_t                        root;
+  SymbolInfo                    *sym;
+  std::vector<DeltaCounter>     counters;
+};
+
+/** State shared by the text and binary dump readers while they build
+    the profile tree of one dump.  */
+struct DumpReadState
+{
+  DumpReadState(ProfileInfo *p, StackTraceFilter *f, SymbolInfoFactory *s)
+    : prof(p), filter(f), symbols(s)
+    {
+      nodestack.reserve(IGPROF_MAX_DEPTH);
+      ranges.reserve(20000);
+    }
+
+  ProfileInfo                   *prof;
+  StackTraceFilter              *filter;
+  SymbolInfoFactory             *symbols;
+
+  // The stack of nodes leading to the current one.
+  std::vector<NodeInfo *>       nodestack;
+
+  // A vector whose i-th element specifies whether or
+  // not the counter file id "i" is a key.
+  std::vector<bool>             keys;
+
+  // A vector keeping track of all the pages touched by the
+  // allocations. We store here the address of the page,
+  // in order to improve lookup whether or not a page is
+  // already there. This way the total number of pages
+  // touched is given by "count".
+  std::vector<RangeInfo>        ranges;
+
+  // The nodes of a delta dump indexed by their ids, and the buffer
+  // roots listed in the most recent dump.
+  std::vector<DeltaNode>        deltaNodes;
+  std::vector<size_t>           deltaRoots;
+};
+
+/** Reads a binary format dump, see the record tags in profile.cc for
+    the layout.  All integers are little-endian base-128
+    varints, signed ones zigzag encoded, and strings are a varint
+    length followed by the bytes.  */
+class BinaryDumpReader
+{
+public:
+  BinaryDumpReader(FILE *in, const char *filename)
+    : m_in(in), m_filename(filename)
+    {}
+
+  int byte(void)
+    {
+      int c = iggetc(m_in);
+      if (c == EOF)
+        die("%s: premature end of file\n", m_filename);
+      return c;
+    }
+
+  uint64_t varint(void)
+    {
+      uint64_t result = 0;
+      for (int shift = 0; shift < 64; shift += 7)
+      {
+        int c = byte();
+        result |= uint64_t(c & 0x7f) << shift;
+        if (! (c & 0x80))
+          return result;
+      }
+      die("%s: malformed integer\n", m_filename);
+      return 0;
+    }
+
+  int64_t svarint(void)
+    {
+      uint64_t v = varint();
+      return (v >> 1) ^ -(int64_t)(v & 1);
+    }
+
+  void string(std::string &result)
+    {
+      size_t len = varint();
+      result.resize(len);
+      if (len && fread(&result[0], 1, len, m_in) != len)
+        die("%s: premature end of file\n", m_filename);
+    }
+
+private:
+  FILE          *m_in;
+  const char    *m_filename;
+};
+
+/** Adds a node for symbol @a sym at depth @a position (zero for the
+    outermost frame) below the nodes read so far.  */
+NodeInfo *
+IgProfAnalyzerApplication::addDumpNode(DumpReadState &state,
+                                       int64_t position,
+                                       SymbolInfo *sym)
+{
+  std::vector<NodeInfo *> &nodestack = state.nodestack;
+  int64_t stackSize = nodestack.size();
+  if (position < 0 || position > stackSize)
+    return 0;
+
+  nodestack.erase(nodestack.begin() + position, nodestack.end());
+
+  // Process this stack node.
+  NodeInfo *parent = nodestack.empty() ? state.prof->spontaneous() : nodestack.back();
+  NodeInfo *child = addDumpChild(state, parent, sym);
+  nodestack.push_back(child);
+  return child;
+}
+
+/** Returns the child of @a parent for symbol @a sym, adding it if
+    there is no such child yet.  */
+NodeInfo *
+IgProfAnalyzerApplication::addDumpChild(DumpReadState &state,
+                                        NodeInfo *parent,
+                                        SymbolInfo *sym)
+{
+  NodeInfo *child = parent ? parent->getChildrenBySymbol(sym) : 0;
+
+  if (!child)
+  {
+    // Nodes are allocated in a deque, to maximize locality
+    // and reduce the actual number of allocations.
+    m_nodesStorage.resize(m_nodesStorage.size() + 1);
+    child = &(m_nodesStorage.back());
+    child->setSymbol(sym);
+    state.prof->nodes().push_back(child);
+    if (parent)
+      parent->CHILDREN.push_back(child);
+  }
+
+  return child;
+}
+
+/** Registers counter @a ctrId called @a ctrname.  */
+void
+IgProfAnalyzerApplication::addDumpCounterDef(DumpReadState &state,
+                                             size_t ctrId,
+                                             const std::string &ctrname)
+{
+  // The first counter we meet, we make it the key, unless
+  // the key was already set on command line.
+  if (m_key.empty())
+    setKey(ctrname);
+
+  // Store information about ctrId being a key or not.
+  if (state.keys.size() <= ctrId)
+    state.keys.resize(ctrId + 1, false);
+  state.keys[ctrId] = (ctrname == m_key);
+}
+
+/** Adds the values of counter @a ctrId to @a node.  Returns false if
+    the counter has not been defined.  */
+bool
+IgProfAnalyzerApplication::addDumpCounter(DumpReadState &state,
+                                          NodeInfo *node,
+                                          size_t ctrId,
+                                          int64_t ctrfreq,
+                                          int64_t ctrvalNormal,
+                                          int64_t ctrvalPeak)
+{
+  if (ctrId >= state.keys.size())
+    return false;
+
+  // Record if we are interested in something related to this counter.
+  if (state.keys[ctrId])
+  {
+    int64_t ctrval = m_config->normalValue() ? ctrvalNormal : ctrvalPeak;
+
+    if (state.filter)
+      state.filter->filter(node->symbol(), ctrval, ctrfreq);
+
+    node->COUNTER.cnt += ctrval;
+    node->COUNTER.freq += ctrfreq;
+  }
+
+  state.ranges.clear();
+  return true;
+}
+
+/** Records a leak of @a leakSize bytes at @a leakAddress for the
+    counter last passed to addDumpCounter().  */
+void
+IgProfAnalyzerApplication::addDumpLeak(DumpReadState &state,
+                                       int64_t leakAddress,
+                                       int64_t leakSize)
+{
+  // In the case we specify one of the --show-pages --show-page-ranges
+  // or --show-locality-metrics options, we keep track
+  // of the page ranges that are referenced by all the allocations
+  // (LK counters in the report).
+  //
+  // We first fill a vector with all the ranges, then we sort it later on
+  // collapsing all the adjacent ranges.
+  if (m_showPages  || m_config->dumpAllocations || m_showPageRanges)
+  {
+    assert(leakSize >= 0);
+    state.ranges.push_back(RangeInfo(leakAddress, (leakAddress + leakSize + 1)));
+    RangeInfo &range = state.ranges.back();
+    if (m_showPages || m_showPageRanges)
+    {
+      range.startAddr = range.startAddr >> 12;
+      range.endAddr = range.endAddr >> 12;
+    }
+    assert(range.size() > 0);
+  }
+}
+
+/** Merges the leaks recorded for counter @a ctrId into @a node.  */
+void
+IgProfAnalyzerApplication::endDumpLeaks(DumpReadState &state,
+                                        NodeInfo *node,
+                                        size_t ctrId)
+{
+  // Sort the leak ranges and collapse them.
+  if (! state.ranges.empty() && state.keys[ctrId])
+  {
+    std::sort(state.ranges.begin(), state.ranges.end());
+    mergeSortedRanges(state.ranges);
+    mergeRanges(node->RANGES, state.ranges);
+  }
+}
+
 /**
     Reads a dump and fills in ProfileInfo with the needed information.
   */
@@ -2464,16 +3017,323 @@ IgProfAnalyzerApplication::readDump(ProfileInfo *prof,
                                     const std::string &filename,
                                     StackTraceFilter *filter)
 {
-  std::vector<NodeInfo *> nodestack;
-  nodestack.reserve(IGPROF_MAX_DEPTH);
+  bool isPipe = false;
+  FILE *inFile = openDump(filename.c_str(), isPipe);
+  verboseMessage("Parsing igprof output file", filename.c_str());
+
+  SymbolInfoFactory symbolsFactory(prof, m_config->useGdb);
+  DumpReadState state(prof, filter, &symbolsFactory);
+
+  // Binary dumps start with a magic byte that can never start a
+  // text dump.
+  int first = iggetc(inFile);
+  ungetc(first, inFile);
+  if (first == 0x7f)
+    readBinaryDump(state, inFile, filename);
+  else
+    readTextDump(state, inFile, filename);
+
+  if (isPipe)
+    pclose(inFile);
+  else
+    fclose(inFile);
+
+  verboseMessage(0, 0, " done\n");
+  if (state.keys.empty())
+    die("No counter values in profile data.");
+}
+
+/** Reads a binary format dump from @a inFile.  */
+void
+IgProfAnalyzerApplication::readBinaryDump(DumpReadState &state,
+                                          FILE *inFile,
+                                          const std::string &filename)
+{
+  enum { TAG_END, TAG_STRING, TAG_FILE, TAG_SYMBOL, TAG_COUNTER,
+         TAG_NODE, TAG_MODULE, TAG_NAME, TAG_RAWNODE, TAG_DELTA,
+         TAG_DELTAROOT, TAG_DELTANODE, TAG_DELTAUPDATE };
+
+  BinaryDumpReader r(inFile, filename.c_str());
+  std::vector<std::string> strings;
+  std::string str;
+  size_t nfiles = 0;
+  size_t nsyms = 0;
+  int64_t depth = 0;
+  int next;
+
+  readBinaryHeader(r, filename);
+  while (true)
+  {
+    printProgress();
+    int tag = r.byte();
+    switch (tag)
+    {
+    case TAG_END:
+      // A delta dump file holds one dump after another, each with
+      // its own header.
+      if ((next = getc(inFile)) != EOF)
+      {
+        ungetc(next, inFile);
+        readBinaryHeader(r, filename);
+        break;
+      }
+
+      if (! state.deltaRoots.empty())
+        addDeltaNodes(state);
+      return;
+
+    case TAG_DELTA:
+      // Stop before the dumps following the one asked for.
+      if (int64_t(r.varint()) > m_deltaDump && m_deltaDump >= 0)
+      {
+        addDeltaNodes(state);
+        return;
+      }
+      state.deltaRoots.clear();
+      break;
+
+    case TAG_DELTAROOT:
+      {
+        size_t id = r.varint();
+        if (state.deltaNodes.size() <= id)
+          state.deltaNodes.resize(id + 1);
+        state.deltaNodes[id].root = id;
+        state.deltaRoots.push_back(id);
+      }
+      break;
+
+    case TAG_DELTANODE:
+      {
+        size_t id = r.varint();
+        size_t parent = r.varint();
+        uint64_t ref = r.varint();
+        if (parent >= state.deltaNodes.size() || ! state.deltaNodes[parent].root)
+          die("%s: node %lu referenced before definition\n",
+              filename.c_str(), (unsigned long) parent);
+        if (ref >= nsyms)
+          die("%s: symbol %lu referenced before definition\n",
+              filename.c_str(), (unsigned long) ref);
+        if (state.deltaNodes.size() <= id)
+          state.deltaNodes.resize(id + 1);
+
+        DeltaNode &node = state.deltaNodes[id];
+        node.parent = parent;
+        node.root = state.deltaNodes[parent].root;
+        node.sym = state.symbols->getSymbol(ref);
+        readDeltaCounters(state, r, node);
+      }
+      break;
+
+    case TAG_DELTAUPDATE:
+      {
+        size_t id = r.varint();
+        if (id >= state.deltaNodes.size() || ! state.deltaNodes[id].sym)
+          die("%s: node %lu referenced before definition\n",
+              filename.c_str(), (unsigned long) id);
+        readDeltaCounters(state, r, state.deltaNodes[id]);
+      }
+      break;
+
+    case TAG_STRING:
+      strings.resize(strings.size() + 1);
+      r.string(strings.back());
+      break;
+
+    case TAG_FILE:
+      {
+        size_t strid = r.varint();
+        if (strid >= strings.size())
+          die("%s: string %lu referenced before definition\n",
+              filename.c_str(), (unsigned long) strid);
+        state.symbols->createFileInfo(strings[strid], nfiles++);
+      }
+      break;
+
+    case TAG_SYMBOL:
+      {
+        size_t fileId = r.varint();
+        int64_t fileoff = r.svarint();
+        size_t strid = r.varint();
+        if (fileId >= nfiles || strid >= strings.size())
+          die("%s: symbol uses undefined file or string\n", filename.c_str());
+        str = strings[strid];
+        state.symbols->createSymbolInfo(str, fileoff,
+                                        state.symbols->getFile(fileId),
+                                        nsyms++);
+      }
+      break;
+
+    case TAG_COUNTER:
+      {
+        size_t strid = r.varint();
+        if (strid >= strings.size())
+          die("%s: string %lu referenced before definition\n",
+              filename.c_str(), (unsigned long) strid);
+        addDumpCounterDef(state, state.keys.size(), strings[strid]);
+      }
+      break;
+
+    case TAG_MODULE:
+      {
+        size_t fileId = r.varint();
+        std::string name, buildid;
+        r.string(name);
+        r.varint();
+        int64_t start = r.varint();
+        int64_t end = r.varint();
+        r.string(buildid);
+        state.symbols->addRawModule(name, fileId, start, end, buildid);
+      }
+      break;
+
+    case TAG_NAME:
+      {
+        int64_t address = r.varint();
+        r.string(str);
+        state.symbols->addRawName(address, str);
+      }
+      break;
+
+    case TAG_NODE:
+    case TAG_RAWNODE:
+      {
+        depth += r.svarint();
+        uint64_t ref = r.varint();
+        SymbolInfo *sym = 0;
+        if (tag == TAG_RAWNODE)
+          sym = state.symbols->getRawSymbol(ref);
+        else if (ref < nsyms)
+          sym = state.symbols->getSymbol(ref);
+        else
+          die("%s: symbol %lu referenced before definition\n",
+              filename.c_str(), (unsigned long) ref);
+
+        NodeInfo *node = addDumpNode(state, depth - 1, sym);
+        if (! node)
+          die("%s: invalid stack depth %ld\n", filename.c_str(), (long) depth);
+
+        // Counters, each with its leaks.
+        for (uint64_t nctrs = r.varint(); nctrs; --nctrs)
+        {
+          size_t ctrId = r.varint();
+          int64_t ctrfreq = r.varint();
+          int64_t ctrvalNormal = r.varint();
+          int64_t ctrvalPeak = r.varint();
+          if (! addDumpCounter(state, node, ctrId, ctrfreq, ctrvalNormal, ctrvalPeak))
+            die("%s: counter %lu referenced before definition\n",
+                filename.c_str(), (unsigned long) ctrId);
+
+          // The number of leaks, then the leaks as size and address pairs.
+          for (uint64_t nleaks = r.varint(); nleaks; --nleaks)
+          {
+            int64_t leakSize = r.varint();
+            int64_t leakAddress = r.varint();
+            addDumpLeak(state, leakAddress, leakSize);
+          }
+          endDumpLeaks(state, node, ctrId);
+        }
+      }
+      break;
+
+    default:
+      die("%s: unknown record in binary dump\n", filename.c_str());
+    }
+  }
+}
+
+/** Reads the header of a binary dump: the magic "\x7fIGPROF", the
+    format version, the process id, the program name and the tick
+    period.  */
+void
+IgProfAnalyzerApplication::readBinaryHeader(BinaryDumpReader &r,
+                                            const std::string &filename)
+{
+  std::string str;
+  for (const char *magic = "\x7fIGPROF"; *magic; ++magic)
+    if (r.byte() != (unsigned char) *magic)
+      die("%s: not an igprof dump\n", filename.c_str());
+  if (r.varint() != 1)
+    die("%s: unsupported binary dump format version\n", filename.c_str());
+
+  r.varint();
+  r.string(str);
+  r.string(str);
+  m_tickPeriod = atof(str.c_str());
+}
 
-  ProfileInfo::Nodes      &nodes = prof->nodes();
+/** Reads the counters of a delta dump node, which replace the ones
+    read for @a node before.  Only the counters we report on are kept,
+    and their leaks only if we need them.  */
+void
+IgProfAnalyzerApplication::readDeltaCounters(DumpReadState &state,
+                                             BinaryDumpReader &r,
+                                             DeltaNode &node)
+{
+  bool keepLeaks = m_showPages || m_config->dumpAllocations || m_showPageRanges;
+  node.counters.clear();
+  for (uint64_t nctrs = r.varint(); nctrs; --nctrs)
+  {
+    DeltaCounter ctr;
+    ctr.id = r.varint();
+    ctr.freq = r.varint();
+    ctr.normal = r.varint();
+    ctr.peak = r.varint();
+    if (ctr.id >= state.keys.size())
+      die("counter %lu referenced before definition\n", (unsigned long) ctr.id);
+
+    bool keep = state.keys[ctr.id];
+    for (uint64_t nleaks = r.varint(); nleaks; --nleaks)
+    {
+      int64_t leakSize = r.varint();
+      int64_t leakAddress = r.varint();
+      if (keep && keepLeaks)
+        ctr.leaks.push_back(std::make_pair(leakAddress, leakSize));
+    }
 
+    if (keep)
+      node.counters.push_back(ctr);
+  }
+}
+
+/** Adds the nodes of a delta dump to the profile, as they were at the
+    last dump read.  Nodes of buffers which no longer existed at that
+    point are skipped: their data was merged into other buffers.  Node
+    ids are assigned in tree order, so parents precede their children.  */
+void
+IgProfAnalyzerApplication::addDeltaNodes(DumpReadState &state)
+{
+  std::vector<DeltaNode> &nodes = state.deltaNodes;
+  std::vector<NodeInfo *> added(nodes.size(), 0);
+  for (size_t i = 0, e = state.deltaRoots.size(); i != e; ++i)
+    added[state.deltaRoots[i]] = state.prof->spontaneous();
+
+  for (size_t id = 0, e = nodes.size(); id != e; ++id)
+  {
+    DeltaNode &node = nodes[id];
+    if (! node.sym || ! added[node.root])
+      continue;
+
+    NodeInfo *child = added[id] = addDumpChild(state, added[node.parent], node.sym);
+    for (size_t i = 0, ie = node.counters.size(); i != ie; ++i)
+    {
+      DeltaCounter &ctr = node.counters[i];
+      addDumpCounter(state, child, ctr.id, ctr.freq, ctr.normal, ctr.peak);
+      for (size_t l = 0, le = ctr.leaks.size(); l != le; ++l)
+        addDumpLeak(state, ctr.leaks[l].first, ctr.leaks[l].second);
+      endDumpLeaks(state, child, ctr.id);
+    }
+  }
+}
+
+/** Reads a text format dump from @a inFile.  */
+void
+IgProfAnalyzerApplication::readTextDump(DumpReadState &state,
+                                        FILE *inFile,
+                                        const std::string &filename)
+{
+  SymbolInfoFactory &symbolsFactory = *state.symbols;
   int base = 10;
-  bool isPipe = false;
-  FILE *inFile = openDump(filename.c_str(), isPipe);
   IgTokenizer t(inFile, filename.c_str());
-  verboseMessage("Parsing igprof output file", filename.c_str());
 
   // Parse the header line, which has form:
   // ^P=\(ID=[0-9]* N=\(.*\) T=[0-9]+.[0-9]*\)
@@ -2491,24 +3351,43 @@ IgProfAnalyzerApplication::readDump(ProfileInfo *prof,
   m_tickPeriod = t.getTokenD(')');
   t.skipEol();
 
-  SymbolInfoFactory symbolsFactory(prof, m_config->useGdb);
-
-  // A vector whose i-th element specifies whether or
-  // not the counter file id "i" is a key.
-  std::vector<bool> keys;
-
-  // A vector keeping track of all the pages touched by the
-  // allocations. We store here the address of the page,
-  // in order to improve lookup whether or not a page is
-  // already there. This way the total number of pages
-  // touched is given by "count".
-  std::vector<RangeInfo> ranges;
-  ranges.reserve(20000);
-
   // String to hold the name of the function.
   std::string fn;
   std::string ctrname;
 
+  // Raw address dumps list the loaded objects, as lines of form
+  // "M<id>=(<name>) B=<bias> S=<start> E=<end> I=(<build-id>)", and
+  // the names of synthetic frames, "N<address>=(<name>)".
+  std::string buildid;
+  while (t.nextChar() == 'M' || t.nextChar() == 'N')
+  {
+    if (t.nextChar() == 'M')
+    {
+      t.skipChar('M');
+      size_t fileId = t.getTokenN('=', base);
+      t.skipChar('(');
+      t.getTokenS(fn, ')');
+      t.skipString(" B=", 3);
+      t.getTokenN(' ', base);
+      t.skipString("S=", 2);
+      int64_t start = t.getTokenN(' ', base);
+      t.skipString("E=", 2);
+      int64_t end = t.getTokenN(' ', base);
+      t.skipString("I=(", 3);
+      t.getTokenS(buildid, ')');
+      symbolsFactory.addRawModule(fn, fileId, start, end, buildid);
+    }
+    else
+    {
+      t.skipChar('N');
+      int64_t address = t.getTokenN('=', base);
+      t.skipChar('(');
+      t.getTokenS(fn, ')');
+      symbolsFactory.addRawName(address, fn);
+    }
+    t.skipEol();
+  }
+
   // One node per line.
   while (! feof(inFile))
   {
@@ -2522,86 +3401,71 @@ IgProfAnalyzerApplication::readDump(ProfileInfo *prof,
     if (newPosition < 0)
       t.syntaxError();
 
-    int64_t stackSize = nodestack.size();
-    if (newPosition > stackSize)
-      die("Internal error on line %d", t.lineNum());
-
-    int64_t difference = newPosition - stackSize;
-    if (difference > 0)
-      nodestack.resize(newPosition);
-    else
-      nodestack.erase(nodestack.begin() + newPosition, nodestack.end());
-
     // Find out the information about the current stack line.
     SymbolInfo *sym = 0;
 
-    // Match either a function reference "FN[0-9]" followed by = or +.
-    t.skipString("FN", 2);
-    int64_t symid = t.getTokenN("+=", base);
-
-    // If this is previously unseen symbol, parse full definition.
-    // Otherwise look up the previously recorded symbol object.
-    if (t.nextChar() == '=')
+    // Raw address dumps give the call address, "A[0-9a-f]+".
+    if (t.nextChar() == 'A')
     {
-      // Match file reference "=\(F(\d+)\+(-?\d+) N=\((.*?)\)\)\+\d+\s*\)"
-      // or definition "=\(F(\d+)=\((.*?)\)\+(-?\d+) N=\((.*?)\)\)\+\d+\s*\)"
-      // and create a symbol info accordingly.
-      t.skipString("=(F");
-      FileInfo *fileinfo = 0;
-      std::string symname;
-      size_t fileId = t.getTokenN("+=", base);
+      t.skipChar('A');
+      sym = symbolsFactory.getRawSymbol(t.getTokenN(" \n", base));
+    }
+    else
+    {
+      // Match either a function reference "FN[0-9]" followed by = or +.
+      t.skipString("FN", 2);
+      int64_t symid = t.getTokenN("+=", base);
 
-      // If we are looking at a new file definition, get file name.
-      // Otherwise retrieve the previously recorded file object.
+      // If this is previously unseen symbol, parse full definition.
+      // Otherwise look up the previously recorded symbol object.
       if (t.nextChar() == '=')
       {
-        t.skipString("=(", 2);
-        t.getTokenS(fn, ')');
-        fileinfo = symbolsFactory.createFileInfo(fn, fileId);
-      }
-      else
-        fileinfo = symbolsFactory.getFile(fileId);
+        // Match file reference "=\(F(\d+)\+(-?\d+) N=\((.*?)\)\)\+\d+\s*\)"
+        // or definition "=\(F(\d+)=\((.*?)\)\+(-?\d+) N=\((.*?)\)\)\+\d+\s*\)"
+        // and create a symbol info accordingly.
+        t.skipString("=(F");
+        FileInfo *fileinfo = 0;
+        std::string symname;
+        size_t fileId = t.getTokenN("+=", base);
+
+        // If we are looking at a new file definition, get file name.
+        // Otherwise retrieve the previously recorded file object.
+        if (t.nextChar() == '=')
+        {
+          t.skipString("=(", 2);
+          t.getTokenS(fn, ')');
+          fileinfo = symbolsFactory.createFileInfo(fn, fileId);
+        }
+        else
+          fileinfo = symbolsFactory.getFile(fileId);
 
-      // Get the file offset.
-      t.skipChar('+');
-      int64_t fileoff = t.getTokenN(' ', base);
+        // Get the file offset.
+        t.skipChar('+');
+        int64_t fileoff = t.getTokenN(' ', base);
 
-      // Read the symbol name and offset.
-      t.skipString("N=(", 3);
-      t.getTokenS(symname, ')');
-      if (symname == "@?(nil")
-      {
-        symname = "@?(nil)";
+        // Read the symbol name and offset.
+        t.skipString("N=(", 3);
+        t.getTokenS(symname, ')');
+        if (symname == "@?(nil")
+        {
+          symname = "@?(nil)";
+          t.skipChar(')');
+        }
+
+        sym = symbolsFactory.createSymbolInfo(symname, fileoff, fileinfo, symid);
         t.skipChar(')');
       }
+      else if (! (sym = symbolsFactory.getSymbol(symid)))
+        die("symbol %" PRId64 " referenced before definition\n", symid);
 
-      sym = symbolsFactory.createSymbolInfo(symname, fileoff, fileinfo, symid);
-      t.skipChar(')');
-    }
-    else if (! (sym = symbolsFactory.getSymbol(symid)))
-      die("symbol %" PRId64 " referenced before definition\n", symid);
-
-    // Skip unused symbol offset.
-    t.skipChar('+');
-    t.getTokenN(" \n", base);
-
-    // Process this stack node.
-    NodeInfo *parent = nodestack.empty() ? prof->spontaneous() : nodestack.back();
-    NodeInfo *child = parent ? parent->getChildrenBySymbol(sym) : 0;
-
-    if (!child)
-    {
-      // Nodes are allocated in a deque, to maximize locality
-      // and reduce the actual number of allocations.
-      m_nodesStorage.resize(m_nodesStorage.size() + 1);
-      child = &(m_nodesStorage.back());
-      child->setSymbol(sym);
-      nodes.push_back(child);
-      if (parent)
-        parent->CHILDREN.push_back(child);
+      // Skip unused symbol offset.
+      t.skipChar('+');
+      t.getTokenN(" \n", base);
     }
 
-    nodestack.push_back(child);
+    NodeInfo *child = addDumpNode(state, newPosition, sym);
+    if (! child)
+      die("Internal error on line %d", t.lineNum());
 
     // Parse counters, possibly with leaks attached.
     while (t.nextChar() != '\n')
@@ -2616,16 +3480,7 @@ IgProfAnalyzerApplication::readDump(ProfileInfo *prof,
         // Get the counter name.
         t.skipString("=(", 2);
         t.getTokenS(ctrname, ')');
-
-        // The first counter we meet, we make it the key, unless
-        // the key was already set on command line.
-        if (m_key.empty())
-          setKey(ctrname);
-
-        // Store information about ctrId being a key or not.
-        if (keys.size() <= ctrId)
-          keys.resize(ctrId + 1, false);
-        keys[ctrId] = (ctrname == m_key);
+        addDumpCounterDef(state, ctrId, ctrname);
       }
 
       // Get the counter counts.
@@ -2633,23 +3488,12 @@ IgProfAnalyzerApplication::readDump(ProfileInfo *prof,
       int64_t ctrfreq = t.getTokenN(',', base);
       int64_t ctrvalNormal = t.getTokenN(',', base);
       int64_t ctrvalPeak = t.getTokenN(')', base);
-
-      // Record if we are interested in something related to this counter.
-      if (keys[ctrId])
-      {
-        int64_t ctrval = m_config->normalValue() ? ctrvalNormal : ctrvalPeak;
-
-        if (filter)
-          filter->filter(sym, ctrval, ctrfreq);
-
-        child->COUNTER.cnt += ctrval;
-        child->COUNTER.freq += ctrfreq;
-      }
+      if (! addDumpCounter(state, child, ctrId, ctrfreq, ctrvalNormal, ctrvalPeak))
+        t.syntaxError();
 
       // Parse leaks of the form ;LK=\(0x[\da-f]+,\d+)* if any.
       // Theoretically the format allows leaks per counter, but
       // we only support leaks for one counter at a time.
-      ranges.clear();
       while (t.nextChar() == ';')
       {
         t.skipString(";LK=(0x", 7);
@@ -2657,49 +3501,15 @@ IgProfAnalyzerApplication::readDump(ProfileInfo *prof,
         // Get the leak address and size.
         int64_t leakAddress = t.getTokenN(',', 16);
         int64_t leakSize = t.getTokenN(')', base);
-
-        // In the case we specify one of the --show-pages --show-page-ranges
-        // or --show-locality-metrics options, we keep track
-        // of the page ranges that are referenced by all the allocations
-        // (LK counters in the report).
-        //
-        // We first fill a vector with all the ranges, then we sort it later on
-        // collapsing all the adjacent ranges.
-        if (m_showPages  || m_config->dumpAllocations || m_showPageRanges)
-        {
-          assert(leakSize > 0);
-          ranges.push_back(RangeInfo(leakAddress, (leakAddress + leakSize + 1)));
-          RangeInfo &range = ranges.back();
-          if (m_showPages || m_showPageRanges)
-          {
-            range.startAddr = range.startAddr >> 12;
-            range.endAddr = range.endAddr >> 12;
-          }
-          assert(range.size() > 0);
-        }
+        addDumpLeak(state, leakAddress, leakSize);
       }
 
-      // Sort the leak ranges and collapse them.
-      if (! ranges.empty() && keys[ctrId])
-      {
-        std::sort(ranges.begin(), ranges.end());
-        mergeSortedRanges(ranges);
-        mergeRanges(child->RANGES, ranges);
-      }
+      endDumpLeaks(state, child, ctrId);
     }
 
     // We should be looking at end of line now.
     t.skipEol();
   }
-
-  if (isPipe)
-    pclose(inFile);
-  else
-    fclose(inFile);
-
-  verboseMessage(0, 0, " done\n");
-  if (keys.empty())
-    die("No counter values in profile data.");
 }
 
 struct StackItem
@@ -2786,6 +3596,13 @@ IgProfAnalyzerApplication::prepdata(ProfileInfo& prof)
     verboseMessage(0, 0, " done\n");
   }
 
+  if (m_config->threadGroups())
+  {
+    verboseMessage("Merge threads by thread group");
+    walk(prof.spontaneous(), m_nodesStorage.size(), new ThreadGroupFilter(m_keyMax));
+    verboseMessage(0, 0, " done\n");
+  }
+
   if (m_config->mergeLibraries())
   {
     //    walk<NodeInfo>(prof.spontaneous(), new PrintTreeFilter);
@@ -4183,6 +5000,8 @@ IgProfAnalyzerApplication::parseArgs(const ArgsList &args)
     }
     else if (is("--merge-libraries", "-ml"))
       m_config->setMergeLibraries(true);
+    else if (is("--thread-groups", "-tg"))
+      m_config->setThreadGroups(true);
     else if (is("--order", "-o"))
     {
       std::string order = *(arg++);
@@ -4211,6 +5030,8 @@ IgProfAnalyzerApplication::parseArgs(const ArgsList &args)
       m_config->setOutputType(Configuration::SQLITE);
     else if (is("--top", "-tn"))
       m_topN = parseOptionToInt(*(++arg), "--top / -tn");
+    else if (is("--delta-dump") && left(arg))
+      m_deltaDump = parseOptionToInt(*(++arg), "--delta-dump");
     else if (is("--tree", "-T"))
       m_config->tree = true;
     else if (is("--demangle", "-d"))
@@ -0,0 +1,118 @@
+// Microbenchmark for the stack frame child index in IgProfTrace.
+//
+// Times IgProfTrace::push() of short stacks which miss the call cache
+// at a frame with N children scattered over the profile pool, for a
+// range of N.  This is the lookup done under event loops and other
+// dispatcher frames.  Not part of the build; compile it on its own:
+//
+//   g++ -O2 -D_GNU_SOURCE -D__STDC_FORMAT_MACROS -D__STDC_LIMIT_MACROS
+//     -o bench-child-index src/bench-child-index.cc src/profile-trace.cc
+//     src/buffer.cc -lpthread -lrt
+//
+// To time plain sibling list lookups instead, for finding where the
+// index starts to pay off, raise IgProfTrace::CHILD_INDEX_MIN above
+// the largest N and rebuild.
+#include "profile.h"
+#include "profile-trace.h"
+#include <cstdlib>
+#include <cstdio>
+#include <cstdarg>
+#include <time.h>
+
+// Stand-ins for the profiler core used by the trace buffer.
+static void benchAbort(void) __attribute__((noreturn));
+static void benchAbort(void) { abort(); }
+HIDDEN void             (*igprof_abort)(void) __attribute__((noreturn)) = &benchAbort;
+HIDDEN char *           (*igprof_getenv)(const char *) = &getenv;
+HIDDEN int              (*igprof_unsetenv)(const char *) = &unsetenv;
+HIDDEN bool             s_igprof_activated = false;
+HIDDEN IgProfAtomic     s_igprof_enabled = 0;
+HIDDEN THREAD_LOCAL IgProfTrace *s_igprof_buffer INITIAL_EXEC = 0;
+HIDDEN THREAD_LOCAL volatile int s_igprof_flag INITIAL_EXEC = IGPROF_NO_THREAD;
+HIDDEN THREAD_LOCAL IgProfThread *s_igprof_thread INITIAL_EXEC = 0;
+HIDDEN void             *s_igprof_phase = 0;
+HIDDEN bool             s_igprof_threadframes = false;
+HIDDEN void             *s_igprof_overflow = 0;
+
+void
+igprof_debug(const char *format, ...)
+{
+  if (getenv("IGPROF_DEBUGGING"))
+  {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+  }
+}
+
+int
+igprof_panic(const char *file, int line, const char *func, const char *expr)
+{
+  fprintf(stderr, "%s:%d: %s: assertion failure: %s\n", file, line, func, expr);
+  abort();
+}
+
+/** Return the monotonic clock in nanoseconds.  */
+static double
+now(void)
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+int
+main(void)
+{
+  // Several dispatcher frames, so their children do not all stay in
+  // the first level cache.
+  static const int NPARENTS = 8;
+  static const int NCHILDREN[] = { 2, 4, 8, 12, 16, 24, 32, 64,
+                                   256, 1024, 4096, 16384 };
+  static IgProfTrace::CounterDef def = { "BENCH", IgProfTrace::TICK, -1, 0, 0 };
+
+  for (size_t n = 0; n < sizeof(NCHILDREN) / sizeof(NCHILDREN[0]); ++n)
+  {
+    int nkids = NCHILDREN[n];
+    int npush = nkids > 64 ? 256000000 / nkids : 4000000;
+    IgProfTrace *buf = new IgProfTrace;
+    void **kids = new void *[nkids];
+    int *seq = new int[2 * npush];
+
+    for (int i = 0; i < nkids; ++i)
+      kids[i] = (void *) (0x400000L + 16L * (random() % (1000L * nkids)));
+
+    // Create the children in an order which scatters them in the pool.
+    for (int i = 0; i < nkids * NPARENTS; ++i)
+    {
+      void *stack[3] = { kids[(i / NPARENTS * 7919L) % nkids],
+                         (void *) (0x1000L + (i % NPARENTS) * 8),
+                         (void *) 0x100 };
+      buf->tick(buf->push(stack, 3, false), &def, 1, 1);
+    }
+
+    for (int i = 0; i < npush; ++i)
+    {
+      seq[2*i] = random() % nkids;
+      seq[2*i+1] = random() % NPARENTS;
+    }
+
+    double start = now();
+    for (int i = 0; i < npush; ++i)
+    {
+      void *stack[3] = { kids[seq[2*i]],
+                         (void *) (0x1000L + seq[2*i+1] * 8),
+                         (void *) 0x100 };
+      buf->tick(buf->push(stack, 3, false), &def, 1, 1);
+    }
+    double end = now();
+
+    printf("%6d children: %8.1f ns per push\n", nkids, (end - start) / npush);
+    delete [] seq;
+    delete [] kids;
+    delete buf;
+  }
+
+  return 0;
+}
@@ -0,0 +1,142 @@
+// Microbenchmark for backing profile buffers with huge pages.
+//
+// Fills a trace buffer with 1M distinct 24 frame stacks and 1M live
+// resources, about 800 MB, then times events on stacks picked at
+// random: a push, a tick, a release and an acquire per event, as the
+// memory profiler does for a realloc.  The walk over the stack tree
+// and the resource hash misses the TLB on nearly every step with
+// normal pages.  Not part of the build; compile it on its own:
+//
+//   g++ -O2 -D_GNU_SOURCE -D__STDC_FORMAT_MACROS -D__STDC_LIMIT_MACROS
+//     -o bench-huge-pages src/bench-huge-pages.cc src/profile-trace.cc
+//     src/buffer.cc -lpthread -lrt
+//
+// Run it as "bench-huge-pages [none|thp|hugetlb]".  Build it with
+// -DIGPROF_COMPACT_TRACE=1 to time the compact trace buffer instead.
+#include "profile.h"
+#include "profile-trace.h"
+#include <cstdlib>
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <time.h>
+
+// Stand-ins for the profiler core used by the trace buffer.
+static void benchAbort(void) __attribute__((noreturn));
+static void benchAbort(void) { abort(); }
+HIDDEN void             (*igprof_abort)(void) __attribute__((noreturn)) = &benchAbort;
+HIDDEN char *           (*igprof_getenv)(const char *) = &getenv;
+HIDDEN int              (*igprof_unsetenv)(const char *) = &unsetenv;
+HIDDEN bool             s_igprof_activated = false;
+HIDDEN IgProfAtomic     s_igprof_enabled = 0;
+HIDDEN THREAD_LOCAL IgProfTrace *s_igprof_buffer INITIAL_EXEC = 0;
+HIDDEN THREAD_LOCAL volatile int s_igprof_flag INITIAL_EXEC = IGPROF_NO_THREAD;
+HIDDEN THREAD_LOCAL IgProfThread *s_igprof_thread INITIAL_EXEC = 0;
+HIDDEN void             *s_igprof_phase = 0;
+HIDDEN bool             s_igprof_threadframes = false;
+HIDDEN void             *s_igprof_overflow = 0;
+
+void
+igprof_debug(const char *format, ...)
+{
+  if (getenv("IGPROF_DEBUGGING"))
+  {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+  }
+}
+
+int
+igprof_panic(const char *file, int line, const char *func, const char *expr)
+{
+  fprintf(stderr, "%s:%d: %s: assertion failure: %s\n", file, line, func, expr);
+  abort();
+}
+
+/** Return the monotonic clock in nanoseconds.  */
+static double
+now(void)
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/** Fill @a stack with @a depth frames derived from @a seed.  The outer
+    frames fan out little and the inner ones more, so the stacks share
+    prefixes the way real call trees do.  */
+static void
+makeStack(void **stack, int depth, unsigned long seed)
+{
+  for (int i = 0; i < depth; ++i)
+  {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    stack[i] = (void *) (0x400000L + 16L * ((seed >> 33) % (i < 12 ? 2 : 8)));
+  }
+}
+
+/** Return the anonymous huge page memory of this process in kB.  */
+static unsigned long
+hugePageMemory(void)
+{
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  unsigned long kb = 0;
+  char line[256];
+
+  while (f && fgets(line, sizeof(line), f))
+    if (! strncmp(line, "AnonHugePages:", 14))
+      kb = strtoul(line + 14, 0, 10);
+
+  if (f)
+    fclose(f);
+  return kb;
+}
+
+int
+main(int argc, char **argv)
+{
+  static const int NSTACKS = 1000000;
+  static const int DEPTH = 24;
+  static const int NEVENTS = 2000000;
+  static const unsigned long ADDRESS = 0x10000000UL;
+  static IgProfTrace::CounterDef def = { "BENCH", IgProfTrace::TICK, -1, 0, 0 };
+  const char *mode = argc > 1 ? argv[1] : "none";
+  void *stack[DEPTH];
+
+  if (! strcmp(mode, "thp"))
+    IgProfBuffer::setHugePages(IgProfBuffer::HUGE_PAGES_THP);
+  else if (! strcmp(mode, "hugetlb"))
+    IgProfBuffer::setHugePages(IgProfBuffer::HUGE_PAGES_HUGETLB);
+  else if (strcmp(mode, "none"))
+  {
+    fprintf(stderr, "usage: %s [none|thp|hugetlb]\n", argv[0]);
+    return 1;
+  }
+
+  IgProfTrace *buf = new IgProfTrace;
+  for (int i = 0; i < NSTACKS; ++i)
+  {
+    makeStack(stack, DEPTH, i);
+    buf->acquire(buf->tick(buf->push(stack, DEPTH, false), &def, 64, 1),
+                 ADDRESS + 64UL * i, 64);
+  }
+
+  double start = now();
+  for (int i = 0; i < NEVENTS; ++i)
+  {
+    unsigned long n = (i * 2654435761UL) % NSTACKS;
+    makeStack(stack, DEPTH, n);
+    IgProfTrace::Counter *ctr = buf->tick(buf->push(stack, DEPTH, false), &def, 64, 1);
+    buf->release(ADDRESS + 64UL * n);
+    buf->acquire(ctr, ADDRESS + 64UL * n, 64);
+  }
+  double end = now();
+
+  printf("%s: %lu MB used, %lu MB in huge pages, %.1f ns per event\n",
+         mode, (unsigned long) (IgProfBuffer::memoryUsed() >> 20),
+         hugePageMemory() >> 10, (end - start) / NEVENTS);
+  delete buf;
+  return 0;
+}
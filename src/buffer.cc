@@ -7,14 +7,23 @@
 # define MAP_ANONYMOUS MAP_ANON
 #endif
 
-static const unsigned int MEM_POOL_SIZE = 8*1024*1024;
+static int s_hugepages = IgProfBuffer::HUGE_PAGES_NONE;
+
+size_t IgProfBuffer::s_memlimit = 0;
+volatile size_t IgProfBuffer::s_memused = 0;
 
 /** Initialise a buffer.  */
 IgProfBuffer::IgProfBuffer(void)
   : poolfirst_(0),
     poolcur_(0),
     freestart_(0),
-    freeend_(0)
+    freeend_(0),
+    poolused_(0),
+    npools_(0),
+    full_(false)
+#if IGPROF_COMPACT_TRACE
+  , pooltable_(0)
+#endif
 {
   initPool();
 }
@@ -22,19 +31,27 @@ IgProfBuffer::IgProfBuffer(void)
 IgProfBuffer::~IgProfBuffer(void)
 {
   freePools();
+#if IGPROF_COMPACT_TRACE
+  unallocateRaw(pooltable_, MAX_POOLS * sizeof(char *));
+#endif
 }
 
 void
 IgProfBuffer::initPool(void)
 {
-  // Get the first pool and initialise the chain pointer to null.
-  void *pool = allocateRaw(MEM_POOL_SIZE);
-  poolfirst_ = poolcur_ = (void **) pool;
-  *poolfirst_ = 0;
-
-  // Mark the rest free.
-  freestart_ = (char *) pool + sizeof(void **);
-  freeend_ = (char *) pool + MEM_POOL_SIZE;
+  // Get the first pool, without which the buffer is of no use.
+#if IGPROF_COMPACT_TRACE
+  if (! pooltable_
+      && ! (pooltable_ = (char **) allocateRaw(MAX_POOLS * sizeof(char *))))
+    igprof_abort();
+#endif
+  npools_ = 0;
+  full_ = false;
+  void **pool = allocatePoolMemory();
+  if (! pool)
+    igprof_abort();
+  poolfirst_ = poolcur_ = pool;
+  freestart_ = freeend_ = (char *) pool + POOL_HEADER;
 }
 
 void
@@ -44,9 +61,18 @@ IgProfBuffer::freePools(void)
   while (p)
   {
     void **next = (void **) *p;
-    munmap(p, MEM_POOL_SIZE);
+    unallocateRaw(p, MEM_POOL_SIZE);
     p = next;
   }
+  trackMemory(-long(poolused_));
+  poolused_ = 0;
+}
+
+/** Return the amount of memory in the pools of this buffer.  */
+size_t
+IgProfBuffer::poolMemory(void) const
+{
+  return npools_ * MEM_POOL_SIZE;
 }
 
 void
@@ -55,38 +81,209 @@ IgProfBuffer::unallocateRaw(void *p, size_t size)
   munmap(p, size);
 }
 
+/** Select whether to back large buffer memory with huge pages.
+    #HUGE_PAGES_THP asks the kernel for transparent huge pages, which
+    it provides if it has them to spare.  #HUGE_PAGES_HUGETLB maps
+    explicitly reserved huge pages, falling back to transparent huge
+    pages once the reserve is exhausted.  Only applies to memory
+    allocated after the call.  */
+void
+IgProfBuffer::setHugePages(int mode)
+{
+  s_hugepages = mode;
+}
+
+/** Limit the memory used by all buffers together to @a bytes, or
+    remove the limit if zero.  */
+void
+IgProfBuffer::setMemoryLimit(size_t bytes)
+{
+  s_memlimit = bytes;
+}
+
+/** Return the memory currently used by all buffers together.  */
+size_t
+IgProfBuffer::memoryUsed(void)
+{
+  return s_memused;
+}
+
+/** Count @a bytes more, or less if negative, as used by the buffers.  */
+void
+IgProfBuffer::trackMemory(long bytes)
+{
+  size_t used = __sync_add_and_fetch(&s_memused, bytes);
+  if (s_memlimit && bytes > 0 && used >= s_memlimit
+      && used - bytes < s_memlimit)
+    igprof_debug("profile buffers reached the memory limit of %lu MB,"
+		 " recording new data in less detail\n",
+		 (unsigned long) (s_memlimit >> 20));
+}
+
+/** Map @a size bytes backed by huge pages as selected with
+    #setHugePages().  Returns MAP_FAILED if huge pages are not in use
+    or the allocation is too small for them, and on failure to map
+    them, in which case the caller should use normal pages.  */
+void *
+IgProfBuffer::allocateHuge(size_t size)
+{
+  void *data = MAP_FAILED;
+#if __linux
+  if (s_hugepages == HUGE_PAGES_NONE || size < HUGE_PAGE_SIZE)
+    return MAP_FAILED;
+
+# ifdef MAP_HUGETLB
+  if (s_hugepages == HUGE_PAGES_HUGETLB && ! (size & (HUGE_PAGE_SIZE-1)))
+  {
+    data = mmap(0, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data != MAP_FAILED)
+      return data;
+
+    igprof_debug("no huge pages reserved for profile buffer: %s (%d),"
+		 " using transparent huge pages\n", strerror(errno), errno);
+    s_hugepages = HUGE_PAGES_THP;
+  }
+# endif
+
+# ifdef MADV_HUGEPAGE
+  // Huge pages only cover naturally aligned ranges, so align the
+  // mapping: get one huge page more and trim the excess.
+  char *raw = (char *) mmap(0, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED)
+    return MAP_FAILED;
+
+  char *start = (char *) (((uintptr_t) raw + HUGE_PAGE_SIZE - 1)
+			  & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+  if (start > raw)
+    munmap(raw, start - raw);
+  munmap(start + size, raw + HUGE_PAGE_SIZE - start);
+
+  if (madvise(start, size, MADV_HUGEPAGE) < 0)
+  {
+    igprof_debug("transparent huge pages not available: %s (%d)\n",
+		 strerror(errno), errno);
+    s_hugepages = HUGE_PAGES_NONE;
+  }
+  data = start;
+# endif
+#else
+  (void) size;
+#endif
+  return data;
+}
+
+/** Map @a size bytes of zeroed memory.  Returns null if there is no
+    memory to be had.  */
 void *
 IgProfBuffer::allocateRaw(size_t size)
 {
-  void *data = mmap(0, size, PROT_READ | PROT_WRITE,
-		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  void *data = allocateHuge(size);
+  if (data == MAP_FAILED)
+    data = mmap(0, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   if (data != MAP_FAILED)
     return data;
-  else
+
+  igprof_debug("failed to allocate memory for profile buffer: %s (%d)\n",
+	       strerror(errno), errno);
+  return 0;
+}
+
+/** Mark the buffer full, see #overMemoryLimit().  */
+void
+IgProfBuffer::setFull(void)
+{
+  if (! full_)
+    igprof_debug("profile buffer %p is full, recording new data"
+		 " in less detail\n", (void *) this);
+  full_ = true;
+}
+
+/** Make room for @a amount bytes in the free space.  Extends the free
+    space a chunk at a time to the end of the current pool, counting
+    the memory as used as it goes, and moves to the next pool once the
+    current one is full.  The next pool is obtained once the current
+    one is down to its reserve.  If the buffer is full and its reserve
+    is used up too, gives up and aborts.  */
+void
+IgProfBuffer::growSpace(size_t amount)
+{
+  char *poolend = (char *) poolcur_ + MEM_POOL_SIZE;
+  if (! *poolcur_ && ! full_
+      && size_t(poolend - freestart_) < amount + POOL_RESERVE)
+    allocatePool();
+
+  if (size_t(poolend - freestart_) < amount)
   {
-    igprof_debug("failed to allocate memory for profile buffer: %s (%d)\n",
-                 strerror(errno), errno);
-    igprof_abort();
+    if (! *poolcur_)
+    {
+      igprof_debug("profile buffer %p ran out of memory\n", (void *) this);
+      igprof_abort();
+    }
+
+    poolcur_ = (void **) *poolcur_;
+    poolend = (char *) poolcur_ + MEM_POOL_SIZE;
+    freestart_ = freeend_ = (char *) poolcur_ + POOL_HEADER;
   }
+
+  char *end = freeend_;
+  while (size_t(end - freestart_) < amount)
+    end = (size_t(poolend - end) > MEM_CHUNK_SIZE
+	   ? end + MEM_CHUNK_SIZE : poolend);
+
+  poolused_ += end - freeend_;
+  trackMemory(end - freeend_);
+  freeend_ = end;
 }
 
+/** Get the next pool and chain it after the current one, which is
+    the last one.  Marks the buffer full if there is none to be had.  */
 void
 IgProfBuffer::allocatePool(void)
 {
-  // Get a pool.  If we don't have any pools yet, make this the first
-  // one.  If we have an existing pool, chain the new one into the
-  // last one.  Then make this the current and last pool and mark the
-  // memory free.  Note the pool memory is allocated all-zeroes.
-  void **pool = (void **) allocateRaw(MEM_POOL_SIZE);
+  if (void **pool = allocatePoolMemory())
+    *poolcur_ = pool;
+  else
+    setFull();
+}
 
-  if (! poolfirst_)
-    poolfirst_ = pool;
+/** Get memory for a new pool and fill in the header: the chain
+    pointer to the next pool, null as the memory is allocated zeroed,
+    and in compact builds the pool number.  The pool memory is marked
+    free only as #growSpace() counts it as used.  Compact builds align
+    the pool to its size.  Returns null if no more pools can be had.  */
+void **
+IgProfBuffer::allocatePoolMemory(void)
+{
+#if IGPROF_COMPACT_TRACE
+  if (npools_ == MAX_POOLS)
+  {
+    igprof_debug("profile buffer %p has used all %u pools\n",
+		 (void *) this, MAX_POOLS);
+    return 0;
+  }
 
-  if (poolcur_)
-    *poolcur_ = pool;
+  // Map twice the pool size and trim to an aligned pool.
+  char *data = (char *) allocateRaw(2 * MEM_POOL_SIZE);
+  if (! data)
+    return 0;
+
+  char *pool = (char *) (((uintptr_t) data + MEM_POOL_SIZE - 1)
+			 & ~(uintptr_t) (MEM_POOL_SIZE - 1));
+  if (pool > data)
+    unallocateRaw(data, pool - data);
+  unallocateRaw(pool + MEM_POOL_SIZE, data + MEM_POOL_SIZE - pool);
 
-  poolcur_ = pool;
+  pooltable_[npools_] = pool;
+  ((uintptr_t *) pool)[1] = npools_;
+#else
+  char *pool = (char *) allocateRaw(MEM_POOL_SIZE);
+  if (! pool)
+    return 0;
+#endif
 
-  freestart_ = (char *) pool + sizeof(void **);
-  freeend_ = (char *) pool + MEM_POOL_SIZE;
+  ++npools_;
+  return (void **) pool;
 }
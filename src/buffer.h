@@ -6,22 +6,110 @@
 # include <stdlib.h>
 # include <stdint.h>
 
-/** Utility class for implementing private heap and hashed data structures.  */
+/** Utility class for implementing private heap and hashed data structures.
+
+    Objects carved out of the pools refer to each other with #Ref
+    values.  Normally these are plain pointers.  When built with
+    IGPROF_COMPACT_TRACE they are 32-bit references holding the pool
+    number and the offset in the pool in eight byte units, which makes
+    the linked structures considerably smaller.  The pools are then
+    aligned to their size so a pointer can be turned back into a
+    reference without searching the pools, and a buffer can have at
+    most MAX_POOLS pools.
+
+    The pools and other large allocations can be backed by huge pages
+    to cut down TLB misses when walking big profiles, see
+    #setHugePages().
+
+    The memory of all buffers together can be limited with
+    #setMemoryLimit().  The limit applies to the memory actually used,
+    not to the pools and hash tables mapped ahead of use: pool memory
+    counts as it is carved out, and hash tables count their entries in
+    use with #trackEntries().  Allocation never fails because of the
+    limit: users are expected to check #overMemoryLimit() and stop
+    growing their data structures.
+
+    A buffer which cannot get any more memory, because the system is
+    out of it or a compact buffer has used all its pools, is marked
+    full and from then on counts as over the memory limit.  Pools are
+    obtained ahead of time while the current one still has a reserve
+    of #POOL_RESERVE bytes left, which then remains for recording new
+    data in reduced detail.  */
 class HIDDEN IgProfBuffer
 {
+public:
+  /// Huge page use, see #setHugePages().
+  enum { HUGE_PAGES_NONE, HUGE_PAGES_THP, HUGE_PAGES_HUGETLB };
+
+  static void setHugePages(int mode);
+  static void setMemoryLimit(size_t bytes);
+  static size_t memoryUsed(void);
+  static void trackMemory(long bytes);
+  static void unallocateRaw(void *p, size_t size);
+  static void *allocateRaw(size_t size);
+
+  /// Number of hash table entries counted as used at a time.
+  static const size_t TRACK_ENTRIES = 4096;
+
+  /// Count hash table entries of @a size bytes as used memory, given
+  /// the number of @a used entries just after adding one, or just
+  /// before removing one if @a added is false.  Counts whole batches
+  /// of #TRACK_ENTRIES entries to keep it off the fast path.
+  static void trackEntries(size_t used, size_t size, bool added)
+    {
+      if (UNLIKELY(! (used & (TRACK_ENTRIES-1))))
+	trackMemory(long(TRACK_ENTRIES * size) * (added ? 1 : -1));
+    }
+
+  /// Memory counted as used for @a used hash table entries of @a size.
+  static long trackedEntries(size_t used, size_t size)
+    { return long((used & ~(TRACK_ENTRIES-1)) * size); }
+
 protected:
   IgProfBuffer(void);
   ~IgProfBuffer(void);
 
+  /// Size of each memory pool.
+  static const unsigned int MEM_POOL_SIZE = 8*1024*1024;
+
+  /// Amount of pool memory counted as used at a time.
+  static const unsigned int MEM_CHUNK_SIZE = 256*1024;
+
+  /// Pool space left when the next pool is obtained, kept in reserve
+  /// in case there is none to be had.
+  static const unsigned int POOL_RESERVE = 1024*1024;
+
+  /// Size of huge pages, the smallest allocation backed by them.
+  static const unsigned int HUGE_PAGE_SIZE = 2*1024*1024;
+
+#if IGPROF_COMPACT_TRACE
+  /// Maximum number of pools in a buffer.
+  static const unsigned int MAX_POOLS = 4096;
+
+  /// Number of bits for the pool offset in a reference.
+  static const unsigned int REF_OFFSET_BITS = 20;
+
+  /// Reference to an object in the pools, zero for none.
+  typedef uint32_t Ref;
+
+  /// Size of the pool header: the chain pointer and the pool number.
+  static const unsigned int POOL_HEADER = 2*sizeof(void *);
+#else
+  /// Reference to an object in the pools, null for none.
+  typedef void *Ref;
+
+  /// Size of the pool header: the chain pointer.
+  static const unsigned int POOL_HEADER = sizeof(void *);
+#endif
+
 protected:
   void initPool(void);
   void freePools(void);
-  void unallocateRaw(void *p, size_t size);
-  void *allocateRaw(size_t size);
+  size_t poolMemory(void) const;
   void *allocateSpace(size_t amount)
     {
       if (size_t(freeend_ - freestart_) < amount)
-        allocatePool();
+        growSpace(amount);
 
       ASSERT(size_t(freeend_ - freestart_) >= amount);
       void *p = freestart_;
@@ -31,16 +119,75 @@ protected:
   template <class T> T *allocate(void)
     { return static_cast<T *>(allocateSpace(sizeof(T))); }
 
+#if IGPROF_COMPACT_TRACE
+  Ref ref(void *p) const
+    {
+      if (! p)
+        return 0;
+
+      uintptr_t pool = (uintptr_t) p & ~(uintptr_t) (MEM_POOL_SIZE-1);
+      ASSERT(! ((uintptr_t) p & 7));
+      return (((uintptr_t *) pool)[1] << REF_OFFSET_BITS)
+	| (((uintptr_t) p - pool) >> 3);
+    }
+  template <class T> T *deref(Ref r) const
+    {
+      if (! r)
+        return 0;
+
+      return (T *) (pooltable_[r >> REF_OFFSET_BITS]
+		    + ((r & ((1u << REF_OFFSET_BITS)-1)) << 3));
+    }
+#else
+  static Ref ref(void *p)
+    { return p; }
+  template <class T> static T *deref(Ref r)
+    { return static_cast<T *>(r); }
+#endif
+
+  /// Check if all buffers together use more memory than the limit,
+  /// or this buffer is full.
+  bool overMemoryLimit(void) const
+    { return UNLIKELY(full_)
+	|| (UNLIKELY(s_memlimit != 0) && s_memused >= s_memlimit); }
+
+  /// Check if all buffers together use more memory than the limit
+  /// plus a reserve of an eighth of it, for recording data in reduced
+  /// detail once over the limit.  A full buffer has half of its pool
+  /// reserve for that, the rest is left for data which must always be
+  /// recorded.
+  bool overMemoryReserve(void) const
+    { return (UNLIKELY(full_)
+	      && size_t((char *) poolcur_ + MEM_POOL_SIZE - freestart_)
+	         < POOL_RESERVE / 2)
+	|| (UNLIKELY(s_memlimit != 0)
+	    && s_memused >= s_memlimit + s_memlimit / 8); }
+
+  /// Mark the buffer full after failing to get memory for it.
+  void setFull(void);
+
   static uint64_t hash(uintptr_t key, size_t shift)
     { return (key * 0x9e3779b97f4a7c16ULL) >> shift; }
 
 private:
+  void growSpace(size_t amount);
   void allocatePool(void);
+  void **allocatePoolMemory(void);
+  static void *allocateHuge(size_t size);
 
   void                  **poolfirst_;            //< Pointer to first memory pool.
   void                  **poolcur_;              //< Pointer to current memory pool.
   char                  *freestart_;             //< Next free address.
-  char                  *freeend_;               //< Last free address.
+  char                  *freeend_;               //< End of free space counted as used.
+  size_t                poolused_;               //< Pool memory counted as used.
+  size_t                npools_;                 //< Number of pools allocated.
+  bool                  full_;                   //< No more memory to be had.
+#if IGPROF_COMPACT_TRACE
+  char                  **pooltable_;            //< Pools by number.
+#endif
+
+  static size_t         s_memlimit;              //< Memory limit, zero for none.
+  static volatile size_t s_memused;              //< Memory used by all buffers.
 
   // Unavailable copy constructor, assignment operator
   IgProfBuffer(IgProfBuffer &);
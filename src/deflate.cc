@@ -0,0 +1,527 @@
+#include "deflate.h"
+#include "profile.h"
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if !defined MAP_ANONYMOUS && defined MAP_ANON
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// Deflate length and distance code bases and extra bit counts.
+static const uint16_t s_lbase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t s_lextra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t s_dbase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+  8193, 12289, 16385, 24577 };
+static const uint8_t s_dextra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Order in which the code length code lengths are transmitted.
+static const uint8_t s_clorder[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+/** Create a compressor writing a gzip stream to @a fd.  Returns null
+    if memory for the compressor state could not be allocated.  */
+IgProfDeflate *
+IgProfDeflate::create(int fd)
+{
+  void *p = mmap(0, sizeof(IgProfDeflate), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return p == MAP_FAILED ? 0 : new (p) IgProfDeflate(fd);
+}
+
+/** Initialise the compressor.  The object memory is already zeroed
+    by mmap(), so only the lookup tables and gzip header are set up.  */
+IgProfDeflate::IgProfDeflate(int fd)
+  : fd_(fd),
+    crc_(0xffffffff),
+    insize_(0),
+    strstart_(0),
+    winend_(0),
+    nsyms_(0),
+    outpos_(0),
+    bitcount_(0),
+    bitbuf_(0)
+{
+  for (uint32_t i = 0; i < 256; ++i)
+  {
+    uint32_t c = i;
+    for (int k = 0; k < 8; ++k)
+      c = (c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1);
+    crctable_[i] = c;
+  }
+
+  for (int code = 0; code < 29; ++code)
+    for (int n = 0; n < (1 << s_lextra[code]); ++n)
+      lcode_[s_lbase[code] - MIN_MATCH + n] = code;
+
+  for (int code = 0; code < 30; ++code)
+    for (int n = 0; n < (1 << s_dextra[code]); ++n)
+    {
+      int d = s_dbase[code] - 1 + n;
+      dcode_[d < 256 ? d : 256 + (d >> 7)] = code;
+    }
+
+  // gzip member header: magic, deflate, no flags, no mtime, unix.
+  static const unsigned char header[10] =
+    { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+  memcpy(out_, header, sizeof(header));
+  outpos_ = sizeof(header);
+}
+
+/** Compress @a len bytes from @a data.  */
+void
+IgProfDeflate::write(const char *data, size_t len)
+{
+  uint32_t crc = crc_;
+  for (size_t i = 0; i < len; ++i)
+    crc = crctable_[(crc ^ (unsigned char) data[i]) & 0xff] ^ (crc >> 8);
+  crc_ = crc;
+  insize_ += len;
+
+  while (len)
+  {
+    if (winend_ == 2*WSIZE)
+      slide();
+
+    size_t n = 2*WSIZE - winend_;
+    if (n > len)
+      n = len;
+    memcpy(window_ + winend_, data, n);
+    winend_ += n;
+    data += n;
+    len -= n;
+    compress(false);
+  }
+}
+
+/** Compress all remaining input, write the gzip trailer and release
+    the compressor.  The object must not be used after this call.  */
+void
+IgProfDeflate::finish(void)
+{
+  compress(true);
+  emitBlock(true);
+  alignBits();
+
+  uint32_t trailer[2] = { crc_ ^ 0xffffffff, insize_ };
+  for (int i = 0; i < 2; ++i)
+    for (int k = 0; k < 4; ++k)
+      out_[outpos_++] = (trailer[i] >> (8*k)) & 0xff;
+
+  flushOutput();
+  munmap(this, sizeof(IgProfDeflate));
+}
+
+/** Move the upper half of the window down to make room for more
+    input, rebasing the hash chains.  Positions which fall out of the
+    window become zero, which marks the end of a chain.  */
+void
+IgProfDeflate::slide(void)
+{
+  ASSERT(strstart_ >= WSIZE);
+  memcpy(window_, window_ + WSIZE, WSIZE);
+  strstart_ -= WSIZE;
+  winend_ -= WSIZE;
+
+  for (int i = 0; i < HASH_SIZE; ++i)
+    head_[i] = (head_[i] >= WSIZE ? head_[i] - WSIZE : 0);
+  for (int i = 0; i < WSIZE; ++i)
+    prev_[i] = (prev_[i] >= WSIZE ? prev_[i] - WSIZE : 0);
+}
+
+/** Add window position @a pos to the hash chains.  */
+void
+IgProfDeflate::insert(int pos)
+{
+  unsigned h = ((window_[pos] << 10) ^ (window_[pos+1] << 5)
+		^ window_[pos+2]) & (HASH_SIZE-1);
+  prev_[pos & (WSIZE-1)] = head_[h];
+  head_[h] = pos;
+}
+
+/** Find the longest earlier match for the string at @a pos, looking
+    at no more than @a avail bytes.  Returns the match length, zero if
+    there is no usable match, and sets @a dist to its distance.  The
+    position must already be in the hash chains.  */
+int
+IgProfDeflate::longestMatch(int pos, int avail, int &dist)
+{
+  const unsigned char *scan = window_ + pos;
+  int limit = (pos > MAX_DIST ? pos - MAX_DIST : 0);
+  int maxlen = (avail < MAX_MATCH ? avail : MAX_MATCH);
+  int bestlen = MIN_MATCH - 1;
+  int cand = prev_[pos & (WSIZE-1)];
+
+  for (int chain = MAX_CHAIN; cand > limit && chain; --chain)
+  {
+    const unsigned char *match = window_ + cand;
+    if (match[bestlen] == scan[bestlen] && match[0] == scan[0])
+    {
+      int len = 1;
+      while (len < maxlen && match[len] == scan[len])
+	++len;
+
+      if (len > bestlen)
+      {
+	bestlen = len;
+	dist = pos - cand;
+	if (len == maxlen)
+	  break;
+      }
+    }
+
+    int next = prev_[cand & (WSIZE-1)];
+    if (next >= cand)
+      break;
+    cand = next;
+  }
+
+  return bestlen >= MIN_MATCH ? bestlen : 0;
+}
+
+/** Code the window contents as literals and matches.  Unless @a flush
+    is set, enough input is kept back to search for full length
+    matches once more data arrives.  */
+void
+IgProfDeflate::compress(bool flush)
+{
+  int keep = (flush ? 0 : LOOKAHEAD);
+  while (winend_ - strstart_ > keep)
+  {
+    int avail = winend_ - strstart_;
+    int len = 0;
+    int dist = 0;
+
+    if (avail >= MIN_MATCH)
+    {
+      insert(strstart_);
+      len = longestMatch(strstart_, avail, dist);
+    }
+
+    if (len)
+    {
+      int code = dcode_[dist <= 256 ? dist-1 : 256 + ((dist-1) >> 7)];
+      symlit_[nsyms_] = len - MIN_MATCH;
+      symdist_[nsyms_] = dist;
+      lfreq_[257 + lcode_[len - MIN_MATCH]]++;
+      dfreq_[code]++;
+
+      for (int i = 1; i < len; ++i)
+	if (strstart_ + i + MIN_MATCH <= winend_)
+	  insert(strstart_ + i);
+      strstart_ += len;
+    }
+    else
+    {
+      symlit_[nsyms_] = window_[strstart_];
+      symdist_[nsyms_] = 0;
+      lfreq_[window_[strstart_]]++;
+      strstart_++;
+    }
+
+    if (++nsyms_ == SYM_SIZE)
+      emitBlock(false);
+  }
+}
+
+/** Compute Huffman code lengths for the @a n symbols with frequencies
+    @a freq into @a lens, limited to @a maxbits bits.  If the optimal
+    code is too deep the frequencies are flattened and the code is
+    rebuilt until it fits.  */
+void
+IgProfDeflate::buildLengths(const uint32_t *freq, int n, int maxbits,
+			    uint8_t *lens)
+{
+  uint32_t f[LITERALS];
+  uint32_t weight[2*LITERALS];
+  int leaf[LITERALS];
+  int parent[2*LITERALS];
+  int depth[2*LITERALS];
+
+  ASSERT(n <= LITERALS);
+  memcpy(f, freq, n * sizeof(*f));
+  memset(lens, 0, n);
+
+  while (true)
+  {
+    // Sort the used symbols by increasing frequency.
+    int nleaves = 0;
+    for (int i = 0; i < n; ++i)
+      if (f[i])
+      {
+	int j = nleaves++;
+	for ( ; j > 0 && f[leaf[j-1]] > f[i]; --j)
+	  leaf[j] = leaf[j-1];
+	leaf[j] = i;
+      }
+
+    if (nleaves < 2)
+    {
+      if (nleaves)
+	lens[leaf[0]] = 1;
+      return;
+    }
+
+    // Build the tree with the two-queue method: leaves and internal
+    // nodes are both produced in increasing weight order.
+    for (int i = 0; i < nleaves; ++i)
+      weight[i] = f[leaf[i]];
+
+    int nextleaf = 0, nextnode = nleaves, nnodes = nleaves;
+    while (nnodes < 2*nleaves-1)
+    {
+      int pick[2];
+      for (int k = 0; k < 2; ++k)
+	if (nextleaf < nleaves
+	    && (nextnode == nnodes || weight[nextleaf] <= weight[nextnode]))
+	  pick[k] = nextleaf++;
+	else
+	  pick[k] = nextnode++;
+
+      weight[nnodes] = weight[pick[0]] + weight[pick[1]];
+      parent[pick[0]] = parent[pick[1]] = nnodes;
+      nnodes++;
+    }
+
+    int maxdepth = 0;
+    depth[nnodes-1] = 0;
+    for (int i = nnodes-2; i >= 0; --i)
+      depth[i] = depth[parent[i]] + 1;
+    for (int i = 0; i < nleaves; ++i)
+      if (depth[i] > maxdepth)
+	maxdepth = depth[i];
+
+    if (maxdepth <= maxbits)
+    {
+      for (int i = 0; i < nleaves; ++i)
+	lens[leaf[i]] = depth[i];
+      return;
+    }
+
+    for (int i = 0; i < n; ++i)
+      if (f[i])
+	f[i] = (f[i] >> 1) | 1;
+  }
+}
+
+/** Assign canonical Huffman codes for code lengths @a lens.  The codes
+    are stored bit reversed as deflate sends them most significant bit
+    first into a least significant bit first stream.  */
+void
+IgProfDeflate::buildCodes(const uint8_t *lens, int n, uint16_t *codes)
+{
+  int count[16];
+  int next[16];
+  memset(count, 0, sizeof(count));
+  for (int i = 0; i < n; ++i)
+    count[lens[i]]++;
+  count[0] = 0;
+
+  int code = 0;
+  for (int bits = 1; bits < 16; ++bits)
+  {
+    code = (code + count[bits-1]) << 1;
+    next[bits] = code;
+  }
+
+  for (int i = 0; i < n; ++i)
+    if (int len = lens[i])
+    {
+      int c = next[len]++;
+      int r = 0;
+      for (int k = 0; k < len; ++k, c >>= 1)
+	r = (r << 1) | (c & 1);
+      codes[i] = r;
+    }
+    else
+      codes[i] = 0;
+}
+
+/** Write out the symbols collected so far as one dynamic Huffman
+    block, marked as the final block if @a last is set.  */
+void
+IgProfDeflate::emitBlock(bool last)
+{
+  uint8_t llens[LITERALS], dlens[DISTANCES], clens[CODELENS];
+  uint16_t lcodes[LITERALS], dcodes[DISTANCES], ccodes[CODELENS];
+  uint8_t lens[LITERALS + DISTANCES];
+  uint8_t rle[LITERALS + DISTANCES];
+  uint8_t rlextra[LITERALS + DISTANCES];
+  uint32_t cfreq[CODELENS];
+  int nrle = 0;
+
+  // Make sure both codes have at least two symbols so that decoders
+  // never see a degenerate one-symbol code.
+  lfreq_[256] = 1;
+  if (nsyms_ == 0)
+    lfreq_[0]++;
+  int ndist = 0;
+  for (int i = 0; i < DISTANCES; ++i)
+    ndist += (dfreq_[i] != 0);
+  if (ndist < 2)
+  {
+    dfreq_[0]++;
+    dfreq_[1]++;
+  }
+
+  buildLengths(lfreq_, LITERALS, 15, llens);
+  buildLengths(dfreq_, DISTANCES, 15, dlens);
+  buildCodes(llens, LITERALS, lcodes);
+  buildCodes(dlens, DISTANCES, dcodes);
+
+  int hlit = LITERALS;
+  while (hlit > 257 && ! llens[hlit-1])
+    --hlit;
+  int hdist = DISTANCES;
+  while (hdist > 1 && ! dlens[hdist-1])
+    --hdist;
+
+  // Run length code the code lengths of both codes as one sequence.
+  int nlens = hlit + hdist;
+  memcpy(lens, llens, hlit);
+  memcpy(lens + hlit, dlens, hdist);
+  memset(cfreq, 0, sizeof(cfreq));
+  for (int i = 0; i < nlens; )
+  {
+    int cur = lens[i];
+    int run = 1;
+    while (i + run < nlens && lens[i + run] == cur)
+      ++run;
+    i += run;
+
+    if (cur == 0)
+      while (run > 0)
+      {
+	int n = (run > 138 ? 138 : run);
+	if (n >= 11)
+	  rle[nrle] = 18, rlextra[nrle] = n - 11;
+	else if (n >= 3)
+	  rle[nrle] = 17, rlextra[nrle] = n - 3;
+	else
+	  rle[nrle] = 0, n = 1;
+	cfreq[rle[nrle++]]++;
+	run -= n;
+      }
+    else
+    {
+      rle[nrle] = cur;
+      cfreq[rle[nrle++]]++;
+      --run;
+      while (run > 0)
+      {
+	int n = (run > 6 ? 6 : run);
+	if (n >= 3)
+	  rle[nrle] = 16, rlextra[nrle] = n - 3;
+	else
+	  rle[nrle] = cur, n = 1;
+	cfreq[rle[nrle++]]++;
+	run -= n;
+      }
+    }
+  }
+
+  buildLengths(cfreq, CODELENS, 7, clens);
+  buildCodes(clens, CODELENS, ccodes);
+  int hclen = CODELENS;
+  while (hclen > 4 && ! clens[s_clorder[hclen-1]])
+    --hclen;
+
+  // Block header and code tables.
+  putBits(last ? 1 : 0, 1);
+  putBits(2, 2);
+  putBits(hlit - 257, 5);
+  putBits(hdist - 1, 5);
+  putBits(hclen - 4, 4);
+  for (int i = 0; i < hclen; ++i)
+    putBits(clens[s_clorder[i]], 3);
+  for (int i = 0; i < nrle; ++i)
+  {
+    int sym = rle[i];
+    putBits(ccodes[sym], clens[sym]);
+    if (sym == 16)
+      putBits(rlextra[i], 2);
+    else if (sym == 17)
+      putBits(rlextra[i], 3);
+    else if (sym == 18)
+      putBits(rlextra[i], 7);
+  }
+
+  // Block contents.
+  for (int i = 0; i < nsyms_; ++i)
+  {
+    int lit = symlit_[i];
+    int dist = symdist_[i];
+    if (! dist)
+      putBits(lcodes[lit], llens[lit]);
+    else
+    {
+      int lc = lcode_[lit];
+      putBits(lcodes[257 + lc], llens[257 + lc]);
+      putBits(lit + MIN_MATCH - s_lbase[lc], s_lextra[lc]);
+
+      int dc = dcode_[dist <= 256 ? dist-1 : 256 + ((dist-1) >> 7)];
+      putBits(dcodes[dc], dlens[dc]);
+      putBits(dist - s_dbase[dc], s_dextra[dc]);
+    }
+  }
+  putBits(lcodes[256], llens[256]);
+
+  memset(lfreq_, 0, sizeof(lfreq_));
+  memset(dfreq_, 0, sizeof(dfreq_));
+  nsyms_ = 0;
+}
+
+/** Append the low @a nbits bits of @a value to the output.  */
+void
+IgProfDeflate::putBits(uint32_t value, int nbits)
+{
+  bitbuf_ |= (uint64_t) value << bitcount_;
+  bitcount_ += nbits;
+  while (bitcount_ >= 8)
+  {
+    if (UNLIKELY(outpos_ == OUT_SIZE))
+      flushOutput();
+    out_[outpos_++] = bitbuf_ & 0xff;
+    bitbuf_ >>= 8;
+    bitcount_ -= 8;
+  }
+}
+
+/** Pad the output to a byte boundary and make room for the trailer.  */
+void
+IgProfDeflate::alignBits(void)
+{
+  if (bitcount_)
+    putBits(0, 8 - bitcount_);
+  if (outpos_ > OUT_SIZE - 8)
+    flushOutput();
+}
+
+/** Write out the buffered compressed output.  */
+void
+IgProfDeflate::flushOutput(void)
+{
+  const unsigned char *p = out_;
+  size_t left = outpos_;
+  while (left)
+  {
+    ssize_t n = ::write(fd_, p, left);
+    if (n > 0)
+      p += n, left -= n;
+    else if (n < 0 && errno == EINTR)
+      continue;
+    else
+      break;
+  }
+  outpos_ = 0;
+}
@@ -0,0 +1,77 @@
+#ifndef DEFLATE_H
+# define DEFLATE_H
+
+# include "macros.h"
+# include <stddef.h>
+# include <stdint.h>
+
+/** Streaming gzip compressor for profile dumps.
+
+    Compresses data with deflate (RFC 1951) in a gzip wrapper
+    (RFC 1952) and writes the result directly to a file descriptor,
+    so compressed dumps need neither a child process nor a pipe.
+    Matches are found greedily with a short hash chain search and
+    each block is coded with its own dynamic Huffman tables, which
+    for profile dumps gives output close to "gzip -3".
+
+    All state lives in a single private memory mapping made by
+    create() and released by finish(), so the compressor never calls
+    malloc() and can be used while the memory profiler is active.  */
+class HIDDEN IgProfDeflate
+{
+public:
+  static IgProfDeflate  *create(int fd);
+  void                  write(const char *data, size_t len);
+  void                  finish(void);
+
+private:
+  static const int      WSIZE       = 32*1024;
+  static const int      HASH_SIZE   = 32*1024;
+  static const int      MIN_MATCH   = 3;
+  static const int      MAX_MATCH   = 258;
+  static const int      LOOKAHEAD   = MAX_MATCH + MIN_MATCH + 1;
+  static const int      MAX_DIST    = WSIZE - LOOKAHEAD;
+  static const int      MAX_CHAIN   = 32;
+  static const int      SYM_SIZE    = 16*1024;
+  static const int      OUT_SIZE    = 64*1024;
+  static const int      LITERALS    = 286;
+  static const int      DISTANCES   = 30;
+  static const int      CODELENS    = 19;
+
+  IgProfDeflate(int fd);
+  void                  compress(bool flush);
+  int                   longestMatch(int pos, int avail, int &dist);
+  void                  insert(int pos);
+  void                  slide(void);
+  void                  emitBlock(bool last);
+  void                  putBits(uint32_t value, int nbits);
+  void                  alignBits(void);
+  void                  flushOutput(void);
+  static void           buildLengths(const uint32_t *freq, int n,
+                                     int maxbits, uint8_t *lens);
+  static void           buildCodes(const uint8_t *lens, int n,
+                                   uint16_t *codes);
+
+  int                   fd_;                    //< Output file descriptor.
+  uint32_t              crc_;                   //< CRC-32 of the input so far.
+  uint32_t              insize_;                //< Input size modulo 2^32.
+  int                   strstart_;              //< Next window byte to code.
+  int                   winend_;                //< End of data in the window.
+  int                   nsyms_;                 //< Symbols in the current block.
+  int                   outpos_;                //< Bytes pending in @a out_.
+  int                   bitcount_;              //< Bits pending in @a bitbuf_.
+  uint64_t              bitbuf_;                //< Output bit accumulator.
+  uint32_t              lfreq_[LITERALS];       //< Literal/length frequencies.
+  uint32_t              dfreq_[DISTANCES];      //< Distance frequencies.
+  uint16_t              head_[HASH_SIZE];       //< Latest window position per hash.
+  uint16_t              prev_[WSIZE];           //< Hash chain links.
+  uint16_t              symlit_[SYM_SIZE];      //< Literal byte or match length-3.
+  uint16_t              symdist_[SYM_SIZE];     //< Match distance, zero for literals.
+  uint32_t              crctable_[256];         //< CRC-32 lookup table.
+  uint8_t               lcode_[256];            //< Length code by match length-3.
+  uint8_t               dcode_[512];            //< Distance code lookup.
+  unsigned char         window_[2*WSIZE];       //< Sliding input window.
+  unsigned char         out_[OUT_SIZE];         //< Compressed output buffer.
+};
+
+#endif // DEFLATE_H
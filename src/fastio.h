@@ -2,6 +2,7 @@
 # define FAST_IO_H
 
 # include "macros.h"
+# include "deflate.h"
 # include <unistd.h>
 # include <string.h>
 
@@ -11,12 +12,14 @@ class HIDDEN FastIO
   static const size_t SIZE = 64*1024;
   int fd_;
   size_t pos_;
+  IgProfDeflate *deflate_;
   char buf_[SIZE];
 
 public:
   FastIO(int fd)
     : fd_(fd),
-      pos_(0)
+      pos_(0),
+      deflate_(0)
     {}
 
   ~FastIO(void)
@@ -28,13 +31,39 @@ public:
     fd_ = fd;
   }
 
+  /** Compress all further output in gzip format. Returns false if
+      the compressor could not be created. */
+  bool compress(void)
+  {
+    deflate_ = IgProfDeflate::create(fd_);
+    return deflate_ != 0;
+  }
+
   /** Flush out all remaining output. */
   void flush(void)
   {
-    write(fd_, buf_, pos_);
+    if (deflate_)
+      deflate_->write(buf_, pos_);
+    else
+      write(fd_, buf_, pos_);
+    pos_ = 0;
+  }
+
+  /** Drop all buffered output without writing it out. */
+  void discard(void)
+  {
     pos_ = 0;
   }
 
+  /** Flush out all remaining output and end any compressed stream. */
+  void finish(void)
+  {
+    flush();
+    if (deflate_)
+      deflate_->finish();
+    deflate_ = 0;
+  }
+
   /** Write @a len characters from @a s. Length is guaranteed to be
       less than SIZE bytes long. */
   FastIO &put_fast(const char *s, size_t len)
@@ -164,6 +193,34 @@ public:
     return put_fast_rev(buf, n);
   }
 
+  /** Write out @a val as a base-128 varint: seven bits per byte, least
+      significant first, high bit set on all but the last byte. */
+  FastIO &putVarint(unsigned long long val)
+  {
+    char buf[10];
+    size_t n = 0;
+    while (val >= 0x80)
+    {
+      buf[n++] = (val & 0x7f) | 0x80;
+      val >>= 7;
+    }
+    buf[n++] = val;
+    return put_fast(buf, n);
+  }
+
+  /** Write out @a val as a zigzag encoded varint. */
+  FastIO &putSignedVarint(long long val)
+  {
+    return putVarint(((unsigned long long) val << 1)
+		     ^ (unsigned long long) (val >> 63));
+  }
+
+  /** Write out string @a s of length @a len prefixed with its length. */
+  FastIO &putString(const char *s, size_t len)
+  {
+    return putVarint(len).put(s, len);
+  }
+
   /** Write out pointer @a ptr as a hexadecimal integer. */
   FastIO &put(void *ptr)
   {
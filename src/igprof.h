@@ -0,0 +1,92 @@
+#ifndef IGPROF_IGPROF_H
+# define IGPROF_IGPROF_H
+
+/** Application interface to the IgProf profiler.
+
+    Lets an application restrict profiling to the regions it cares
+    about, for example to leave out a long warm-up phase, and split
+    the profile into named phases.  Each phase becomes a synthetic
+    root frame of all stack traces recorded while it is active, so
+    the analysis shows the cost of each phase separately.
+
+    The functions are safe to call whether or not the program runs
+    under the profiler: the profiler entry points are referenced
+    weakly, and the calls do nothing if the profiler is not loaded.
+    This requires position independent code (-fPIC or -fPIE), the
+    default on most current systems; in other executables the weak
+    references cannot be resolved to a preloaded profiler.
+
+    Typical use:
+
+      igprof_pause();
+      warmUpCaches();
+      igprof_resume();
+      igprof_phase("reconstruction");
+      reconstruct();
+      igprof_phase("output");
+      writeOutput();
+      igprof_phase(0);
+      igprof_dump("profile.gz");  */
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+extern void igprof_dump_now(const char *path) __attribute__((weak));
+extern void igprof_api_pause(void) __attribute__((weak));
+extern void igprof_api_resume(void) __attribute__((weak));
+extern void igprof_api_reset(void) __attribute__((weak));
+extern void igprof_api_phase(const char *name) __attribute__((weak));
+
+/** Stop collecting profile data until #igprof_resume() is called. */
+static __inline__ void
+igprof_pause(void)
+{
+  if (igprof_api_pause)
+    igprof_api_pause();
+}
+
+/** Resume collecting profile data after #igprof_pause(). */
+static __inline__ void
+igprof_resume(void)
+{
+  if (igprof_api_resume)
+    igprof_api_resume();
+}
+
+/** Throw away all profile data collected so far. */
+static __inline__ void
+igprof_reset(void)
+{
+  if (igprof_api_reset)
+    igprof_api_reset();
+}
+
+/** Write out the profile data collected so far to @a path.  The name
+    may be a pipe to a command if it starts with '|', and is written
+    compressed if it ends in ".gz".  With incremental dumps (igprof -i)
+    every dump is appended to the file of the first one, and @a path
+    is ignored.  */
+static __inline__ void
+igprof_dump(const char *path)
+{
+  if (igprof_dump_now)
+    igprof_dump_now(path);
+}
+
+/** Attribute all profile data from now on to phase @a name, shown as
+    the root frame of all stack traces, until the next call.  A null
+    or empty name ends the current phase.  Phases are process wide.
+    The name is copied, at most 127 characters of it.  */
+static __inline__ void
+igprof_phase(const char *name)
+{
+  if (igprof_api_phase)
+    igprof_api_phase(name);
+}
+
+# ifdef __cplusplus
+}
+# endif
+
+#endif /* IGPROF_IGPROF_H */
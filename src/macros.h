@@ -6,6 +6,8 @@
 #define VISIBLE      __attribute__((visibility("default")))
 #define LIKELY(x)    __builtin_expect(bool(x), true)
 #define UNLIKELY(x)  __builtin_expect(bool(x), false)
+#define THREAD_LOCAL __thread
+#define INITIAL_EXEC __attribute__((tls_model("initial-exec")))
 
 #define MERGE2(a,b)              a##b
 #define MERGE3(a,b,c)            a##b##c
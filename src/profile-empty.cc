@@ -39,7 +39,7 @@ static const unsigned char      MAGIC_BYTE      = 0xAA;
 
 HIDDEN unsigned char            s_zero_page[4096];
 HIDDEN unsigned char            s_magic_page[4096];
-static IgProfTrace::CounterDef  s_ct_empty      = { "MEM_LIVE", IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_empty      = { "MEM_LIVE", IgProfTrace::TICK, -1, 0, 0 };
 static bool                     s_init_memory   = false;
 static bool                     s_track_unused  = false;
 static bool                     s_initialized   = false;
@@ -137,7 +137,7 @@ remove (void *ptr)
     size = res->size;
     ASSERT(ctr);
     IgProfTrace::Value empty_mem = derivedLeakSize(res->hashslot->resource, size);
-    buf->tick(ctr->frame, &s_ct_empty, empty_mem, 1);
+    buf->tick(buf->counterFrame(ctr), &s_ct_empty, empty_mem, 1);
     // buf->release() will decrease the counter value by res->size
     ctr->value += size;
     buf->release((IgProfTrace::Address) ptr);
@@ -7,7 +7,12 @@
 #include <cstdio>
 #include <cerrno>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <pthread.h>
+#if __linux
+# include <sys/sendfile.h>
+#endif
 
 // -------------------------------------------------------------------
 // Traps for this profiling module
@@ -32,18 +37,103 @@ DUAL_HOOK(3, int, dosocket, _main, _libc,
 DUAL_HOOK(3, int, doaccept, _main, _libc,
           (int fd, sockaddr *addr, socklen_t *len), (fd, addr, len),
           "accept", 0, "libc.so.6")
+DUAL_HOOK(3, ssize_t, doread, _main, _libc,
+          (int fd, void *buf, size_t n), (fd, buf, n),
+          "read", 0, "libc.so.6")
+DUAL_HOOK(3, ssize_t, dowrite, _main, _libc,
+          (int fd, const void *buf, size_t n), (fd, buf, n),
+          "write", 0, "libc.so.6")
+DUAL_HOOK(4, ssize_t, dopread, _main, _libc,
+          (int fd, void *buf, size_t n, off_t off), (fd, buf, n, off),
+          "pread", 0, "libc.so.6")
+DUAL_HOOK(4, ssize_t, dopwrite, _main, _libc,
+          (int fd, const void *buf, size_t n, off_t off), (fd, buf, n, off),
+          "pwrite", 0, "libc.so.6")
+DUAL_HOOK(3, ssize_t, doreadv, _main, _libc,
+          (int fd, const iovec *iov, int n), (fd, iov, n),
+          "readv", 0, "libc.so.6")
+DUAL_HOOK(3, ssize_t, dowritev, _main, _libc,
+          (int fd, const iovec *iov, int n), (fd, iov, n),
+          "writev", 0, "libc.so.6")
+DUAL_HOOK(4, ssize_t, dosend, _main, _libc,
+          (int fd, const void *buf, size_t n, int flags), (fd, buf, n, flags),
+          "send", 0, "libc.so.6")
+DUAL_HOOK(4, ssize_t, dorecv, _main, _libc,
+          (int fd, void *buf, size_t n, int flags), (fd, buf, n, flags),
+          "recv", 0, "libc.so.6")
+#if __linux
+DUAL_HOOK(4, ssize_t, dosendfile, _main, _libc,
+          (int out, int in, off_t *off, size_t n), (out, in, off, n),
+          "sendfile", 0, "libc.so.6")
+#endif
 
 // Data for this profiling module
-static IgProfTrace::CounterDef  s_ct_used       = { "FD_USED", IgProfTrace::TICK, -1, 0 };
-static IgProfTrace::CounterDef  s_ct_live       = { "FD_LIVE", IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_used       = { "FD_USED", IgProfTrace::TICK, -1, 0, 0 };
+static IgProfTrace::CounterDef  s_ct_live       = { "FD_LIVE", IgProfTrace::TICK, -1, 0, 0 };
+static IgProfTrace::CounterDef  s_ct_read       = { "IO_READ_BYTES", IgProfTrace::TICK, -1, 0, 0 };
+static IgProfTrace::CounterDef  s_ct_write      = { "IO_WRITE_BYTES", IgProfTrace::TICK, -1, 0, 0 };
+static IgProfTrace::CounterDef  s_ct_iotime     = { "IO_TIME", IgProfTrace::TICK, -1, 0, 0 };
 static bool                     s_initialized   = false;
+static bool                     s_io            = false;
+static bool                     s_iotype        = false;
+static IgProfTrace              *s_fdbuf        = 0;
+
+/// Descriptor kinds for splitting I/O by descriptor type.
+enum { FD_UNKNOWN, FD_FILE, FD_SOCKET, FD_PIPE, FD_OTHER, FD_KINDS };
+static const int                MAX_FDS         = 65536;
+static const char               *s_kindnames[FD_KINDS]
+  = { "<unknown>", "<file>", "<socket>", "<pipe>", "<other>" };
+static void                     *s_kindframes[FD_KINDS];
+static unsigned char            s_fdkind[MAX_FDS];
+
+/** Determine the kind of descriptor @a fd.  */
+static int
+classify(int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return FD_OTHER;
+  else if (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+    return FD_FILE;
+  else if (S_ISSOCK(st.st_mode))
+    return FD_SOCKET;
+  else if (S_ISFIFO(st.st_mode))
+    return FD_PIPE;
+  else
+    return FD_OTHER;
+}
+
+/** Return the kind of descriptor @a fd.  The kind is normally known
+    from when the descriptor was opened; descriptors opened in ways we
+    do not trap, such as pipe() or inherited ones, are classified on
+    first use.  */
+static int
+fdkind(int fd)
+{
+  if (fd < 0 || fd >= MAX_FDS)
+    return classify(fd);
+  if (s_fdkind[fd] == FD_UNKNOWN)
+    s_fdkind[fd] = classify(fd);
+  return s_fdkind[fd];
+}
+
+/** Return the buffer for the descriptor counters.  When I/O is
+    measured the profile buffers are per thread, and the descriptors,
+    which may be closed in another thread than they were opened in,
+    go to a separate buffer shared by all threads.  */
+static inline IgProfTrace *
+fdbuffer(void)
+{
+  IgProfTrace *buf = igprof_buffer();
+  return buf && s_fdbuf ? s_fdbuf : buf;
+}
 
 /** Record file descriptor.  Increments counters in the tree. */
 static void __attribute__((noinline))
 add (int fd)
 {
   void *addresses[IgProfTrace::MAX_DEPTH];
-  IgProfTrace *buf = igprof_buffer();
+  IgProfTrace *buf = fdbuffer();
   IgProfTrace::Stack *frame;
   IgProfTrace::Counter *ctr;
   uint64_t tstart, tend;
@@ -52,6 +142,9 @@ add (int fd)
   if (UNLIKELY(! buf))
     return;
 
+  if (s_iotype && fd >= 0 && fd < MAX_FDS)
+    s_fdkind[fd] = classify(fd);
+
   RDTSC(tstart);
   depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH);
   RDTSC(tend);
@@ -72,15 +165,57 @@ add (int fd)
 static void
 remove (int fd)
 {
-  IgProfTrace *buf = igprof_buffer();
+  IgProfTrace *buf = fdbuffer();
   if (UNLIKELY(! buf))
     return;
 
+  if (fd >= 0 && fd < MAX_FDS)
+    s_fdkind[fd] = FD_UNKNOWN;
+
   buf->lock();
   buf->release(fd);
   buf->unlock();
 }
 
+/** Record an I/O call on descriptor @a fd which transferred @a bytes
+    bytes, counted in @a def, and took @a cycles clock cycles, in the
+    buffer of the calling thread.  If requested, the hook frame is
+    replaced by a synthetic frame for the kind of the descriptor, so
+    the data can be split by file, socket and pipe.  */
+static void __attribute__((noinline))
+addio(int fd, IgProfTrace::CounterDef *def, ssize_t bytes, uint64_t cycles)
+{
+  void *addresses[IgProfTrace::MAX_DEPTH];
+  IgProfTrace *buf = igprof_buffer();
+  IgProfTrace::Stack *frame;
+  uint64_t tstart, tend;
+  int depth, skip = 2;
+
+  if (UNLIKELY(! buf))
+    return;
+
+  RDTSC(tstart);
+  depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH);
+  RDTSC(tend);
+
+  // Drop top two stack frames (me, hook), or just me if the hook
+  // frame is replaced with the descriptor kind.
+  if (s_iotype && depth > 1)
+  {
+    addresses[1] = s_kindframes[fdkind(fd)];
+    skip = 1;
+  }
+
+  buf->lock();
+  frame = buf->push(addresses+skip, depth-skip);
+  if (bytes > 0)
+    buf->tick(frame, def, bytes, 1);
+  if (cycles > 0)
+    buf->tick(frame, &s_ct_iotime, cycles, 1);
+  buf->traceperf(depth, tstart, tend);
+  buf->unlock();
+}
+
 // -------------------------------------------------------------------
 /** Initialise file descriptor profiling.  Traps various system
     calls to keep track of usage, and if requested, leaks.  */
@@ -102,6 +237,21 @@ initialize(void)
     {
       enable = true;
       options += 2;
+      while (*options)
+      {
+        if (! strncmp(options, ":iotype", 7))
+        {
+          s_io = s_iotype = true;
+          options += 7;
+        }
+        else if (! strncmp(options, ":io", 3))
+        {
+          s_io = true;
+          options += 3;
+        }
+        else
+          break;
+      }
     }
     else
       options++;
@@ -113,7 +263,9 @@ initialize(void)
   if (! enable)
     return;
 
-  if (! igprof_init("file descriptor profiler", 0, false))
+  // Record I/O calls, which need no resource tracking, into per-thread
+  // buffers so threads doing I/O do not queue up on one buffer lock.
+  if (! igprof_init("file descriptor profiler", 0, s_io))
     return;
 
   igprof_disable_globally();
@@ -133,6 +285,37 @@ initialize(void)
   if (dosocket_hook_main.raw.chain) IgHook::hook(dosocket_hook_libc.raw);
   if (doaccept_hook_main.raw.chain) IgHook::hook(doaccept_hook_libc.raw);
 #endif
+
+  if (s_io)
+  {
+    s_fdbuf = igprof_make_shared_buffer();
+    for (int i = 0; i < FD_KINDS; ++i)
+      s_kindframes[i] = igprof_synthetic_frame(s_kindnames[i]);
+
+    IgHook::hook(doread_hook_main.raw);
+    IgHook::hook(dowrite_hook_main.raw);
+    IgHook::hook(dopread_hook_main.raw);
+    IgHook::hook(dopwrite_hook_main.raw);
+    IgHook::hook(doreadv_hook_main.raw);
+    IgHook::hook(dowritev_hook_main.raw);
+    IgHook::hook(dosend_hook_main.raw);
+    IgHook::hook(dorecv_hook_main.raw);
+#if __linux
+    IgHook::hook(dosendfile_hook_main.raw);
+    if (doread_hook_main.raw.chain)     IgHook::hook(doread_hook_libc.raw);
+    if (dowrite_hook_main.raw.chain)    IgHook::hook(dowrite_hook_libc.raw);
+    if (dopread_hook_main.raw.chain)    IgHook::hook(dopread_hook_libc.raw);
+    if (dopwrite_hook_main.raw.chain)   IgHook::hook(dopwrite_hook_libc.raw);
+    if (doreadv_hook_main.raw.chain)    IgHook::hook(doreadv_hook_libc.raw);
+    if (dowritev_hook_main.raw.chain)   IgHook::hook(dowritev_hook_libc.raw);
+    if (dosend_hook_main.raw.chain)     IgHook::hook(dosend_hook_libc.raw);
+    if (dorecv_hook_main.raw.chain)     IgHook::hook(dorecv_hook_libc.raw);
+    if (dosendfile_hook_main.raw.chain) IgHook::hook(dosendfile_hook_libc.raw);
+#endif
+    igprof_debug("file descriptor profiler: measuring i/o%s\n",
+                 s_iotype ? " by descriptor type" : "");
+  }
+
   igprof_debug("file descriptor profiler enabled\n");
   igprof_enable_globally();
 }
@@ -250,5 +433,192 @@ doaccept(IgHook::SafeData<igprof_doaccept_t> &hook,
   return result;
 }
 
+// -------------------------------------------------------------------
+// Trapped i/o system calls.  Measure bytes transferred and time taken.
+static ssize_t
+doread(IgHook::SafeData<igprof_doread_t> &hook, int fd, void *buf, size_t n)
+{
+  bool enabled = igprof_disable();
+  uint64_t tstart, tend;
+
+  RDTSC(tstart);
+  ssize_t result = (*hook.chain)(fd, buf, n);
+  RDTSC(tend);
+  int err = errno;
+
+  if (enabled)
+    addio(fd, &s_ct_read, result, tend - tstart);
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+
+static ssize_t
+dowrite(IgHook::SafeData<igprof_dowrite_t> &hook, int fd, const void *buf, size_t n)
+{
+  bool enabled = igprof_disable();
+  uint64_t tstart, tend;
+
+  RDTSC(tstart);
+  ssize_t result = (*hook.chain)(fd, buf, n);
+  RDTSC(tend);
+  int err = errno;
+
+  if (enabled)
+    addio(fd, &s_ct_write, result, tend - tstart);
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+
+static ssize_t
+dopread(IgHook::SafeData<igprof_dopread_t> &hook,
+        int fd, void *buf, size_t n, off_t off)
+{
+  bool enabled = igprof_disable();
+  uint64_t tstart, tend;
+
+  RDTSC(tstart);
+  ssize_t result = (*hook.chain)(fd, buf, n, off);
+  RDTSC(tend);
+  int err = errno;
+
+  if (enabled)
+    addio(fd, &s_ct_read, result, tend - tstart);
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+
+static ssize_t
+dopwrite(IgHook::SafeData<igprof_dopwrite_t> &hook,
+         int fd, const void *buf, size_t n, off_t off)
+{
+  bool enabled = igprof_disable();
+  uint64_t tstart, tend;
+
+  RDTSC(tstart);
+  ssize_t result = (*hook.chain)(fd, buf, n, off);
+  RDTSC(tend);
+  int err = errno;
+
+  if (enabled)
+    addio(fd, &s_ct_write, result, tend - tstart);
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+
+static ssize_t
+doreadv(IgHook::SafeData<igprof_doreadv_t> &hook,
+        int fd, const iovec *iov, int n)
+{
+  bool enabled = igprof_disable();
+  uint64_t tstart, tend;
+
+  RDTSC(tstart);
+  ssize_t result = (*hook.chain)(fd, iov, n);
+  RDTSC(tend);
+  int err = errno;
+
+  if (enabled)
+    addio(fd, &s_ct_read, result, tend - tstart);
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+
+static ssize_t
+dowritev(IgHook::SafeData<igprof_dowritev_t> &hook,
+         int fd, const iovec *iov, int n)
+{
+  bool enabled = igprof_disable();
+  uint64_t tstart, tend;
+
+  RDTSC(tstart);
+  ssize_t result = (*hook.chain)(fd, iov, n);
+  RDTSC(tend);
+  int err = errno;
+
+  if (enabled)
+    addio(fd, &s_ct_write, result, tend - tstart);
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+
+static ssize_t
+dosend(IgHook::SafeData<igprof_dosend_t> &hook,
+       int fd, const void *buf, size_t n, int flags)
+{
+  bool enabled = igprof_disable();
+  uint64_t tstart, tend;
+
+  RDTSC(tstart);
+  ssize_t result = (*hook.chain)(fd, buf, n, flags);
+  RDTSC(tend);
+  int err = errno;
+
+  if (enabled)
+    addio(fd, &s_ct_write, result, tend - tstart);
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+
+static ssize_t
+dorecv(IgHook::SafeData<igprof_dorecv_t> &hook,
+       int fd, void *buf, size_t n, int flags)
+{
+  bool enabled = igprof_disable();
+  uint64_t tstart, tend;
+
+  RDTSC(tstart);
+  ssize_t result = (*hook.chain)(fd, buf, n, flags);
+  RDTSC(tend);
+  int err = errno;
+
+  if (enabled)
+    addio(fd, &s_ct_read, result, tend - tstart);
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+
+#if __linux
+// sendfile() both reads and writes; the time is accounted once, to
+// the output side.
+static ssize_t
+dosendfile(IgHook::SafeData<igprof_dosendfile_t> &hook,
+           int out, int in, off_t *off, size_t n)
+{
+  bool enabled = igprof_disable();
+  uint64_t tstart, tend;
+
+  RDTSC(tstart);
+  ssize_t result = (*hook.chain)(out, in, off, n);
+  RDTSC(tend);
+  int err = errno;
+
+  if (enabled)
+  {
+    addio(in, &s_ct_read, result, 0);
+    addio(out, &s_ct_write, result, tend - tstart);
+  }
+
+  errno = err;
+  igprof_enable();
+  return result;
+}
+#endif
+
 // -------------------------------------------------------------------
 static bool autoboot = (initialize(), true);
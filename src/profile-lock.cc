@@ -0,0 +1,237 @@
+#include "profile.h"
+#include "profile-trace.h"
+#include "hook.h"
+#include "walk-syms.h"
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <pthread.h>
+#include <semaphore.h>
+
+// -------------------------------------------------------------------
+// Traps for this profiling module
+LIBHOOK(1, int, domutex_lock, _main,
+        (pthread_mutex_t *mutex), (mutex),
+        "pthread_mutex_lock", 0, 0)
+LIBHOOK(1, int, dorwlock_rdlock, _main,
+        (pthread_rwlock_t *rwlock), (rwlock),
+        "pthread_rwlock_rdlock", 0, 0)
+LIBHOOK(1, int, dorwlock_wrlock, _main,
+        (pthread_rwlock_t *rwlock), (rwlock),
+        "pthread_rwlock_wrlock", 0, 0)
+LIBHOOK(2, int, docond_wait, _main,
+        (pthread_cond_t *cond, pthread_mutex_t *mutex), (cond, mutex),
+        "pthread_cond_wait", 0, 0)
+LIBHOOK(1, int, dosem_wait, _main,
+        (sem_t *sem), (sem),
+        "sem_wait", 0, 0)
+
+// Data for this profiling module
+static IgProfTrace::CounterDef  s_ct_time       = { "LOCK_WAIT_TIME", IgProfTrace::TICK, -1, 0, 0 };
+static IgProfTrace::CounterDef  s_ct_contended  = { "LOCK_CONTENDED", IgProfTrace::TICK, -1, 0, 0 };
+static IgProfTrace::CounterDef  s_ct_condwait   = { "LOCK_COND_WAIT", IgProfTrace::TICK, -1, 0, 0 };
+static bool                     s_initialized   = false;
+
+/** Record a contended lock wait of @a cycles clock cycles against
+    the call stack of the waiting thread.  Condition variable waits,
+    if @a condwait, are counted apart as they mostly measure idle time
+    rather than contention.  */
+static void __attribute__((noinline))
+add(uint64_t cycles, bool condwait = false)
+{
+  void *addresses[IgProfTrace::MAX_DEPTH];
+  IgProfTrace *buf = igprof_buffer();
+  IgProfTrace::Stack *frame;
+  uint64_t tstart, tend;
+  int depth;
+
+  if (UNLIKELY(! buf))
+    return;
+
+  RDTSC(tstart);
+  depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH);
+  RDTSC(tend);
+
+  // Drop top two stack frames (me, hook).
+  buf->lock();
+  frame = buf->push(addresses+2, depth-2);
+  if (condwait)
+    buf->tick(frame, &s_ct_condwait, cycles, 1);
+  else
+  {
+    buf->tick(frame, &s_ct_time, cycles, 1);
+    buf->tick(frame, &s_ct_contended, 1, 1);
+  }
+  buf->traceperf(depth, tstart, tend);
+  buf->unlock();
+}
+
+// -------------------------------------------------------------------
+/** Initialise lock contention profiling.  Traps the blocking lock
+    and wait calls to measure how long threads wait for each other.  */
+static void
+initialize(void)
+{
+  if (s_initialized) return;
+  s_initialized = true;
+
+  const char    *options = igprof_options();
+  bool          enable = false;
+
+  while (options && *options)
+  {
+    while (*options == ' ' || *options == ',')
+      ++options;
+
+    if (! strncmp(options, "lock", 4))
+    {
+      enable = true;
+      options += 4;
+    }
+    else
+      options++;
+
+    while (*options && *options != ',' && *options != ' ')
+      options++;
+  }
+
+  if (! enable)
+    return;
+
+  // Record into per-thread buffers, a shared buffer would make the
+  // waiting threads queue up on its lock on top of the measured wait.
+  if (! igprof_init("lock contention profiler", 0, true))
+    return;
+
+  igprof_disable_globally();
+  IgHook::hook(domutex_lock_hook_main.raw);
+  IgHook::hook(dorwlock_rdlock_hook_main.raw);
+  IgHook::hook(dorwlock_wrlock_hook_main.raw);
+  IgHook::hook(docond_wait_hook_main.raw);
+  IgHook::hook(dosem_wait_hook_main.raw);
+  igprof_debug("lock contention profiler enabled\n");
+  igprof_enable_globally();
+}
+
+// -------------------------------------------------------------------
+// Trapped lock calls.  Try to take the lock without blocking first,
+// and only measure the wait if that fails, so uncontended locking
+// costs little more than a trylock.  The profiler core itself locks
+// mutexes while recording; those calls are made with the profiler
+// disabled in the calling thread and are never measured.
+static int
+domutex_lock(IgHook::SafeData<igprof_domutex_lock_t> &hook,
+             pthread_mutex_t *mutex)
+{
+  bool enabled = igprof_disable();
+  uint64_t tstart, tend;
+  int result;
+
+  if (! enabled || (result = pthread_mutex_trylock(mutex)) == EBUSY)
+  {
+    RDTSC(tstart);
+    result = (*hook.chain)(mutex);
+    RDTSC(tend);
+
+    if (enabled)
+      add(tend - tstart);
+  }
+
+  igprof_enable();
+  return result;
+}
+
+static int
+dorwlock_rdlock(IgHook::SafeData<igprof_dorwlock_rdlock_t> &hook,
+                pthread_rwlock_t *rwlock)
+{
+  bool enabled = igprof_disable();
+  uint64_t tstart, tend;
+  int result;
+
+  if (! enabled || (result = pthread_rwlock_tryrdlock(rwlock)) == EBUSY)
+  {
+    RDTSC(tstart);
+    result = (*hook.chain)(rwlock);
+    RDTSC(tend);
+
+    if (enabled)
+      add(tend - tstart);
+  }
+
+  igprof_enable();
+  return result;
+}
+
+static int
+dorwlock_wrlock(IgHook::SafeData<igprof_dorwlock_wrlock_t> &hook,
+                pthread_rwlock_t *rwlock)
+{
+  bool enabled = igprof_disable();
+  uint64_t tstart, tend;
+  int result;
+
+  if (! enabled || (result = pthread_rwlock_trywrlock(rwlock)) == EBUSY)
+  {
+    RDTSC(tstart);
+    result = (*hook.chain)(rwlock);
+    RDTSC(tend);
+
+    if (enabled)
+      add(tend - tstart);
+  }
+
+  igprof_enable();
+  return result;
+}
+
+// Condition variable waits always block, so every wait is counted,
+// including reacquiring the mutex after the wakeup, but under its own
+// counter: idle waits for work would otherwise swamp the contention.
+static int
+docond_wait(IgHook::SafeData<igprof_docond_wait_t> &hook,
+            pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+  bool enabled = igprof_disable();
+  uint64_t tstart, tend;
+
+  RDTSC(tstart);
+  int result = (*hook.chain)(cond, mutex);
+  RDTSC(tend);
+
+  if (enabled)
+    add(tend - tstart, true);
+
+  igprof_enable();
+  return result;
+}
+
+static int
+dosem_wait(IgHook::SafeData<igprof_dosem_wait_t> &hook, sem_t *sem)
+{
+  bool enabled = igprof_disable();
+  uint64_t tstart, tend;
+  int err = errno;
+  int result;
+
+  if (! enabled || (result = sem_trywait(sem)) == -1)
+  {
+    errno = err;
+    RDTSC(tstart);
+    result = (*hook.chain)(sem);
+    RDTSC(tend);
+    err = errno;
+
+    if (enabled)
+      add(tend - tstart);
+
+    errno = err;
+  }
+
+  igprof_enable();
+  return result;
+}
+
+// -------------------------------------------------------------------
+static bool autoboot = (initialize(), true);
@@ -5,8 +5,10 @@
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
+#include <cmath>
 #include <pthread.h>
 #include <malloc.h>
+#include <unistd.h>
 
 // -------------------------------------------------------------------
 // Traps for this profiler module
@@ -37,27 +39,257 @@ DUAL_HOOK(1, void, dofree, _main, _libc,
 static const int                OVERHEAD_NONE   = 0; // Memory use without malloc overheads
 static const int                OVERHEAD_WITH   = 1; // Memory use including malloc overheads
 static const int                OVERHEAD_DELTA  = 2; // Memory use malloc overhead only
+static const int                MAX_SHARDS      = 256;
+static const size_t             SHARD_LOG_SIZE  = 16;
 
-static IgProfTrace::CounterDef  s_ct_total      = { "MEM_TOTAL",    IgProfTrace::TICK, -1, 0 };
-static IgProfTrace::CounterDef  s_ct_largest    = { "MEM_MAX",      IgProfTrace::MAX, -1, 0 };
-static IgProfTrace::CounterDef  s_ct_live       = { "MEM_LIVE",     IgProfTrace::TICK, -1, 0 };
+static const int                SAMPLE_FILTER_BITS = 20;
+
+/// Per-thread state of the allocation sampler.
+struct SampleState
+{
+  int64_t       left;           //< Bytes left to allocate before next sample.
+  uint64_t      random;         //< Random number generator state.
+};
+
+/// Entry in the index of tracked memory blocks.
+struct HIDDEN MemBlock
+{
+  uintptr_t     address;        //< Address of the block, zero for a free slot.
+  IgProfTrace   *owner;         //< Per-thread buffer which tracks the block.
+};
+
+/// One shard of the index of tracked memory blocks.  The index maps
+/// each block to the per-thread buffer which recorded its allocation,
+/// so a block freed in another thread is released from the counters
+/// of the stack which allocated it.  The blocks are spread over the
+/// shards by address, each with its own lock, so threads allocating
+/// and freeing unrelated blocks do not serialise on a single lock.
+/// The hash table uses linear probing and is kept at most half full.
+struct HIDDEN MemShard
+{
+  pthread_mutex_t lock;         //< Protection for this shard.
+  size_t        logSize;        //< Log size of the hash table.
+  size_t        used;           //< Number of blocks in the hash table.
+  MemBlock      *table;         //< Start of the hash table.
+};
+
+static void scaleSampled(IgProfTrace::Value &ticks,
+                         IgProfTrace::Value &value,
+                         IgProfTrace::Value &peak);
+
+static IgProfTrace::CounterDef  s_ct_total      = { "MEM_TOTAL",    IgProfTrace::TICK, -1, 0, 0 };
+static IgProfTrace::CounterDef  s_ct_largest    = { "MEM_MAX",      IgProfTrace::MAX, -1, 0, 0 };
+static IgProfTrace::CounterDef  s_ct_live       = { "MEM_LIVE",     IgProfTrace::TICK, -1, 0, 0 };
 static int                      s_overhead      = OVERHEAD_NONE;
+static int                      s_nshards       = 16;
+static MemShard                 s_shards[MAX_SHARDS];
+static int64_t                  s_sample        = 0;
+static unsigned char            *s_sampled      = 0;
+static pthread_key_t            s_samplekey;
 static bool                     s_initialized   = false;
 
+/** Return the index shard for the memory at @a ptr.  The shard is
+    chosen from the high bits of a multiplicative hash of the address.  */
+static inline MemShard &
+shard(void *ptr)
+{
+  uint64_t h = (uint64_t) (uintptr_t) ptr * 0x9e3779b97f4a7c16ULL;
+  return s_shards[(h >> 40) & (s_nshards-1)];
+}
+
+/** Return the home slot of @a address in the hash table of shard @a s.
+    Uses a different multiplier than #shard() so the blocks of a shard
+    spread over the whole table.  */
+static inline size_t
+homeSlot(MemShard &s, uintptr_t address)
+{
+  return ((uint64_t) address * 0xbf58476d1ce4e5b9ULL) >> (64 - s.logSize);
+}
+
+/** Return the slot of @a address in shard @a s, or the free slot where
+    it would be inserted.  */
+static inline MemBlock *
+findBlock(MemShard &s, uintptr_t address)
+{
+  size_t mask = ((size_t) 1 << s.logSize) - 1;
+  size_t slot = homeSlot(s, address);
+  while (s.table[slot].address && s.table[slot].address != address)
+    slot = (slot + 1) & mask;
+  return &s.table[slot];
+}
+
+/** Double the size of the hash table of shard @a s.  Returns false
+    if there is no memory for it.  */
+static bool
+expandShard(MemShard &s)
+{
+  MemBlock *old = s.table;
+  size_t oldSize = (size_t) 1 << s.logSize;
+  MemBlock *table = (MemBlock *) IgProfBuffer::allocateRaw(2 * oldSize * sizeof(MemBlock));
+  if (! table)
+    return false;
+
+  s.logSize++;
+  s.table = table;
+  for (size_t i = 0; i < oldSize; ++i)
+    if (old[i].address)
+      *findBlock(s, old[i].address) = old[i];
+  IgProfBuffer::unallocateRaw(old, oldSize * sizeof(MemBlock));
+  return true;
+}
+
+/** Remove the block in @a slot from shard @a s.  Moves later blocks of
+    the same probe sequence back, so lookups need no deletion markers.  */
+static void
+eraseBlock(MemShard &s, MemBlock *slot)
+{
+  size_t mask = ((size_t) 1 << s.logSize) - 1;
+  size_t hole = slot - s.table;
+  for (size_t i = (hole + 1) & mask; s.table[i].address; i = (i + 1) & mask)
+  {
+    // Move the block into the hole unless its home slot lies
+    // cyclically after the hole, up to the block itself.
+    size_t home = homeSlot(s, s.table[i].address);
+    if (hole <= i ? (home <= hole || home > i) : (home <= hole && home > i))
+    {
+      s.table[hole] = s.table[i];
+      hole = i;
+    }
+  }
+
+  s.table[hole].address = 0;
+  s.table[hole].owner = 0;
+  IgProfBuffer::trackEntries(s.used--, sizeof(MemBlock), false);
+}
+
+/** Return the sampled-block filter slot for the memory at @a ptr.  In
+    sampling mode only a small fraction of the blocks are tracked, and
+    the filter lets free() skip the buffer lock and hash lookup for the
+    rest.  Each slot counts the live sampled blocks hashing to it.  The
+    slot index includes the shard selection bits, so a slot is always
+    updated under the lock of the same index shard.  */
+static inline unsigned char &
+sampledFilter(void *ptr)
+{
+  uint64_t h = (uint64_t) (uintptr_t) ptr * 0x9e3779b97f4a7c16ULL;
+  return s_sampled[(h >> 40) & ((1u << SAMPLE_FILTER_BITS)-1)];
+}
+
+/** Return a pseudo-random 64-bit number from state @a x (xorshift64*). */
+static inline uint64_t
+nextRandom(uint64_t &x)
+{
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  return x * 2685821657736338717ULL;
+}
+
+/** Draw the number of bytes until the next sample from an exponential
+    distribution with mean @c s_sample, so the samples form a Poisson
+    process over the allocated bytes.  This runs inside the allocation
+    hooks, so it avoids floating point: -ln(u) for a uniform 26-bit u is
+    computed as (26 - log2(r)) * ln(2) in 16-bit fixed point, with the
+    fractional bits of log2 obtained by repeated squaring.  */
+static int64_t
+nextSampleInterval(uint64_t &random)
+{
+  uint64_t r = (nextRandom(random) >> 38) + 1; // [1, 2^26]
+  uint64_t log2r = 0;
+  while ((r >> log2r) > 1)
+    ++log2r;
+
+  // Normalise mantissa to [1, 2) in Q30 and extract fraction bits.
+  uint64_t m = (log2r >= 30 ? r >> (log2r - 30) : r << (30 - log2r));
+  uint64_t frac = 0;
+  for (int i = 0; i < 16; ++i)
+  {
+    m = (m * m) >> 30;
+    frac <<= 1;
+    if (m >= (2ULL << 30))
+    {
+      m >>= 1;
+      frac |= 1;
+    }
+  }
+
+  uint64_t neglog2 = (26ULL << 16) - ((log2r << 16) | frac); // Q16
+  uint64_t neglog = (neglog2 * 45426) >> 16;                  // * ln(2), Q16
+  return (int64_t) ((neglog * (uint64_t) s_sample) >> 16) + 1;
+}
+
+/** Decide whether to record an allocation of @a size bytes in sampling
+    mode.  Each thread counts down the bytes to the next sample point;
+    an allocation is sampled if it crosses the sample point, so the
+    probability of sampling a block of size S is 1 - exp(-S/s_sample).  */
+static bool
+sampleAllocation(size_t size)
+{
+  SampleState *state = (SampleState *) pthread_getspecific(s_samplekey);
+  if (UNLIKELY(! state))
+  {
+    // Profiling is disabled in this thread while we are in the hooks,
+    // so this allocation does not come back here.
+    state = new SampleState;
+    state->random = ((uint64_t) (uintptr_t) state * 0x9e3779b97f4a7c16ULL)
+                    ^ ((uint64_t) getpid() << 32) ^ 0x2545f4914f6cdd1dULL;
+    state->left = nextSampleInterval(state->random);
+    pthread_setspecific(s_samplekey, state);
+  }
+
+  if (LIKELY((state->left -= (int64_t) size) > 0))
+    return false;
+
+  state->left = nextSampleInterval(state->random);
+  return true;
+}
+
+/** Free the per-thread sampler state.  */
+static void
+freeSampleState(void *arg)
+{
+  delete (SampleState *) arg;
+}
+
+/** Scale sampled counter values back to unbiased estimates.  A block
+    of size S is sampled with probability p = 1 - exp(-S/s_sample), so
+    each sampled block stands for 1/p blocks.  As the individual sizes
+    are no longer known, the average block size of the stack is used,
+    in the same way as tcmalloc and pprof.  Only called when dumping,
+    so floating point is fine here.  */
+static void
+scaleSampled(IgProfTrace::Value &ticks,
+             IgProfTrace::Value &value,
+             IgProfTrace::Value &peak)
+{
+  double avg = (ticks ? 1. * value / ticks : 1. * peak);
+  if (avg <= 0)
+    return;
+
+  double scale = 1. / (1. - exp(-avg / s_sample));
+  ticks = (IgProfTrace::Value) (ticks * scale + .5);
+  value = (IgProfTrace::Value) (value * scale + .5);
+  peak  = (IgProfTrace::Value) (peak * scale + .5);
+}
+
 /** Record an allocation at @a ptr of @a size bytes.  Increments counters
     in the tree for the allocations as per current configuration and adds
-    the pointer to current live memory map if we are tracking leaks.  */
+    the pointer to current live memory map if we are tracking leaks.  The
+    counters and the live memory map are in the buffer of the calling
+    thread; the block is then entered in the index so it can be found
+    from other threads.  The MEM_LIVE peak is therefore per thread, and
+    igprof-analyse reports the sum of the thread peaks of a stack.  */
 static void  __attribute__((noinline))
 add(void *ptr, size_t size)
 {
   void *addresses[IgProfTrace::MAX_DEPTH];
-  IgProfTrace *buf = igprof_buffer();
+  IgProfTrace *buf;
   IgProfTrace::Stack *frame;
   IgProfTrace::Counter *ctr;
   uint64_t tstart, tend;
   int depth;
 
-  if (UNLIKELY(! buf))
+  if (UNLIKELY(! (buf = igprof_buffer())))
     return;
 
   if (UNLIKELY(s_overhead != OVERHEAD_NONE))
@@ -72,6 +304,9 @@ add(void *ptr, size_t size)
       size = actual;
   }
 
+  if (s_sample && LIKELY(! sampleAllocation(size)))
+    return;
+
   RDTSC(tstart);
   depth = IgHookTrace::stacktrace(addresses, IgProfTrace::MAX_DEPTH);
   RDTSC(tend);
@@ -85,23 +320,95 @@ add(void *ptr, size_t size)
   buf->acquire(ctr, (IgProfTrace::Address) ptr, size);
   buf->traceperf(depth, tstart, tend);
   buf->unlock();
+
+  // Enter the block in the index.  If another thread's buffer still
+  // has a block at this address, its release was missed: drop it
+  // there, as acquire() does within one buffer.  Only one lock is
+  // held at a time, so the lock order does not matter.
+  MemShard &s = shard(ptr);
+  IgProfTrace *stale = 0;
+  pthread_mutex_lock(&s.lock);
+  MemBlock *b = findBlock(s, (uintptr_t) ptr);
+  if (b->address)
+    stale = (b->owner != buf ? b->owner : 0);
+  else
+  {
+    if (UNLIKELY(2 * (s.used + 1) > ((size_t) 1 << s.logSize)))
+    {
+      // Without memory for a bigger index the release of the block
+      // could not be matched, so drop it from the buffer right away.
+      if (! expandShard(s))
+      {
+        pthread_mutex_unlock(&s.lock);
+        buf->lock();
+        buf->release((IgProfTrace::Address) ptr);
+        buf->unlock();
+        return;
+      }
+      b = findBlock(s, (uintptr_t) ptr);
+    }
+
+    b->address = (uintptr_t) ptr;
+    IgProfBuffer::trackEntries(++s.used, sizeof(MemBlock), true);
+    if (s_sample)
+    {
+      unsigned char &nsampled = sampledFilter(ptr);
+      if (nsampled < 255)
+        ++nsampled;
+    }
+  }
+  b->owner = buf;
+  pthread_mutex_unlock(&s.lock);
+
+  if (UNLIKELY(stale != 0))
+  {
+    stale->lock();
+    stale->release((IgProfTrace::Address) ptr);
+    stale->unlock();
+  }
 }
 
 /** Remove knowledge about allocation.  If we are tracking leaks,
     removes the memory allocation from the live map and subtracts
-    from the live memory counters.  */
+    from the live memory counters, in the buffer of the thread which
+    allocated the memory.  */
 static void
 remove (void *ptr)
 {
   if (LIKELY(ptr))
   {
-    IgProfTrace *buf = igprof_buffer();
-    if (UNLIKELY(! buf))
+    if (UNLIKELY(! igprof_buffer()))
       return;
 
-    buf->lock();
-    buf->release((IgProfTrace::Address) ptr);
-    buf->unlock();
+    // In sampling mode most blocks are not tracked.  Skip the lookup
+    // unless the filter says this block might be a sampled one.
+    if (s_sample && LIKELY(! sampledFilter(ptr)))
+      return;
+
+    MemShard &s = shard(ptr);
+    pthread_mutex_lock(&s.lock);
+    MemBlock *b = findBlock(s, (uintptr_t) ptr);
+    IgProfTrace *owner = b->owner;
+    if (owner)
+    {
+      eraseBlock(s, b);
+      if (s_sample)
+      {
+        unsigned char &nsampled = sampledFilter(ptr);
+        if (nsampled < 255)
+          --nsampled;
+      }
+    }
+    pthread_mutex_unlock(&s.lock);
+
+    // The owner buffer lives until the end of the program, see
+    // igprof_keep_thread_buffers().
+    if (owner)
+    {
+      owner->lock();
+      owner->release((IgProfTrace::Address) ptr);
+      owner->unlock();
+    }
   }
 }
 
@@ -143,6 +450,27 @@ initialize(void)
           s_overhead = OVERHEAD_DELTA;
           options += 15;
         }
+        else if (! strncmp(options, ":shards=", 8))
+        {
+          char *end = 0;
+          long n = strtol(options+8, &end, 10);
+          if (n < 1 || n > MAX_SHARDS || (n & (n-1)))
+          {
+            igprof_debug("memory profiler: shards must be a power of two"
+                         " between 1 and %d, using %d\n", MAX_SHARDS, s_nshards);
+            n = s_nshards;
+          }
+          s_nshards = n;
+          options = end;
+        }
+        else if (! strncmp(options, ":sample=", 8))
+        {
+          char *end = 0;
+          s_sample = strtoll(options+8, &end, 10);
+          if (s_sample < 0)
+            s_sample = 0;
+          options = end;
+        }
         else
           break;
       }
@@ -157,15 +485,46 @@ initialize(void)
   if (! enable)
     return;
 
-  if (! igprof_init("memory profiler", 0, false))
+  if (! igprof_init("memory profiler", 0, true))
     return;
 
+  // Frees refer to the buffers of the allocating threads, which must
+  // therefore outlive them.
+  igprof_keep_thread_buffers();
+
   igprof_disable_globally();
   igprof_debug("memory profiler: reporting %sallocation overhead%s\n",
                (s_overhead == OVERHEAD_NONE ? "memory use without "
                 : s_overhead == OVERHEAD_WITH ? "memory use with " : ""),
                (s_overhead == OVERHEAD_DELTA ? " only" : ""));
 
+  // Create the index of tracked memory blocks.
+  for (int i = 0; i < s_nshards; ++i)
+  {
+    MemShard &s = s_shards[i];
+    pthread_mutex_init(&s.lock, 0);
+    s.logSize = SHARD_LOG_SIZE;
+    s.used = 0;
+    s.table = (MemBlock *) IgProfBuffer::allocateRaw(((size_t) 1 << s.logSize)
+                                                      * sizeof(MemBlock));
+    if (! s.table)
+      igprof_abort();
+  }
+  igprof_debug("memory profiler: indexing memory blocks in %d shards\n", s_nshards);
+
+  // Set up allocation sampling.
+  if (s_sample)
+  {
+    s_sampled = new unsigned char[1u << SAMPLE_FILTER_BITS];
+    memset(s_sampled, 0, 1u << SAMPLE_FILTER_BITS);
+    pthread_key_create(&s_samplekey, &freeSampleState);
+    s_ct_total.scaleValues = &scaleSampled;
+    s_ct_live.scaleValues = &scaleSampled;
+    __extension__
+      igprof_debug("memory profiler: sampling on average every %jd bytes\n",
+                   (intmax_t) s_sample);
+  }
+
   IgHook::hook(domalloc_hook_main.raw);
   IgHook::hook(docalloc_hook_main.raw);
   IgHook::hook(dorealloc_hook_main.raw);
@@ -2,10 +2,23 @@
 #include "profile-trace.h"
 #include "hook.h"
 #include "walk-syms.h"
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <signal.h>
 #include <sys/time.h>
+#if __linux
+# include <time.h>
+# include <unistd.h>
+# include <sys/syscall.h>
+# include <sys/ioctl.h>
+# include <fcntl.h>
+# include <errno.h>
+# include <linux/perf_event.h>
+# ifndef sigev_notify_thread_id
+#  define sigev_notify_thread_id _sigev_un._tid
+# endif
+#endif
 
 #ifdef __APPLE__
 typedef sig_t sighandler_t;
@@ -25,25 +38,131 @@ LIBHOOK(3, int, dosigaction, _main,
         "sigaction", 0, 0)
 
 // Data for this profiler module
-static IgProfTrace::CounterDef  s_ct_ticks      = { "PERF_TICKS", IgProfTrace::TICK, -1, 0 };
+static IgProfTrace::CounterDef  s_ct_ticks      = { "PERF_TICKS", IgProfTrace::TICK, -1, 0, 0 };
+static IgProfTrace::CounterDef  s_ct_wall       = { "PERF_WALL", IgProfTrace::TICK, -1, 0, 0 };
 static bool                     s_initialized   = false;
 static bool                     s_keep          = false;
 static int                      s_signal        = SIGPROF;
 static int                      s_itimer        = ITIMER_PROF;
+static volatile int             s_interval      = 5000;
+static bool                     s_thread        = false;
+static pthread_key_t            s_timerkey;
+static int                      s_nevents       = 0;
+static unsigned long long       s_period        = 0;
+static bool                     s_wall          = false;
+
+#if __linux
+/** Per-thread cpu time timer and the interval it was last set to. */
+struct HIDDEN PerfThreadTimer
+{
+  timer_t                       id;
+  int                           interval;
+};
+
+/** Software event available to the perf_event_open() backend.  The
+    sample period is in events, or nanoseconds for the clock events,
+    which instead follow the timer frequency if @a period is zero. */
+struct HIDDEN PerfEventDef
+{
+  const char                    *name;
+  uint64_t                      config;
+  uint64_t                      period;
+  IgProfTrace::CounterDef       counter;
+};
+
+/** Per-thread perf event file descriptors, one per selected event. */
+struct HIDDEN PerfThreadEvents
+{
+  int                           fds[IgProfTrace::MAX_COUNTERS];
+};
+
+static PerfEventDef             s_eventdefs[] = {
+  { "cpu-clock", PERF_COUNT_SW_CPU_CLOCK, 0,
+    { "PERF_CPU_CLOCK", IgProfTrace::TICK, -1, 0, 0 } },
+  { "task-clock", PERF_COUNT_SW_TASK_CLOCK, 0,
+    { "PERF_TASK_CLOCK", IgProfTrace::TICK, -1, 0, 0 } },
+  { "page-faults", PERF_COUNT_SW_PAGE_FAULTS, 100,
+    { "PERF_PAGE_FAULTS", IgProfTrace::TICK, -1, 0, 0 } },
+  { "context-switches", PERF_COUNT_SW_CONTEXT_SWITCHES, 10,
+    { "PERF_CSW", IgProfTrace::TICK, -1, 0, 0 } },
+  { "cpu-migrations", PERF_COUNT_SW_CPU_MIGRATIONS, 1,
+    { "PERF_MIGRATIONS", IgProfTrace::TICK, -1, 0, 0 } },
+  { 0, 0, 0, { 0, IgProfTrace::TICK, -1, 0, 0 } }
+};
+static PerfEventDef             *s_events[IgProfTrace::MAX_COUNTERS];
+static pthread_key_t            s_eventkey;
+
+static const int                MAX_WALL_THREADS = 4096;
+static pid_t                    s_walltids[MAX_WALL_THREADS];
+static int                      s_nwalltids     = 0;
+static pthread_mutex_t          s_walllock      = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t            s_wallkey;
+static pthread_t                s_wallthread;
+static IgProfAtomic             s_wallblink     = 0;
+#endif
 
 /** Convert timeval to seconds. */
 static inline double tv2sec(const timeval &tv)
 { return tv.tv_sec + tv.tv_usec * 1e-6; }
 
+static void enableTimer(void);
+
 /** Performance profiler signal handler, SIGPROF or SIGALRM depending
     on the current profiler mode.  Record a tick for the current
     program location.  Assumes the signal handler is registered for
     the correct thread.  Skip ticks when this profiler is not
     enabled.  */
 static void
-profileSignalHandler(int /* nsig */, siginfo_t * /* info */, void * /* ctx */)
+profileSignalHandler(int /* nsig */, siginfo_t *info, void * /* ctx */)
 {
   void *addresses[IgProfTrace::MAX_DEPTH];
+  IgProfTrace::CounterDef *def = s_wall ? &s_ct_wall : &s_ct_ticks;
+  IgProfTrace::Value amount = 1;
+  int eventfd = -1;
+  int interval = s_interval;
+
+#if __linux
+  // A per-thread timer is re-armed here if the sampling rate has been
+  // changed, and the tick is sized by the interval it had until now.
+  if (s_thread)
+  {
+    PerfThreadTimer *timer
+      = (PerfThreadTimer *) pthread_getspecific(s_timerkey);
+    if (timer && timer->interval != interval)
+    {
+      if (timer->interval)
+        interval = timer->interval;
+      enableTimer();
+    }
+  }
+
+  // With the perf event backend the overflowing event is identified
+  // by the descriptor in the signal info.  Ignore stray signals.
+  if (s_nevents)
+  {
+    PerfThreadEvents *ev
+      = (PerfThreadEvents *) pthread_getspecific(s_eventkey);
+    for (int i = 0; ev && i < s_nevents; ++i)
+      if (ev->fds[i] >= 0 && ev->fds[i] == info->si_fd)
+      {
+        eventfd = ev->fds[i];
+        def = &s_events[i]->counter;
+        amount = s_events[i]->period;
+        break;
+      }
+
+    if (eventfd < 0)
+      return;
+  }
+#else
+  (void) info;
+#endif
+
+  // Ticks are counted in microseconds of the sampling interval, so
+  // the profile stays consistent over sampling rate changes.
+  if (! s_nevents)
+    amount = interval;
+
   if (LIKELY(igprof_disable()))
   {
     IgProfTrace *buf = igprof_buffer();
@@ -60,12 +179,308 @@ profileSignalHandler(int /* nsig */, siginfo_t * /* info */, void * /* ctx */)
       // Drop top two stackframes (me, signal frame).
       buf->lock();
       frame = buf->push(addresses+2, depth-2);
-      buf->tick(frame, &s_ct_ticks, 1, 1);
+      buf->tick(frame, def, amount, 1);
       buf->traceperf(depth, tstart, tend);
       buf->unlock();
     }
   }
   igprof_enable();
+
+#if __linux
+  // Re-arm the event for the next overflow signal.
+  if (eventfd >= 0)
+    ioctl(eventfd, PERF_EVENT_IOC_REFRESH, 1);
+#endif
+}
+
+#if __linux
+/** Release the per-thread cpu time timer on thread exit.  */
+static void
+freeThreadTimer(void *arg)
+{
+  PerfThreadTimer *timer = (PerfThreadTimer *) arg;
+  timer_delete(timer->id);
+  delete timer;
+}
+
+/** Create a timer measuring cpu time of the calling thread only, and
+    delivering the profiling signal to that same thread.  Replaces any
+    timer recorded for this thread before, for example one inherited
+    as stale data over fork().  Returns @c false if the kernel refuses
+    to create the timer.  */
+static bool
+createThreadTimer(void)
+{
+  PerfThreadTimer *timer
+    = (PerfThreadTimer *) pthread_getspecific(s_timerkey);
+  if (! timer)
+  {
+    timer = new PerfThreadTimer;
+    pthread_setspecific(s_timerkey, timer);
+  }
+
+  sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = s_signal;
+  sev.sigev_notify_thread_id = syscall(SYS_gettid);
+  timer->interval = 0;
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer->id) == 0)
+    return true;
+
+  igprof_debug("performance profiler: failed to create thread cpu timer"
+               " in thread 0x%lx\n", (unsigned long) pthread_self());
+  pthread_setspecific(s_timerkey, 0);
+  delete timer;
+  return false;
+}
+#endif
+
+#if __linux
+/** Open software event @a def for thread @a tid.  If @a async, route
+    overflow signals to that thread and arm the event; otherwise just
+    check the event can be opened.  Falls back to user space counting
+    only if the kernel refuses to count kernel activity.  Returns the
+    file descriptor, or -1 on failure.  */
+static int
+openEvent(PerfEventDef *def, pid_t tid, bool async)
+{
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.config = def->config;
+  attr.sample_period = def->period;
+  attr.wakeup_events = 1;
+  attr.disabled = 1;
+
+  int fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+  if (fd < 0 && (errno == EACCES || errno == EPERM))
+  {
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+  }
+
+  if (fd < 0 || ! async)
+    return fd;
+
+  f_owner_ex owner;
+  owner.type = F_OWNER_TID;
+  owner.pid = tid;
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0
+      || fcntl(fd, F_SETSIG, s_signal) != 0
+      || fcntl(fd, F_SETOWN_EX, &owner) != 0
+      || fcntl(fd, F_SETFL, O_ASYNC) != 0
+      || ioctl(fd, PERF_EVENT_IOC_RESET, 0) != 0
+      || ioctl(fd, PERF_EVENT_IOC_REFRESH, 1) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/** Close the perf event descriptors of a thread.  */
+static void
+closeThreadEvents(PerfThreadEvents *ev)
+{
+  for (int i = 0; i < s_nevents; ++i)
+    if (ev->fds[i] >= 0)
+    {
+      close(ev->fds[i]);
+      ev->fds[i] = -1;
+    }
+}
+
+/** Release the per-thread perf events on thread exit.  */
+static void
+freeThreadEvents(void *arg)
+{
+  PerfThreadEvents *ev = (PerfThreadEvents *) arg;
+  closeThreadEvents(ev);
+  delete ev;
+}
+
+/** Open the selected software events for the calling thread, with
+    overflow signals delivered to this thread.  Replaces any events
+    recorded for this thread before, for example descriptors which
+    a fork() child inherited from the parent.  */
+static void
+createThreadEvents(void)
+{
+  PerfThreadEvents *ev = (PerfThreadEvents *) pthread_getspecific(s_eventkey);
+  if (! ev)
+  {
+    ev = new PerfThreadEvents;
+    for (int i = 0; i < s_nevents; ++i)
+      ev->fds[i] = -1;
+    pthread_setspecific(s_eventkey, ev);
+  }
+
+  closeThreadEvents(ev);
+  pid_t tid = syscall(SYS_gettid);
+  for (int i = 0; i < s_nevents; ++i)
+    if ((ev->fds[i] = openEvent(s_events[i], tid, true)) < 0)
+      igprof_debug("performance profiler: failed to open %s event"
+                   " in thread 0x%lx\n", s_events[i]->name,
+                   (unsigned long) pthread_self());
+}
+
+/** Stop or restart counting the perf events of the calling thread.  */
+static void
+toggleThreadEvents(bool enable)
+{
+  // The thread key only exists with the perf event backend.
+  if (! s_nevents)
+    return;
+
+  PerfThreadEvents *ev = (PerfThreadEvents *) pthread_getspecific(s_eventkey);
+  for (int i = 0; ev && i < s_nevents; ++i)
+    if (ev->fds[i] >= 0)
+      ioctl(ev->fds[i], enable ? PERF_EVENT_IOC_ENABLE
+            : PERF_EVENT_IOC_DISABLE, 0);
+}
+
+/** Add the calling thread to the threads the wall clock sampler
+    signals.  The thread is removed again by the key destructor when
+    it exits.  */
+static void
+registerWallThread(void)
+{
+  pid_t tid = syscall(SYS_gettid);
+  pthread_mutex_lock(&s_walllock);
+  if (s_nwalltids < MAX_WALL_THREADS)
+  {
+    s_walltids[s_nwalltids++] = tid;
+    pthread_setspecific(s_wallkey, (void *) (intptr_t) tid);
+  }
+  else
+    igprof_debug("performance profiler: too many threads, not sampling"
+                 " wall clock time of thread 0x%lx\n",
+                 (unsigned long) pthread_self());
+  pthread_mutex_unlock(&s_walllock);
+}
+
+/** Remove an exiting thread from the wall clock sampler.  */
+static void
+unregisterWallThread(void *arg)
+{
+  pid_t tid = (pid_t) (intptr_t) arg;
+  pthread_mutex_lock(&s_walllock);
+  for (int i = 0; i < s_nwalltids; ++i)
+    if (s_walltids[i] == tid)
+    {
+      s_walltids[i] = s_walltids[--s_nwalltids];
+      break;
+    }
+  pthread_mutex_unlock(&s_walllock);
+}
+
+/** Wall clock sampler thread.  Signals every registered thread at a
+    fixed rate whether the thread is running or not, so time spent
+    blocked in the kernel is sampled just like time spent computing.
+    Ticks missed because the sampler itself was delayed are skipped
+    rather than sent in a burst.  No signals are sent while a thread
+    is blinking for fork() or system().
+
+    Note that system calls which are never restarted after a signal
+    handler, such as nanosleep(), select() and epoll_wait(), will
+    return early with EINTR in the sampled threads.  */
+static void *
+wallSamplerThread(void *)
+{
+  pid_t pid = getpid();
+  timespec next, now;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (s_igprof_activated)
+  {
+    next.tv_nsec += 1000L * s_interval;
+    while (next.tv_nsec >= 1000000000L)
+    {
+      next.tv_nsec -= 1000000000L;
+      ++next.tv_sec;
+    }
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0) == EINTR)
+      ;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - next.tv_sec) * 1000000000LL
+        + (now.tv_nsec - next.tv_nsec) > 1000LL * s_interval)
+      next = now;
+
+    if (s_wallblink)
+      continue;
+
+    pthread_mutex_lock(&s_walllock);
+    for (int i = 0; i < s_nwalltids; ++i)
+      syscall(SYS_tgkill, pid, s_walltids[i], s_signal);
+    pthread_mutex_unlock(&s_walllock);
+  }
+
+  return 0;
+}
+#endif
+
+/** Set the profiling timer, either the process-wide interval timer
+    or the per-thread cpu time timer of the calling thread, returning
+    the previous setting in @a old if non-null.  The per-thread timer
+    is converted to and from #itimerval so callers need not care. */
+static int
+setTimer(const itimerval *value, itimerval *old)
+{
+#if __linux
+  if (s_thread)
+  {
+    PerfThreadTimer *timer
+      = (PerfThreadTimer *) pthread_getspecific(s_timerkey);
+    if (! timer)
+      return -1;
+
+    itimerspec nval, oval;
+    nval.it_interval.tv_sec = value->it_interval.tv_sec;
+    nval.it_interval.tv_nsec = value->it_interval.tv_usec * 1000;
+    nval.it_value.tv_sec = value->it_value.tv_sec;
+    nval.it_value.tv_nsec = value->it_value.tv_usec * 1000;
+    if (timer_settime(timer->id, 0, &nval, &oval) != 0)
+      return -1;
+
+    if (old)
+    {
+      old->it_interval.tv_sec = oval.it_interval.tv_sec;
+      old->it_interval.tv_usec = oval.it_interval.tv_nsec / 1000;
+      old->it_value.tv_sec = oval.it_value.tv_sec;
+      old->it_value.tv_usec = oval.it_value.tv_nsec / 1000;
+    }
+    return 0;
+  }
+#endif
+  return setitimer(s_itimer, value, old);
+}
+
+/** Get the current profiling timer setting.  See #setTimer().  */
+static int
+getTimer(itimerval *value)
+{
+#if __linux
+  if (s_thread)
+  {
+    PerfThreadTimer *timer
+      = (PerfThreadTimer *) pthread_getspecific(s_timerkey);
+    itimerspec val;
+    if (! timer || timer_gettime(timer->id, &val) != 0)
+      return -1;
+
+    value->it_interval.tv_sec = val.it_interval.tv_sec;
+    value->it_interval.tv_usec = val.it_interval.tv_nsec / 1000;
+    value->it_value.tv_sec = val.it_value.tv_sec;
+    value->it_value.tv_usec = val.it_value.tv_nsec / 1000;
+    return 0;
+  }
+#endif
+  return getitimer(s_itimer, value);
 }
 
 /** Enable profiling timer.  You should have called
@@ -74,8 +489,34 @@ profileSignalHandler(int /* nsig */, siginfo_t * /* info */, void * /* ctx */)
 static void
 enableTimer(void)
 {
-  itimerval interval = { { 0, 5000 }, { 0, 5000 } };
-  setitimer(s_itimer, &interval, 0);
+  int usecs = s_interval;
+  itimerval interval = { { usecs / 1000000, usecs % 1000000 },
+                         { usecs / 1000000, usecs % 1000000 } };
+#if __linux
+  PerfThreadTimer *timer
+    = (PerfThreadTimer *) (s_thread ? pthread_getspecific(s_timerkey) : 0);
+  if (timer)
+    timer->interval = usecs;
+#endif
+  setTimer(&interval, 0);
+}
+
+/** Change the sampling rate to @a hz samples per second, for the
+    control socket "set-rate" command.  Ticks are counted in
+    microseconds, so any rate up to one sample per microsecond can be
+    used.  Per-thread timers pick up the new rate at their next tick.  */
+static bool
+setRate(long hz)
+{
+  if (hz <= 0 || hz > 1000000)
+    return false;
+
+  s_interval = 1000000 / hz;
+  if (! s_thread && ! s_wall)
+    enableTimer();
+
+  igprof_debug("performance profiler: sampling every %d us\n", s_interval);
+  return true;
 }
 
 /** Enable profiling signal handler.  */
@@ -100,10 +541,56 @@ threadInit(void)
 {
   // Enable profiling in this thread.
   enableSignalHandler();
+#if __linux
+  if (s_wall)
+  {
+    registerWallThread();
+    return;
+  }
+  if (s_nevents)
+  {
+    createThreadEvents();
+    return;
+  }
+  // The main thread already got its timer in initialize().
+  if (s_thread && ! pthread_getspecific(s_timerkey) && ! createThreadTimer())
+    return;
+#endif
   enableTimer();
 }
 
 // -------------------------------------------------------------------
+/** Parse a '+' separated list of software event names for the perf
+    event backend, advancing @a options past the list.  */
+static void
+parseEvents(const char *&options)
+{
+  while (*options && *options != ':' && *options != ',' && *options != ' ')
+  {
+    size_t len = strcspn(options, "+:, ");
+#if __linux
+    PerfEventDef *def = s_eventdefs;
+    while (def->name
+           && (strlen(def->name) != len || strncmp(def->name, options, len)))
+      ++def;
+
+    if (! def->name)
+      fprintf(stderr, "IgProf: unknown perf event '%.*s'\n",
+              (int) len, options);
+    else if (s_nevents == IgProfTrace::MAX_COUNTERS)
+      fprintf(stderr, "IgProf: at most %d perf events can be used at once\n",
+              IgProfTrace::MAX_COUNTERS);
+    else
+      s_events[s_nevents++] = def;
+#else
+    fprintf(stderr, "IgProf: perf events are not supported on this system\n");
+#endif
+    options += len;
+    if (*options == '+')
+      ++options;
+  }
+}
+
 /** Possibly start performance profiler.  */
 static void
 initialize(void)
@@ -143,6 +630,35 @@ initialize(void)
           s_itimer = ITIMER_PROF;
           options += 7;
         }
+        else if (! strncmp(options, ":wall", 5))
+        {
+          s_wall = true;
+          options += 5;
+        }
+        else if (! strncmp(options, ":thread", 7))
+        {
+          s_thread = true;
+          options += 7;
+        }
+        else if (! strncmp(options, ":hz=", 4))
+        {
+          char *end = 0;
+          long hz = strtol(options+4, &end, 10);
+          if (hz > 0 && hz <= 1000000)
+            s_interval = 1000000 / hz;
+          options = end;
+        }
+        else if (! strncmp(options, ":events=", 8))
+        {
+          options += 8;
+          parseEvents(options);
+        }
+        else if (! strncmp(options, ":period=", 8))
+        {
+          char *end = 0;
+          s_period = strtoull(options+8, &end, 10);
+          options = end;
+        }
         else if (! strncmp(options, ":keep", 5))
         {
           s_keep = true;
@@ -162,21 +678,104 @@ initialize(void)
   if (! enable)
     return;
 
-  double clockres = 0;
-  itimerval precision;
-  itimerval interval = { { 0, 5000 }, { 100, 0 } };
-  itimerval nullified = { { 0, 0 }, { 0, 0 } };
-  setitimer(s_itimer, &interval, 0);
-  getitimer(s_itimer, &precision);
-  setitimer(s_itimer, &nullified, 0);
-  clockres = precision.it_interval.tv_sec
-             + 1e-6 * precision.it_interval.tv_usec;
-
-  if (! igprof_init("performance profiler", &threadInit, true, clockres))
+#if __linux
+  // The wall clock sampler replaces the timers and event backends.
+  if (s_wall)
+  {
+    s_nevents = 0;
+    s_thread = false;
+    s_signal = SIGPROF;
+    s_itimer = ITIMER_PROF;
+    pthread_key_create(&s_wallkey, &unregisterWallThread);
+  }
+
+  // The perf event backend replaces the interval timers.  Drop the
+  // events this kernel refuses to open, and signal overflows with a
+  // queued real-time signal so overflows of different events are
+  // never merged; a lost signal would leave its event disarmed.
+  else if (s_nevents)
+  {
+    int n = 0;
+    for (int i = 0; i < s_nevents; ++i)
+    {
+      PerfEventDef *def = s_events[i];
+      if (! def->period)
+        def->period = 1000ULL * s_interval;
+      else if (s_period)
+        def->period = s_period;
+
+      int fd = openEvent(def, 0, false);
+      if (fd < 0)
+        fprintf(stderr, "IgProf: perf event %s not available: %s\n",
+                def->name, strerror(errno));
+      else
+      {
+        close(fd);
+        s_events[n++] = def;
+      }
+    }
+
+    if (! (s_nevents = n))
+      return;
+
+    s_thread = false;
+    s_signal = SIGRTMIN + 3;
+    pthread_key_create(&s_eventkey, &freeThreadEvents);
+  }
+
+  // Per-thread timers always measure thread cpu time, and use the
+  // same signal as the process cpu time timer.
+  else if (s_thread)
+  {
+    s_signal = SIGPROF;
+    s_itimer = ITIMER_PROF;
+    pthread_key_create(&s_timerkey, &freeThreadTimer);
+    if (! createThreadTimer())
+      return;
+  }
+#else
+  if (s_thread || s_wall)
+  {
+    igprof_debug("performance profiler: per-thread timers and wall clock"
+                 " sampling not supported\n");
+    s_thread = s_wall = false;
+  }
+#endif
+
+  // Ticks are counted in microseconds of the interval the timer really
+  // uses, which the kernel may have rounded from the one requested.
+  if (! s_nevents && ! s_wall)
+  {
+    itimerval precision;
+    itimerval interval = { { s_interval / 1000000, s_interval % 1000000 },
+                           { 100, 0 } };
+    itimerval nullified = { { 0, 0 }, { 0, 0 } };
+    setTimer(&interval, 0);
+    getTimer(&precision);
+    setTimer(&nullified, 0);
+    if (int usecs = precision.it_interval.tv_sec * 1000000
+                    + precision.it_interval.tv_usec)
+      s_interval = usecs;
+  }
+
+  if (! igprof_init("performance profiler", &threadInit, true, 1e-6))
     return;
 
   igprof_disable_globally();
-  if (s_itimer == ITIMER_REAL)
+  if (s_wall)
+    igprof_debug("performance profiler: measuring wall clock time\n");
+  else if (s_nevents)
+  {
+#if __linux
+    for (int i = 0; i < s_nevents; ++i)
+      igprof_debug("performance profiler: sampling %s event every %llu\n",
+                   s_events[i]->name,
+                   (unsigned long long) s_events[i]->period);
+#endif
+  }
+  else if (s_thread)
+    igprof_debug("performance profiler: measuring per-thread cpu time\n");
+  else if (s_itimer == ITIMER_REAL)
     igprof_debug("performance profiler: measuring real time\n");
   else if (s_itimer == ITIMER_VIRTUAL)
     igprof_debug("performance profiler: measuring user time\n");
@@ -188,10 +787,16 @@ initialize(void)
   IgHook::hook(dosystem_hook_main.raw);
   IgHook::hook(dopthread_sigmask_hook_main.raw);
   IgHook::hook(dosigaction_hook_main.raw);
-  igprof_debug("performance profiler enabled\n");
+  if (! s_nevents)
+    igprof_set_rate_handler(&setRate);
+  igprof_debug("performance profiler enabled, sampling every %d us\n",
+               s_interval);
 
-  enableSignalHandler();
-  enableTimer();
+  threadInit();
+#if __linux
+  if (s_wall)
+    igprof_create_helper_thread(&s_wallthread, &wallSamplerThread, 0);
+#endif
   igprof_enable_globally();
 }
 
@@ -202,14 +807,17 @@ dopthread_sigmask(IgHook::SafeData<igprof_dopthread_sigmask_t> &hook,
                   int how, sigset_t *newmask,  sigset_t *oldmask)
 {
   struct sigaction cursig;
-  struct itimerval curtimer;
+  struct itimerval curtimer = { { 0, 0 }, { 0, 0 } };
   if (newmask
       && (how == SIG_BLOCK || how == SIG_SETMASK)
       && sigismember(newmask, s_signal)
       && sigaction(s_signal, 0, &cursig) == 0
       && cursig.sa_handler
-      && getitimer(s_itimer, &curtimer) == 0
-      && (curtimer.it_interval.tv_sec || curtimer.it_interval.tv_usec))
+      && (s_nevents
+          || s_wall
+          || (getTimer(&curtimer) == 0
+              && (curtimer.it_interval.tv_sec
+                  || curtimer.it_interval.tv_usec))))
   {
     igprof_debug("pthread_sigmask(): prevented profiling signal"
                  " %d from being blocked in thread 0x%lx"
@@ -255,7 +863,9 @@ static int
 dofork(IgHook::SafeData<igprof_dofork_t> &hook)
 {
   // Slow down profiling to once per 10sec, which should be slow
-  // enough to complete fork() under any circumstances.
+  // enough to complete fork() under any circumstances.  The perf
+  // events and the wall clock sampler have no interval timer to slow
+  // down, and are instead paused below without accounting ticks.
   double ival;
   double dt = 0;
   int nticks = 0;
@@ -265,26 +875,63 @@ dofork(IgHook::SafeData<igprof_dofork_t> &hook)
   itimerval slow = { { 10, 0 }, { 10, 0 } };
   itimerval fast = { { 0, 5000 }, { 0, 5000 } };
   itimerval left = { { 0, 0 }, { 0, 0 } };
-  getitimer(s_itimer, &left);
-  setitimer(s_itimer, &slow, &orig);
-  getitimer(s_itimer, &slow);
-  dt = tv2sec(left.it_interval) - tv2sec(left.it_value);
+  bool timed = ! s_nevents && ! s_wall;
+  if (timed)
+  {
+    getTimer(&left);
+    setTimer(&slow, &orig);
+    getTimer(&slow);
+    dt = tv2sec(left.it_interval) - tv2sec(left.it_value);
+  }
+#if __linux
+  toggleThreadEvents(false);
+  IgProfAtomicInc(&s_wallblink);
+#endif
 
   // Do the fork() call.
   int ret = hook.chain();
 
+#if __linux
+  // Perf events are not inherited, and the descriptors the child did
+  // inherit still count the parent thread, so open fresh ones.
+  if (ret == 0 && s_nevents)
+    createThreadEvents();
+  else
+    toggleThreadEvents(true);
+
+  // The child has only this thread and no wall clock sampler.  The
+  // sampler lock may have been held at fork(), so reinitialise it.
+  IgProfAtomicDec(&s_wallblink);
+  if (ret == 0 && s_wall)
+  {
+    pthread_mutex_init(&s_walllock, 0);
+    s_nwalltids = 0;
+    registerWallThread();
+    igprof_create_helper_thread(&s_wallthread, &wallSamplerThread, 0);
+  }
+#endif
+
   // Now calculate how much time we spent doing the fork, and blame
   // the actual system call for it, drop this frame out of stack.
   // Assign costs to the parent, but re-enable timer also in child.
   // Normally we reset profiles in child, but allow an override.
   if (ret >= 0)
   {
-    getitimer(s_itimer, &left);
-    setitimer(s_itimer, &orig, 0);
-    getitimer(s_itimer, &fast);
-    ival = tv2sec(fast.it_interval);
-    dt += tv2sec(slow.it_value) - tv2sec(left.it_value);
-    nticks = (ival > 0 ? int(dt / ival + 0.5) : 0);
+#if __linux
+    // Timers created with timer_create() are not inherited by the
+    // child, so give the forking thread of the child a fresh one.
+    if (ret == 0 && s_thread)
+      createThreadTimer();
+#endif
+    if (timed)
+    {
+      getTimer(&left);
+      setTimer(&orig, 0);
+      getTimer(&fast);
+      ival = tv2sec(fast.it_interval);
+      dt += tv2sec(slow.it_value) - tv2sec(left.it_value);
+      nticks = (ival > 0 ? int(dt / ival + 0.5) : 0);
+    }
 
     if (ret == 0)
     {
@@ -307,7 +954,8 @@ dofork(IgHook::SafeData<igprof_dofork_t> &hook)
       // Replace top stack frame (this hook) with the original.
       if (depth > 0) addresses[0] = __extension__ (void *) hook.original;
       frame = buf->push(addresses, depth);
-      buf->tick(frame, &s_ct_ticks, 1, nticks);
+      buf->tick(frame, &s_ct_ticks,
+                IgProfTrace::Value(nticks * ival * 1e6 + .5), nticks);
       buf->traceperf(depth, tstart, tend);
     }
 
@@ -337,19 +985,35 @@ dosystem(IgHook::SafeData<igprof_dosystem_t> &hook, const char *cmd)
   itimerval slow = { { 10, 0 }, { 10, 0 } };
   itimerval fast = { { 0, 5000 }, { 0, 5000 } };
   itimerval left = { { 0, 0 }, { 0, 0 } };
-  getitimer(s_itimer, &left);
-  setitimer(s_itimer, &slow, &orig);
-  getitimer(s_itimer, &slow);
-  dt = tv2sec(left.it_interval) - tv2sec(left.it_value);
+  bool timed = ! s_nevents && ! s_wall;
+  if (timed)
+  {
+    getTimer(&left);
+    setTimer(&slow, &orig);
+    getTimer(&slow);
+    dt = tv2sec(left.it_interval) - tv2sec(left.it_value);
+  }
+#if __linux
+  toggleThreadEvents(false);
+  IgProfAtomicInc(&s_wallblink);
+#endif
 
   int ret = hook.chain(cmd);
 
-  getitimer(s_itimer, &left);
-  setitimer(s_itimer, &orig, 0);
-  getitimer(s_itimer, &fast);
-  ival = tv2sec(fast.it_interval);
-  dt += tv2sec(slow.it_value) - tv2sec(left.it_value);
-  nticks = (ival > 0 ? int(dt / ival + 0.5) : 0);
+#if __linux
+  toggleThreadEvents(true);
+  IgProfAtomicDec(&s_wallblink);
+#endif
+
+  if (timed)
+  {
+    getTimer(&left);
+    setTimer(&orig, 0);
+    getTimer(&fast);
+    ival = tv2sec(fast.it_interval);
+    dt += tv2sec(slow.it_value) - tv2sec(left.it_value);
+    nticks = (ival > 0 ? int(dt / ival + 0.5) : 0);
+  }
   if (enabled && nticks && (buf = igprof_buffer()))
   {
     void *addresses[IgProfTrace::MAX_DEPTH];
@@ -364,7 +1028,8 @@ dosystem(IgHook::SafeData<igprof_dosystem_t> &hook, const char *cmd)
     // Replace top stack frame (this hook) with the original.
     if (depth > 0) addresses[0] = __extension__ (void *) hook.original;
     frame = buf->push(addresses, depth);
-    buf->tick(frame, &s_ct_ticks, 1, nticks);
+    buf->tick(frame, &s_ct_ticks,
+              IgProfTrace::Value(nticks * ival * 1e6 + .5), nticks);
     buf->traceperf(depth, tstart, tend);
   }
 
@@ -5,15 +5,26 @@
 #if DEBUG
 IgProfTrace::Counter IgProfTrace::FREED;
 #endif
+IgProfTrace::CounterDef IgProfTrace::UNTRACKED =
+  { "IGPROF_UNTRACKED", IgProfTrace::TICK, -1, 0, 0 };
 
 /** Initialise a trace buffer.  */
 IgProfTrace::IgProfTrace(void)
   : hashLogSize_(20),
     hashUsed_(0),
     restable_(0),
+    oldLogSize_(0),
+    oldMigrated_(0),
+    oldtable_(0),
+    kidLogSize_(0),
+    kidUsed_(0),
+    kidtable_(0),
     callcache_(0),
     resfree_(0),
-    stack_(0)
+    stack_(0),
+    epoch_(0),
+    tickValue_(0),
+    tickPeak_(0)
 {
   pthread_mutex_init(&mutex_, 0);
 
@@ -22,6 +33,8 @@ IgProfTrace::IgProfTrace(void)
   // allocate it separately.  Note the memory obtained here starts out
   // as zeroed out.
   restable_ = (HResource *) allocateRaw((1u << hashLogSize_)*sizeof(HResource));
+  if (! restable_)
+    igprof_abort();
 
   // Allocate the call cache next.
   callcache_ = (StackCache *) allocateSpace(MAX_DEPTH*sizeof(StackCache));
@@ -40,23 +53,39 @@ IgProfTrace::IgProfTrace(void)
   perfStats_.sum2Ticks = 0;
   perfStats_.sumTPerD  = 0;
   perfStats_.sum2TPerD = 0;
+  perfStats_.noverflow = 0;
+  perfStats_.nuntracked = 0;
 }
 
 IgProfTrace::~IgProfTrace(void)
 {
+  trackMemory(-trackedEntries(hashUsed_, sizeof(HResource))
+	      - trackedEntries(kidUsed_, sizeof(HChild)));
   if (restable_)
     unallocateRaw(restable_, (1u << hashLogSize_) * sizeof(HResource));
+  if (oldtable_)
+    unallocateRaw(oldtable_, (1u << oldLogSize_) * sizeof(HResource));
+  if (kidtable_)
+    unallocateRaw(kidtable_, (1u << kidLogSize_) * sizeof(HChild));
 }
 
 void
 IgProfTrace::reset(void)
 {
   // Free all pools, then create a new one.
+  trackMemory(-trackedEntries(hashUsed_, sizeof(HResource))
+	      - trackedEntries(kidUsed_, sizeof(HChild)));
   freePools();
   initPool();
 
   // Reset member variables back to initial values. Keep restable but reset it.
   memset(restable_, 0, (1u << hashLogSize_)*sizeof(HResource));
+  if (oldtable_)
+    unallocateRaw(oldtable_, (1u << oldLogSize_) * sizeof(HResource));
+  oldtable_ = 0;
+  if (kidtable_)
+    memset(kidtable_, 0, (1u << kidLogSize_)*sizeof(HChild));
+  kidUsed_ = 0;
   callcache_ = (StackCache *) allocateSpace(MAX_DEPTH*sizeof(StackCache));
   stack_ = allocate<Stack>();
   hashUsed_ = 0;
@@ -69,14 +98,103 @@ IgProfTrace::reset(void)
   perfStats_.sum2Ticks = 0;
   perfStats_.sumTPerD  = 0;
   perfStats_.sum2TPerD = 0;
+  perfStats_.noverflow = 0;
+  perfStats_.nuntracked = 0;
 }
 
+/** Expand the resource hash.  Allocates a four times larger hash and
+    leaves the resources in the old one to be moved over gradually by
+    #migrateResources() as new resources are acquired.  If there is no
+    memory for it, marks the buffer full instead.  */
 void
 IgProfTrace::expandResourceHash(void)
 {
+  // Finish moving resources out of the previous old hash first.  This
+  // is rare, the new hash fills up much slower than it is migrated.
+  if (oldtable_ && ! migrateResources(1u << oldLogSize_))
+    return;
+
+  __extension__
+    igprof_debug("expanding resource hash table for %p"
+		 " from 2^%ju to 2^%ju, %ju used\n",
+		 (void *) this, (uintmax_t) hashLogSize_,
+		 (uintmax_t) hashLogSize_ + 2, (uintmax_t) hashUsed_);
+  HResource *newTable = (HResource *)
+    allocateRaw((1u << (hashLogSize_ + 2)) * sizeof(HResource));
+  if (! newTable)
+  {
+    setFull();
+    return;
+  }
+
+  oldtable_ = restable_;
+  oldLogSize_ = hashLogSize_;
+  oldMigrated_ = 0;
+  hashLogSize_ += 2;
+  restable_ = newTable;
+}
+
+/** Move the resources in the next @a n slots of the old resource hash
+    to the current one.  Releases the old hash once it is empty.
+
+    If a resource cannot be placed within MAX_HASH_PROBES steps in the
+    current hash, falls back to rebuilding a bigger hash of all the
+    resources in one go with #rehashResources() and returns false.  */
+bool
+IgProfTrace::migrateResources(size_t n)
+{
+  size_t oldSize = (1u << oldLogSize_);
+  size_t size = (1u << hashLogSize_);
+  size_t end = (n < oldSize - oldMigrated_ ? oldMigrated_ + n : oldSize);
+  for ( ; oldMigrated_ < end; ++oldMigrated_)
+  {
+    HResource *old = &oldtable_[oldMigrated_];
+    if (! old->record)
+      continue;
+
+    HResource *hr = 0;
+    size_t slot = hash(old->resource, 8);
+    for (size_t i = 0; i < MAX_HASH_PROBES && ! hr; ++i, ++slot)
+      if (! restable_[slot & (size-1)].record)
+	hr = &restable_[slot & (size-1)];
+
+    if (UNLIKELY(! hr))
+    {
+      __extension__
+	igprof_debug("rehash of 0x%jx[%ju] failed, re-expanding"
+		     " another time\n", (uintmax_t) old->resource,
+		     (uintmax_t) oldMigrated_);
+      rehashResources();
+      return false;
+    }
+
+    *hr = *old;
+    hr->record->hashslot = hr;
+    old->resource = 0;
+    old->record = 0;
+  }
+
+  if (oldMigrated_ == oldSize)
+  {
+    unallocateRaw(oldtable_, oldSize * sizeof(HResource));
+    oldtable_ = 0;
+  }
+
+  return true;
+}
+
+/** Rebuild the resource hash in one go, with the resources from both
+    the current and the old hash, into a hash four times larger than
+    the current one, or larger still if needed to place all of them
+    within MAX_HASH_PROBES steps.  If there is no memory for it, leaves
+    the hashes as they are and marks the buffer full.  */
+void
+IgProfTrace::rehashResources(void)
+{
+  HResource *tables[2] = { restable_, oldtable_ };
+  size_t sizes[2] = { 1u << hashLogSize_, oldtable_ ? 1u << oldLogSize_ : 0 };
   HResource *newTable;
-  size_t i, j, slot;
-  size_t oldSize = (1u << hashLogSize_);
+  size_t i, j, t, slot;
   size_t newLogSize = hashLogSize_;
   size_t newSize;
 
@@ -84,43 +202,125 @@ TRY_AGAIN:
   newLogSize += 2;
   newSize = (1u << newLogSize);
   newTable = (HResource *) allocateRaw(newSize * sizeof(HResource));
-  __extension__
-    igprof_debug("expanding resource hash table for %p"
-		 " from 2^%ju to 2^%ju, %ju used\n",
-		 (void *) this, (uintmax_t) hashLogSize_,
-		 (uintmax_t) newLogSize, (uintmax_t) hashUsed_);
-  for (i = 0; i < oldSize; ++i)
+  if (! newTable)
   {
-    if (! restable_[i].record)
-      continue;
+    // Undo the moves into the tables that failed to take them all.
+    for (t = 0; t < 2; ++t)
+      for (i = 0; i < sizes[t]; ++i)
+	if (tables[t][i].record)
+	  tables[t][i].record->hashslot = &tables[t][i];
+    setFull();
+    return;
+  }
 
-    slot = hash(restable_[i].resource, 8);
-    for (j = 0; true; ++slot)
+  __extension__
+    igprof_debug("rebuilding resource hash table for %p"
+		 " at 2^%ju, %ju used\n",
+		 (void *) this, (uintmax_t) newLogSize, (uintmax_t) hashUsed_);
+  for (t = 0; t < 2; ++t)
+    for (i = 0; i < sizes[t]; ++i)
     {
-      slot &= newSize-1;
-      if (LIKELY(! newTable[slot].record))
-      {
-	newTable[slot] = restable_[i];
-	restable_[i].record->hashslot = &newTable[slot];
-	break;
-      }
+      HResource *hr = &tables[t][i];
+      if (! hr->record)
+	continue;
 
-      if (UNLIKELY(++j == MAX_HASH_PROBES))
+      slot = hash(hr->resource, 8);
+      for (j = 0; true; ++slot)
       {
-	__extension__
-	  igprof_debug("rehash of 0x%jx[%ju -> %ju] failed,"
-		       " re-expanding another time\n",
-		       (uintmax_t) restable_[i].resource,
-		       (uintmax_t) i, (uintmax_t) slot);
-        unallocateRaw(newTable, newSize * sizeof(HResource));
-        goto TRY_AGAIN;
+	slot &= newSize-1;
+	if (LIKELY(! newTable[slot].record))
+	{
+	  newTable[slot] = *hr;
+	  hr->record->hashslot = &newTable[slot];
+	  break;
+	}
+
+	if (UNLIKELY(++j == MAX_HASH_PROBES))
+	{
+	  __extension__
+	    igprof_debug("rehash of 0x%jx[%ju -> %ju] failed,"
+			 " re-expanding another time\n",
+			 (uintmax_t) hr->resource,
+			 (uintmax_t) i, (uintmax_t) slot);
+	  unallocateRaw(newTable, newSize * sizeof(HResource));
+	  goto TRY_AGAIN;
+	}
       }
     }
-  }
 
-  unallocateRaw(restable_, oldSize * sizeof(HResource));
+  unallocateRaw(restable_, sizes[0] * sizeof(HResource));
+  if (oldtable_)
+    unallocateRaw(oldtable_, sizes[1] * sizeof(HResource));
   hashLogSize_ = newLogSize;
   restable_ = newTable;
+  oldtable_ = 0;
+}
+
+/** Enter the new child @a kid of @a parent into the child index.  If
+    @a parent just got enough children to be indexed, enters all its
+    children.  Creates the index on first use, and grows it to keep it
+    at most half full so lookups stay short.  If there is no memory to
+    create or grow it, the children are left out and marks the buffer
+    full: lookups then fall back on the sibling list.  */
+void
+IgProfTrace::indexChild(Stack *parent, Stack *kid)
+{
+  ASSERT(parent->nchildren >= CHILD_INDEX_MIN);
+  if (! kidtable_)
+  {
+    if (! (kidtable_ = (HChild *) allocateRaw((1u << 10)*sizeof(HChild))))
+    {
+      setFull();
+      return;
+    }
+    kidLogSize_ = 10;
+  }
+
+  // Enter just the new child, or all the children when the parent
+  // has just reached the threshold.
+  Stack *end = nextSibling(kid);
+  if (parent->nchildren == CHILD_INDEX_MIN)
+  {
+    kid = firstChild(parent);
+    end = 0;
+  }
+
+  for ( ; kid != end; kid = nextSibling(kid))
+  {
+    if (2 * (kidUsed_ + 1) > (1u << kidLogSize_) && ! expandChildIndex())
+      return;
+
+    HChild *hc = findChild(parent, kid->address);
+    ASSERT(! hc->child);
+    hc->parent = parent;
+    hc->address = kid->address;
+    hc->child = kid;
+    trackEntries(++kidUsed_, sizeof(HChild), true);
+  }
+}
+
+/** Double the size of the child index.  Returns false and marks the
+    buffer full if there is no memory for it.  */
+bool
+IgProfTrace::expandChildIndex(void)
+{
+  HChild *oldTable = kidtable_;
+  size_t oldSize = (1u << kidLogSize_);
+  HChild *newTable = (HChild *) allocateRaw(2 * oldSize * sizeof(HChild));
+  if (! newTable)
+  {
+    setFull();
+    return false;
+  }
+
+  kidLogSize_ += 1;
+  kidtable_ = newTable;
+  for (size_t i = 0; i < oldSize; ++i)
+    if (oldTable[i].child)
+      *findChild(oldTable[i].parent, oldTable[i].address) = oldTable[i];
+
+  unallocateRaw(oldTable, oldSize * sizeof(HChild));
+  return true;
 }
 
 void
@@ -132,7 +332,7 @@ IgProfTrace::mergeFrom(IgProfTrace &other)
   // Scan stack tree and insert each call stack, including resources.
   void *callstack[MAX_DEPTH+1];
   callstack[MAX_DEPTH] = stack_->address; // null really
-  mergeFrom(0, other.stack_, &callstack[MAX_DEPTH]);
+  mergeFrom(other, 0, other.stack_, &callstack[MAX_DEPTH]);
   perfStats_ += other.perfStats_;
 
   pthread_mutex_unlock(&other.mutex_);
@@ -140,18 +340,18 @@ IgProfTrace::mergeFrom(IgProfTrace &other)
 }
 
 void
-IgProfTrace::mergeFrom(int depth, Stack *frame, void **callstack)
+IgProfTrace::mergeFrom(IgProfTrace &other, int depth, Stack *frame,
+		       void **callstack)
 {
-  // Process counters at this call stack level.
-  Stack *myframe = push(callstack, depth);
-  Counter **ptr = &frame->counters[0];
-  for (int i = 0; i < MAX_COUNTERS && *ptr; ++i, ++ptr)
+  // Process counters at this call stack level.  The stack already
+  // has any synthetic root frames of the thread which recorded it.
+  Stack *myframe = push(callstack, depth, false);
+  for (Counter *c = other.firstCounter(frame); c; c = other.nextCounter(c))
   {
-    Counter *c = *ptr;
     if (c->ticks && ! c->resources)
       tick(myframe, c->def, c->value, c->ticks);
     else if (c->ticks)
-      for (Resource *r = c->resources; r; r = r->nextlive)
+      for (Resource *r = other.firstResource(c); r; r = r->nextlive)
       {
         Counter *ctr = tick(myframe, c->def, r->size, 1);
 	acquire(ctr, r->hashslot->resource, r->size);
@@ -163,11 +363,11 @@ IgProfTrace::mergeFrom(int depth, Stack *frame, void **callstack)
   }
 
   // Merge the children.
-  for (frame = frame->children; frame; frame = frame->sibling)
+  for (frame = other.firstChild(frame); frame; frame = other.nextSibling(frame))
   {
     ASSERT(depth < MAX_DEPTH);
     callstack[-1] = frame->address;
-    mergeFrom(depth+1, frame, &callstack[-1]);
+    mergeFrom(other, depth+1, frame, &callstack[-1]);
   }
 }
 
@@ -179,18 +379,16 @@ IgProfTrace::debugDumpStack(Stack *s, int depth)
   INDENT(2*depth);
   fprintf(stderr, "STACK %d frame=%p addr=%p next=%p kids=%p\n",
           depth, (void *)s, (void *)s->address,
-          (void *)s->sibling, (void *)s->children);
+          (void *)nextSibling(s), (void *)firstChild(s));
 
-  Counter **ptr = &s->counters[0];
-  for (int i = 0; i < MAX_COUNTERS && *ptr; ++i, ++ptr)
+  for (Counter *c = firstCounter(s); c; c = nextCounter(c))
   {
-    Counter *c = *ptr;
     INDENT(2*depth+1);
     __extension__
       fprintf(stderr, "COUNTER ctr=%p %s %ju %ju %ju\n",
 	      (void *)c, c->def->name, c->ticks, c->value, c->peak);
 
-    for (Resource *r = c->resources; r; r = r->nextlive)
+    for (Resource *r = firstResource(c); r; r = r->nextlive)
     {
       INDENT(2*depth+2);
       __extension__
@@ -200,7 +398,7 @@ IgProfTrace::debugDumpStack(Stack *s, int depth)
     }
   }
 
-  for (Stack *kid = s->children; kid; kid = kid->sibling)
+  for (Stack *kid = firstChild(s); kid; kid = nextSibling(kid))
     debugDumpStack(kid, depth+1);
 }
 
@@ -209,6 +407,7 @@ IgProfTrace::debugDump(void)
 {
   fprintf(stderr, "TRACE BUFFER %p:\n", (void *)this);
   fprintf(stderr, " RESTABLE:  %p\n", (void *)restable_);
+  fprintf(stderr, " OLDTABLE:  %p\n", (void *)oldtable_);
   fprintf(stderr, " CALLCACHE: %p\n", (void *)callcache_);
 
   debugDumpStack(stack_, 0);
@@ -39,8 +39,13 @@
 
     The stack trace is represented as a tree of nodes keyed by call
     address. Each stack frame has a singly linked list of children,
-    the addresses called from that stack frame. A frame also has
-    pointers to profiling counters associated with that call tree.
+    the addresses called from that stack frame. A frame also has a
+    singly linked list of profiling counters associated with that
+    call tree.  The counters are not stored in the stack nodes: most
+    nodes are inner frames without counters of their own, and in
+    memory profiles the nodes which do have counters have three.  The
+    links are buffer references, see IgProfBuffer, so walk the tree
+    with firstChild(), nextSibling() and friends.
     Each counter may point to a list of resources known to be live
     within that buffer; the resources linked with the counter form a
     singly linked list. The root of the stack trace is a null frame:
@@ -81,6 +86,18 @@ public:
   /// Maximum number of hashs probe steps to look for a resource.
   static const size_t MAX_HASH_PROBES = 32;
 
+  /// Number of slots of the old resource hash moved to the new one on
+  /// each resource insert while the hash is being expanded.
+  static const size_t HASH_MIGRATE_SLOTS = 32;
+
+  /// Number of children from which on a stack frame's children are
+  /// looked up in the child index rather than the sibling list.
+  static const unsigned CHILD_INDEX_MIN = 8;
+
+  /// Number of innermost stack frames kept of stack traces recorded
+  /// under the overflow frame once over the memory limit.
+  static const int OVERFLOW_DEPTH = 4;
+
   /// A value that might be an address, usually memory resource.
   typedef uintptr_t Address;
 
@@ -97,6 +114,8 @@ public:
     uint64_t    sum2Ticks;      //< sum(ticks_for_trace^2).
     uint64_t    sumTPerD;       //< sum((ticks << 4) / depth).
     uint64_t    sum2TPerD;      //< sum(((ticks << 4) / depth)^2).
+    uint64_t    noverflow;      //< Traces recorded under the overflow frame.
+    uint64_t    nuntracked;     //< Resources not tracked over the memory limit.
 
     PerfStat &operator+=(const PerfStat &other);
   };
@@ -115,9 +134,19 @@ public:
 #if DEBUG
     Stack       *parent;        //< The calling stack frame, or null for the root.
 #endif
-    Stack       *sibling;       //< The next child frame of the same parent.
-    Stack       *children;      //< The first child of this call frame.
-    Counter     *counters[MAX_COUNTERS]; //< The counters for this call frame.
+    Ref         sibling;        //< The next child frame of the same parent.
+    Ref         children;       //< The first child of this call frame.
+    Ref         counters;       //< The first counter of this call frame.
+    unsigned    id;             //< Stable ID in delta dumps, zero until dumped.
+    unsigned    nchildren;      //< Number of children of this call frame.
+  };
+
+  /// Child index entry.
+  struct HChild
+  {
+    Stack       *parent;        //< The calling stack frame.
+    void        *address;       //< Call address of the child.
+    Stack       *child;         //< The child stack frame, null if the slot is free.
   };
 
   /// Counter type.
@@ -137,6 +166,10 @@ public:
        of a live resource.  If it is 0, the full resource size is added
        to the leak counter. */
     Value (*derivedLeakSize)(Address address, size_t size);
+    /* Allows the values of a counter to be scaled on output, for
+       example to turn sampled values into estimates of the real ones.
+       If it is 0, the values are output as recorded. */
+    void (*scaleValues)(Value &ticks, Value &value, Value &peak);
   };
 
   /// Counter value.
@@ -146,8 +179,10 @@ public:
     Value       ticks;          //< The number of times the counter was increased.
     Value       value;          //< The accumulated counter value.
     Value       peak;           //< The maximum value of the counter at any time.
-    Resource    *resources;     //< The live resources linked to this counter.
-    Stack       *frame;         //< The stack node owning the counter.
+    Ref         resources;      //< The live resources linked to this counter.
+    Ref         frame;          //< The stack node owning the counter.
+    Ref         next;           //< The next counter of the same stack node.
+    unsigned    epoch;          //< Buffer epoch of the last change.
   };
 
   /* Both the resource hash and a counter points to a live resource
@@ -172,7 +207,12 @@ public:
      the free list). If the resource is not known in the trace buffer
      the release is ignored on the assumption the profiler missed the
      resource acquisition, for example because it wasn't active at
-     the time. */
+     the time.
+
+     When the hash fills up, a four times larger one is allocated and
+     the resources are moved to it a few slots at a time on each new
+     acquisition, so expanding a big hash does not stall the program.
+     Until all of them have been moved, lookups search both hashes.  */
 
   /// Resource entry for hash table.
   struct HResource
@@ -196,39 +236,70 @@ public:
 
   void			reset(void);
   void                  lock(void);
-  Stack *               push(void **stack, int depth);
+  Stack *               push(void **stack, int depth, bool roots = true);
   Counter *             tick(Stack *frame, CounterDef *def, Value amount, Value ticks);
   void                  acquire(Counter *ctr, Address resource, Value size);
-  void                  release(Address resource);
+  bool                  release(Address resource);
   HResource *           findResource(Address resource);
   void                  traceperf(int depth, uint64_t tstart, uint64_t tend);
   void                  mergeFrom(IgProfTrace &other);
   void                  unlock(void);
 
   Stack *               stackRoot(void) const;
+  Stack *               firstChild(Stack *frame) const;
+  Stack *               nextSibling(Stack *frame) const;
+  Counter *             firstCounter(Stack *frame) const;
+  Counter *             nextCounter(Counter *ctr) const;
+  Resource *            firstResource(Counter *ctr) const;
+  Stack *               counterFrame(Counter *ctr) const;
   const PerfStat &      perfStats(void) const;
+  size_t                memory(void) const;
+  unsigned              epoch(void) const;
+  void                  nextEpoch(void);
 
 private:
+  /// Memory limits for creating new stack nodes.
+  enum { NODE_LIMIT, NODE_RESERVE, NODE_ALWAYS };
+
   void                  expandResourceHash(void);
-  Stack *               childStackNode(Stack *parent, void *address);
+  bool                  migrateResources(size_t n);
+  void                  rehashResources(void);
+  Stack *               childStackNode(Stack *parent, void *address,
+				       int limit = NODE_LIMIT);
+  Stack *               overflowStackNode(void **stack, int depth);
+  void                  untrack(Counter *ctr, Value size);
+  HChild *              findChild(Stack *parent, void *address);
+  void                  indexChild(Stack *parent, Stack *kid);
+  bool                  expandChildIndex(void);
   void                  releaseResource(HResource *hres);
-  void                  mergeFrom(int depth, Stack *frame, void **callstack);
+  void                  mergeFrom(IgProfTrace &other, int depth,
+				  Stack *frame, void **callstack);
 
   void                  debugDump(void);
-  static void           debugDumpStack(Stack *s, int depth);
+  void                  debugDumpStack(Stack *s, int depth);
 
   pthread_mutex_t       mutex_;         //< Concurrency protection.
   size_t                hashLogSize_;   //< Log size of the resources hash.
   size_t                hashUsed_;      //< Occupancy in the resources hash.
   HResource             *restable_;     //< Start of the resources hash.
+  size_t                oldLogSize_;    //< Log size of the old resources hash.
+  size_t                oldMigrated_;   //< Slots of the old hash moved so far.
+  HResource             *oldtable_;     //< Old resources hash being moved, or null.
+  size_t                kidLogSize_;    //< Log size of the child index.
+  size_t                kidUsed_;       //< Occupancy in the child index.
+  HChild                *kidtable_;     //< Start of the child index, or null.
   StackCache            *callcache_;    //< Start of address cache.
   Resource              *resfree_;      //< Resource free list.
   Stack                 *stack_;        //< Stack root.
+  unsigned              epoch_;         //< Current change epoch.
+  Value                 tickValue_;     //< Last ticked counter value before the tick.
+  Value                 tickPeak_;      //< Last ticked counter peak before the tick.
   PerfStat		perfStats_;	//< Performance stats.
 
 #if DEBUG
   static Counter        FREED;		//< Pseudo-counter used to mark free list.
 #endif
+  static CounterDef     UNTRACKED;	//< Total of resources not tracked over the limit.
 
   // Unavailable copy constructor, assignment operator
   IgProfTrace(IgProfTrace &);
@@ -246,6 +317,36 @@ inline IgProfTrace::Stack *
 IgProfTrace::stackRoot (void) const
 { return stack_; }
 
+/** Return the first child of stack frame @a frame, or null.  */
+inline IgProfTrace::Stack *
+IgProfTrace::firstChild(Stack *frame) const
+{ return deref<Stack>(frame->children); }
+
+/** Return the next sibling of stack frame @a frame, or null.  */
+inline IgProfTrace::Stack *
+IgProfTrace::nextSibling(Stack *frame) const
+{ return deref<Stack>(frame->sibling); }
+
+/** Return the first counter of stack frame @a frame, or null.  */
+inline IgProfTrace::Counter *
+IgProfTrace::firstCounter(Stack *frame) const
+{ return deref<Counter>(frame->counters); }
+
+/** Return the next counter of the same stack frame after @a ctr, or null.  */
+inline IgProfTrace::Counter *
+IgProfTrace::nextCounter(Counter *ctr) const
+{ return deref<Counter>(ctr->next); }
+
+/** Return the first live resource of counter @a ctr, or null.  */
+inline IgProfTrace::Resource *
+IgProfTrace::firstResource(Counter *ctr) const
+{ return deref<Resource>(ctr->resources); }
+
+/** Return the stack frame owning counter @a ctr.  */
+inline IgProfTrace::Stack *
+IgProfTrace::counterFrame(Counter *ctr) const
+{ return deref<Stack>(ctr->frame); }
+
 /** Combine trace performance stats. */
 inline IgProfTrace::PerfStat &
 IgProfTrace::PerfStat::operator+=(const PerfStat &other)
@@ -257,6 +358,8 @@ IgProfTrace::PerfStat::operator+=(const PerfStat &other)
   sum2Ticks += other.sum2Ticks;
   sumTPerD  += other.sumTPerD;
   sum2TPerD += other.sum2TPerD;
+  noverflow += other.noverflow;
+  nuntracked += other.nuntracked;
   return *this;
 }
 
@@ -299,6 +402,28 @@ inline const IgProfTrace::PerfStat &
 IgProfTrace::perfStats(void) const
 { return perfStats_; }
 
+/** Return the amount of memory used by this buffer. */
+inline size_t
+IgProfTrace::memory(void) const
+{
+  return poolMemory() + (1u << hashLogSize_) * sizeof(HResource)
+    + (oldtable_ ? (1u << oldLogSize_) * sizeof(HResource) : 0)
+    + (kidtable_ ? (1u << kidLogSize_) * sizeof(HChild) : 0);
+}
+
+/** Return the current change epoch.  Every counter update stamps the
+    counter with the epoch, so a counter changed since the epoch was
+    last advanced has an epoch equal to the current one.  */
+inline unsigned
+IgProfTrace::epoch(void) const
+{ return epoch_; }
+
+/** Start a new change epoch.  Delta dumps call this after writing out
+    the counters changed in the current epoch. */
+inline void
+IgProfTrace::nextEpoch(void)
+{ ++epoch_; }
+
 /** Lock the trace buffer. Call this before making state changes, or
     walking the buffer, unless you know for sure you are the only one
     accessing the buffer. */
@@ -318,7 +443,9 @@ IgProfTrace::unlock(void)
     right slot can be found in at most MAX_HASH_PROBES steps.
 
     If the resource cannot be found, returns the first free hash slot
-    which was seen in the scan.
+    which was seen in the scan.  While the hash is being expanded, the
+    resource may also be found in the old hash, but free slots are only
+    returned in the current one.
 
     In other words, returns a null pointer if and only if the resource
     could not be found and there were no hash slots free. If the caller
@@ -344,6 +471,20 @@ IgProfTrace::findResource(Address resource)
       free = hr;
   }
 
+  // While the hash is being expanded, resources not yet moved are
+  // still in the old hash.  New ones always go to the current hash.
+  if (UNLIKELY(oldtable_ != 0))
+  {
+    slot = hash(resource, 8);
+    size = (1u << oldLogSize_);
+    for (size_t i = 0; i < MAX_HASH_PROBES; ++i, ++slot)
+    {
+      hr = &oldtable_[slot & (size-1)];
+      if (hr->resource == resource && hr->record)
+	return hr;
+    }
+  }
+
   return free;
 }
 
@@ -375,6 +516,7 @@ IgProfTrace::releaseResource(HResource *hres)
   ASSERT(ctr->ticks > 0);
   ctr->value -= res->size;
   ctr->ticks--;
+  ctr->epoch = epoch_;
 
   // Unchain from hash and counter lists.
   hres->resource = 0;
@@ -387,8 +529,8 @@ IgProfTrace::releaseResource(HResource *hres)
   }
   else
   {
-    ASSERT(ctr->resources == res);
-    ctr->resources = res->nextlive;
+    ASSERT(ctr->resources == ref(res));
+    ctr->resources = ref(res->nextlive);
   }
 
   if (Resource *next = res->nextlive)
@@ -404,7 +546,27 @@ IgProfTrace::releaseResource(HResource *hres)
   res->counter = &FREED;
 #endif
   resfree_ = res;
-  --hashUsed_;
+  trackEntries(hashUsed_--, sizeof(HResource), false);
+}
+
+/** Locate child @a address of stack frame @a parent in the child
+    index.  Returns the slot of the child, or the free slot where it
+    belongs if the child is not in the index.  The index must exist
+    and is never full, so there always is a free slot.  */
+inline IgProfTrace::HChild *
+IgProfTrace::findChild(Stack *parent, void *address)
+{
+  ASSERT(kidtable_);
+  size_t mask = (1u << kidLogSize_) - 1;
+  size_t slot = hash((Address) address ^ ((Address) parent << 16),
+		     64 - kidLogSize_);
+  while (true)
+  {
+    HChild *hc = &kidtable_[slot & mask];
+    if (! hc->child || (hc->address == address && hc->parent == parent))
+      return hc;
+    ++slot;
+  }
 }
 
 /** Find callee at @a address for the caller @a parent.
@@ -416,15 +578,29 @@ IgProfTrace::releaseResource(HResource *hres)
     This code deliberately does things the "slow" way. It has only one
     caller, which already does caching of recently seen stack frames.
     Be careful about trying to optimise things here - there is a fair
-    chance of simply making things slower by adding complexity. */
+    chance of simply making things slower by adding complexity.  The
+    exception are frames with many children, such as event loops and
+    interpreter dispatch functions, whose children are also entered
+    into a hash table keyed by the parent and the call address once
+    there are CHILD_INDEX_MIN of them.
+
+    Returns null instead of creating a new node if the profile buffers
+    are over the memory limit, or the memory reserve beyond it if
+    @a limit is NODE_RESERVE.  With NODE_ALWAYS the node is created
+    regardless.  */
 inline IgProfTrace::Stack *
-IgProfTrace::childStackNode(Stack *parent, void *address)
+IgProfTrace::childStackNode(Stack *parent, void *address, int limit)
 {
+  // Look up children of frames with many children in the index.
+  if (UNLIKELY(parent->nchildren >= CHILD_INDEX_MIN) && kidtable_)
+    if (Stack *k = findChild(parent, address)->child)
+      return k;
+
   // Search for the child's call address in the child stack frames.
-  Stack **kid = &parent->children;
+  Ref *kid = &parent->children;
   while (*kid)
   {
-    Stack *k = *kid;
+    Stack *k = deref<Stack>(*kid);
     if (k->address == address)
       return k;
 
@@ -434,23 +610,35 @@ IgProfTrace::childStackNode(Stack *parent, void *address)
     kid = &k->sibling;
   }
 
-  // Didn't find it, add a new child in address-sorted order.
-  Stack *next = *kid;
-  Stack *k = *kid = allocate<Stack>();
+  // Didn't find it, add a new child in address-sorted order, if
+  // there is memory left for it.
+  if (UNLIKELY(limit == NODE_LIMIT ? overMemoryLimit()
+	       : limit == NODE_RESERVE && overMemoryReserve()))
+    return 0;
+
+  Ref next = *kid;
+  Stack *k = allocate<Stack>();
+  *kid = ref(k);
   k->address = address;
 #if DEBUG
   k->parent = parent;
 #endif
   k->sibling = next;
   k->children = 0;
-  for (int i = 0; i < MAX_COUNTERS; ++i)
-    k->counters[i] = 0;
+  k->counters = 0;
+  k->id = 0;
+  k->nchildren = 0;
+
+  if (UNLIKELY(++parent->nchildren >= CHILD_INDEX_MIN))
+    indexChild(parent, k);
   return k;
 }
 
-/** Locate stack frame record for a call tree. */
+/** Locate stack frame record for a call tree.  Unless @a roots is
+    false, the stack is rooted at the synthetic thread and phase
+    frames if any are active.  */
 inline IgProfTrace::Stack *
-IgProfTrace::push(void **stack, int depth)
+IgProfTrace::push(void **stack, int depth, bool roots)
 {
   // Make sure we operate on non-negative depth.  This allows callers
   // to do strip off call tree layers without checking for sufficient
@@ -461,22 +649,86 @@ IgProfTrace::push(void **stack, int depth)
   // Look up call stack in the cache.
   StackCache    *cache = callcache_;
   Stack         *frame = stack_;
+  int           valid = 1;
+  int           maxdepth = MAX_DEPTH;
+
+  // Root all stacks at the thread and the current application phase
+  // if requested.  The roots take the first cache slots, so the cache
+  // is invalidated for the whole stack when the roots change.
+  void          *root[2];
+  int           nroots = 0;
+  if (roots)
+  {
+    if (void *thread = igprof_thread_frame())
+      root[nroots++] = thread;
+    if (void *phase = s_igprof_phase)
+      root[nroots++] = phase;
+  }
 
-  for (int i = 0, valid = 1; i < depth && i < MAX_DEPTH; ++i)
+  for (int i = 0; i < nroots; ++i, ++cache, --maxdepth)
+  {
+    if (valid && cache->address == root[i])
+      frame = cache->frame;
+    else if (! (frame = childStackNode(frame, root[i])))
+    {
+      cache->address = 0;
+      return overflowStackNode(stack, depth);
+    }
+    else
+    {
+      cache->address = root[i];
+      cache->frame = frame;
+      valid = 0;
+    }
+  }
+
+  for (int i = 0; i < depth && i < maxdepth; ++i)
   {
     void *address = stack[depth-i-1];
     if (valid && cache[i].address == address)
       frame = cache[i].frame;
     else
     {
-      // Look up this call stack child, then cache result.
-      frame = childStackNode(frame, address);
+      // Look up this call stack child, then cache result.  Over the
+      // memory limit, cut the cached path at the missing node.
+      if (UNLIKELY(! (frame = childStackNode(frame, address))))
+      {
+        cache[i].address = 0;
+        return overflowStackNode(stack, depth);
+      }
       cache[i].address = address;
       cache[i].frame = frame;
       valid = 0;
     }
   }
 
+  // Deeper cache slots belong to the old stack if this one differed
+  // from it.  Cut the cached path here so a later deeper stack with
+  // the same addresses under a new parent does not match them.
+  if (! valid && depth < maxdepth)
+    cache[depth].address = 0;
+
+  return frame;
+}
+
+/** Locate the stack frame record for a call tree which would need new
+    stack nodes over the memory limit.  Records it in reduced detail,
+    under the synthetic overflow frame with only the OVERFLOW_DEPTH
+    innermost frames of @a stack, and fewer if even the memory reserve
+    runs out.  */
+inline IgProfTrace::Stack *
+IgProfTrace::overflowStackNode(void **stack, int depth)
+{
+  ++perfStats_.noverflow;
+  Stack *frame = childStackNode(stack_, s_igprof_overflow, NODE_ALWAYS);
+  for (int i = (depth < OVERFLOW_DEPTH ? depth : OVERFLOW_DEPTH); i > 0; --i)
+  {
+    Stack *kid = childStackNode(frame, stack[i-1], NODE_RESERVE);
+    if (! kid)
+      break;
+    frame = kid;
+  }
+
   return frame;
 }
 
@@ -489,29 +741,32 @@ IgProfTrace::tick(Stack *frame, CounterDef *def, Value amount, Value ticks)
   ASSERT(frame);
   ASSERT(def);
 
-  // Locate and possibly initialise the counter.
+  // Locate and possibly initialise the counter.  New counters go to
+  // the end of the list so the counters stay in order of creation.
   Counter *c = 0;
-  Counter **ctr = &frame->counters[0];
-  for (int i = 0; i < MAX_COUNTERS; ++i, ++ctr)
+  Ref *ctr = &frame->counters;
+  while (true)
   {
     if (! *ctr)
     {
-      *ctr = c = allocate<Counter>();
+      c = allocate<Counter>();
+      *ctr = ref(c);
       c->def = def;
       c->ticks = 0;
       c->value = 0;
       c->peak = 0;
       c->resources = 0;
-      c->frame = frame;
+      c->frame = ref(frame);
+      c->next = 0;
       break;
     }
 
-    ASSERT((*ctr)->def);
-    if ((*ctr)->def == def)
-    {
-      c = *ctr;
+    c = deref<Counter>(*ctr);
+    ASSERT(c->def);
+    if (c->def == def)
       break;
-    }
+
+    ctr = &c->next;
   }
 
   ASSERT(c);
@@ -519,6 +774,8 @@ IgProfTrace::tick(Stack *frame, CounterDef *def, Value amount, Value ticks)
   // Tick the counter.
   if (def->type == TICK)
   {
+    tickValue_ = c->value;
+    tickPeak_ = c->peak;
     c->value += amount;
     if (c->value > c->peak)
       c->peak = c->value;
@@ -527,6 +784,7 @@ IgProfTrace::tick(Stack *frame, CounterDef *def, Value amount, Value ticks)
     c->value = amount;
 
   c->ticks += ticks;
+  c->epoch = epoch_;
 
   // Return the counter for acquire() calls.
   return c;
@@ -550,7 +808,7 @@ IgProfTrace::acquire(Counter *ctr, Address resource, Value size)
                  ctr->def->name, resource, hres->record->size, (void *)this);
 #if DEBUG
     int depth = 0;
-    for (Stack *s = ctr->frame; s; s = s->parent)
+    for (Stack *s = counterFrame(ctr); s; s = s->parent)
     {
       const char  *sym = 0;
       const char  *lib = 0;
@@ -564,13 +822,29 @@ IgProfTrace::acquire(Counter *ctr, Address resource, Value size)
 #endif
 
     // Release the resource, then proceed as if we hadn't found it.
+    // The slot may be in the old hash, so look up a new one.
     releaseResource(hres);
+    hres = findResource(resource);
   }
 
-  // Find a free hash table entry - may require hash resize.
+  // Over the memory limit, do not track a resource which would need
+  // more memory, only count it.
+  if (UNLIKELY((! hres || ! resfree_) && overMemoryLimit()))
+  {
+    untrack(ctr, size);
+    return;
+  }
+
+  // Find a free hash table entry - may require hash resize.  If the
+  // hash cannot grow, the buffer is now full: count the resource only.
   while (UNLIKELY(! hres))
   {
     expandResourceHash();
+    if (overMemoryLimit())
+    {
+      untrack(ctr, size);
+      return;
+    }
     hres = findResource(resource);
   }
 
@@ -586,17 +860,38 @@ IgProfTrace::acquire(Counter *ctr, Address resource, Value size)
   hres->record = res;
   res->hashslot = hres;
   res->prevlive = 0;
-  res->nextlive = ctr->resources;
+  res->nextlive = deref<Resource>(ctr->resources);
   res->counter = ctr;
   res->size = size;
-  ctr->resources = res;
+  ctr->resources = ref(res);
   if (res->nextlive)
     res->nextlive->prevlive = res;
-  ++hashUsed_;
+  trackEntries(++hashUsed_, sizeof(HResource), true);
+
+  // Continue moving resources out of the old hash.
+  if (UNLIKELY(oldtable_ != 0))
+    migrateResources(HASH_MIGRATE_SLOTS);
 }
 
-/** Release @a resource from which ever counter owns it. */
+/** Take back the tick just made to @a ctr for a resource of @a size
+    the buffer has no memory to track, and count it instead in the
+    IGPROF_UNTRACKED counter of the overflow frame.  The untracked
+    resource is never released, so that counter keeps the total of all
+    resources left untracked, not the live amount.  */
 inline void
+IgProfTrace::untrack(Counter *ctr, Value size)
+{
+  ++perfStats_.nuntracked;
+  ctr->value = tickValue_;
+  ctr->peak = tickPeak_;
+  ctr->ticks--;
+  tick(childStackNode(stack_, s_igprof_overflow, NODE_ALWAYS),
+       &UNTRACKED, size, 1);
+}
+
+/** Release @a resource from which ever counter owns it.  Returns
+    @c true if the resource was known and was released.  */
+inline bool
 IgProfTrace::release(Address resource)
 {
   // Locate the resource in the hash table.
@@ -605,7 +900,12 @@ IgProfTrace::release(Address resource)
 
   // If not found, we missed the allocation, ignore this release.
   if (LIKELY(hres && hres->record))
+  {
     releaseResource(hres);
+    return true;
+  }
+
+  return false;
 }
 
 #endif // PROFILE_TRACE_H
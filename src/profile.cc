@@ -1,6 +1,7 @@
 #include "profile.h"
 #include "profile-trace.h"
 #include "sym-cache.h"
+#include "sym-index.h"
 #include "atomic.h"
 #include "fastio.h"
 #include "hook.h"
@@ -14,13 +15,24 @@
 #include <cstring>
 #include <cerrno>
 #include <cmath>
+#include <map>
 #include <set>
+#include <string>
+#include <vector>
 #include <unistd.h>
 #include <sys/signal.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <dlfcn.h>
 #include <cxxabi.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#if __linux
+# include <sys/syscall.h>
+#endif
 
 #ifdef __APPLE__
 # include <crt_externs.h>
@@ -33,8 +45,12 @@ HIDDEN char *           (*igprof_getenv)(const char *) = &getenv;
 HIDDEN int              (*igprof_unsetenv)(const char *) = &unsetenv;
 HIDDEN bool             s_igprof_activated = false;
 HIDDEN IgProfAtomic     s_igprof_enabled = 0;
-HIDDEN pthread_key_t    s_igprof_bufkey;
-HIDDEN pthread_key_t    s_igprof_flagkey;
+HIDDEN THREAD_LOCAL IgProfTrace *s_igprof_buffer INITIAL_EXEC = 0;
+HIDDEN THREAD_LOCAL volatile int s_igprof_flag INITIAL_EXEC = IGPROF_NO_THREAD;
+HIDDEN THREAD_LOCAL IgProfThread *s_igprof_thread INITIAL_EXEC = 0;
+HIDDEN void             *s_igprof_phase = 0;
+HIDDEN bool             s_igprof_threadframes = false;
+HIDDEN void             *s_igprof_overflow = 0;
 
 // -------------------------------------------------------------------
 // Used to capture real user start arguments in our custom thread wrapper
@@ -42,11 +58,15 @@ struct HIDDEN IgProfWrappedArg
 { void *(*start_routine)(void *); void *arg; };
 
 struct HIDDEN IgProfDumpInfo
-{ int depth; int nsyms; int nlibs; int nctrs;
+{ int depth; int nsyms; int nlibs; int nctrs; int nstrs; int lastdepth;
   const char *tofile; FILE *output; FastIO io;
-  IgProfSymCache *symcache; int blocksig;
+  IgProfSymCache *symcache; int blocksig; int reset;
   IgProfTrace::PerfStat perf; };
 
+struct HIDDEN IgProfDeltaInfo
+{ int nsyms; int nlibs; int nctrs; int nstrs; unsigned nnodes; unsigned ndumps;
+  IgProfSymCache *symcache; };
+
 // -------------------------------------------------------------------
 // Traps for this profiling module
 DUAL_HOOK(1, void, doexit, _main, _libc,
@@ -71,6 +91,11 @@ LIBHOOK(4, int, dopthread_create, _pthread20,
         (thread, attr, start_routine, arg),
         "pthread_create", "GLIBC_2.0", 0)
 
+LIBHOOK(2, int, dopthread_setname_np, _main,
+        (pthread_t thread, const char *name),
+        (thread, name),
+        "pthread_setname_np", 0, 0)
+
 LIBHOOK(4, int, dopthread_create, _pthread21,
         (pthread_t *thread, const pthread_attr_t *attr,
          void * (*start_routine)(void *), void *arg),
@@ -81,6 +106,13 @@ LIBHOOK(4, int, dopthread_create, _pthread21,
 static const int        MAX_FNAME       = 1024;
 static const char       *s_initialized  = 0;
 static bool             s_perthread     = false;
+static bool             s_keepbufs      = false;
+static bool             s_rawdump       = false;
+static bool             s_binarydump    = false;
+static bool             s_compress      = false;
+static bool             s_deltadump     = false;
+static bool             s_snapshot      = false;
+static pid_t            s_snapshotpid   = 0;
 static volatile int     s_quitting      = 0;
 static double           s_clockres      = 0;
 static pthread_mutex_t  s_buflock       = PTHREAD_MUTEX_INITIALIZER;
@@ -93,6 +125,35 @@ static pthread_t        s_mainthread;
 static pthread_t        s_dumpthread;
 static char             s_outname[MAX_FNAME];
 static char             s_dumpflag[MAX_FNAME];
+static char             s_deltaname[MAX_FNAME];
+static char             s_controlname[MAX_FNAME];
+static bool             s_control       = false;
+static int              s_controlfd     = -1;
+static pid_t            s_controlpid    = 0;
+static bool             s_paused        = false;
+static pthread_mutex_t  s_pauselock     = PTHREAD_MUTEX_INITIALIZER;
+static const int        MAX_PHASES      = 256;
+static const int        MAX_PHASENAME   = 128;
+static pthread_mutex_t  s_phaselock     = PTHREAD_MUTEX_INITIALIZER;
+static int              s_nphases       = 0;
+static char             s_phasenames[MAX_PHASES][MAX_PHASENAME];
+static void             *s_phaseframes[MAX_PHASES];
+static bool             (*s_ratehandler)(long) = 0;
+static double           s_period        = 0;
+static int              s_keep          = 0;
+static unsigned long    s_nwindows      = 0;
+static IgProfDeltaInfo  s_delta         = { 0, 0, 0, 0, 0, 0, 0 };
+static char             s_deltasymdata[sizeof(IgProfSymCache)];
+static const int        MAX_SYNTHETIC   = 65536;
+static pthread_mutex_t  s_synthlock     = PTHREAD_MUTEX_INITIALIZER;
+static char             *s_synthbase    = 0;
+static int              s_nsynth        = 0;
+static const char       *s_synthnames[MAX_SYNTHETIC];
+static pthread_mutex_t  s_threadlock    = PTHREAD_MUTEX_INITIALIZER;
+static IgProfThread     *s_threads      = 0;
+static pthread_mutex_t  s_threadframelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t    s_bufkey;
+static pthread_key_t    s_threadkey;
 
 /** Return set of currently outstanding profile buffers. */
 static std::set<IgProfTrace *> &
@@ -103,13 +164,44 @@ allTraceBuffers(void)
   return *s_bufs;
 }
 
-/** Create a new profile buffer and remember it. */
+/** Get the buffers of exited threads kept for reuse. */
+static std::vector<IgProfTrace *> &
+keptTraceBuffers(void)
+{
+  static std::vector<IgProfTrace *> *s_kept = 0;
+  if (! s_kept) s_kept = new std::vector<IgProfTrace *>;
+  return *s_kept;
+}
+
+/** Return the synthetic thread root frames made so far, by name.  */
+static std::map<std::string, void *> &
+threadFrames(void)
+{
+  static std::map<std::string, void *> *s_frames = 0;
+  if (! s_frames) s_frames = new std::map<std::string, void *>;
+  return *s_frames;
+}
+
+/** Create a new profile buffer and remember it, or reuse one kept
+    from an exited thread. */
 static IgProfTrace *
 makeTraceBuffer(void)
 {
   if (s_perthread)
   {
-    IgProfTrace *buf = new IgProfTrace;
+    IgProfTrace *buf = 0;
+    pthread_mutex_lock(&s_buflock);
+    std::vector<IgProfTrace *> &kept = keptTraceBuffers();
+    if (! kept.empty())
+    {
+      buf = kept.back();
+      kept.pop_back();
+    }
+    pthread_mutex_unlock(&s_buflock);
+    if (buf)
+      return buf;
+
+    buf = new IgProfTrace;
     pthread_mutex_lock(&s_buflock);
     allTraceBuffers().insert(buf);
     pthread_mutex_unlock(&s_buflock);
@@ -119,11 +211,17 @@ makeTraceBuffer(void)
     return s_masterbuf;
 }
 
-/** Dispose a profile buffer. */
+/** Dispose a profile buffer.  Merges it to the master buffer, or if
+    buffers are kept, leaves it for reuse by the next new thread. */
 static void
 disposeTraceBuffer(IgProfTrace *buf)
 {
-  if (buf && buf != s_masterbuf)
+  if (buf && buf != s_masterbuf && s_keepbufs)
+  {
+    igprof_debug("keeping profile buffer %p for reuse\n", (void *) buf);
+    keptTraceBuffers().push_back(buf);
+  }
+  else if (buf && buf != s_masterbuf)
   {
     igprof_debug("merging profile buffer %p to master buffer %p\n",
                  (void *) buf, (void *) s_masterbuf);
@@ -133,96 +231,206 @@ disposeTraceBuffer(IgProfTrace *buf)
   }
 }
 
-/** Free a thread's trace buffer. */
+/** Set up the calling thread for profiling into buffer @a buf, with
+    profiling initially enabled if @a enabled is true.  The buffer is
+    kept in a thread key only for its destructor, the profiler itself
+    uses the thread-local copy.  */
+static void
+setThreadBuffer(IgProfTrace *buf, bool enabled)
+{
+  IgHookTrace::threadInit();
+  pthread_setspecific(s_bufkey, buf);
+  s_igprof_buffer = buf;
+  s_igprof_flag = enabled ? 1 : 0;
+}
+
+/** Free a thread's trace buffer, and stop profiling the thread. */
 static void
 freeTraceBuffer(void *arg)
 {
   ASSERT(arg);
+  s_igprof_flag = IGPROF_NO_THREAD;
+  s_igprof_buffer = 0;
   pthread_mutex_lock(&s_buflock);
   disposeTraceBuffer((IgProfTrace *) arg);
   pthread_mutex_unlock(&s_buflock);
 }
 
-/** Free a thread's profile-enabled flag. */
+/** Set the root frame of thread @a t for thread name @a name.  The
+    frame is called "thread TID NAME".  Frames are made once per name
+    and reused, for example when the thread id is recycled or a thread
+    switches back to an earlier name.  Keeps the previous frame if no
+    more synthetic frames can be made.  */
 static void
-freeThreadFlag(void *arg)
+setThreadFrame(IgProfThread *t, const char *name)
 {
-  delete (IgProfAtomic *) arg;
+  static bool exhausted = false;
+  char buf[128];
+  int len = snprintf(buf, sizeof(buf), "thread %ld %s", t->tid, name);
+  if (len < 0 || len >= int(sizeof(buf)))
+    len = sizeof(buf)-1;
+  for (int i = 0; i < len; ++i)
+    if (buf[i] == '(' || buf[i] == ')' || buf[i] == '\n')
+      buf[i] = '_';
+
+  // The map keys never move or change, so they serve as the frame
+  // names, which must live until the end of the program.
+  pthread_mutex_lock(&s_threadframelock);
+  igprof_disable();
+  std::map<std::string, void *>::iterator pos
+    = threadFrames().insert(std::make_pair(std::string(buf, len),
+                                           (void *) 0)).first;
+  igprof_enable();
+  if (! pos->second)
+    pos->second = igprof_synthetic_frame(pos->first.c_str());
+
+  if (pos->second)
+    t->frame = pos->second;
+  else if (! exhausted)
+  {
+    igprof_debug("too many synthetic frames, cannot make '%s',"
+                 " threads keep their previous frame\n", pos->first.c_str());
+    exhausted = true;
+  }
+  pthread_mutex_unlock(&s_threadframelock);
 }
 
-/** Dump out the profile data.  */
+/** Register the calling thread for a synthetic thread root frame,
+    named after the current thread name.  */
 static void
-dumpOneProfile(IgProfDumpInfo &info, IgProfTrace::Stack *frame)
+registerThread(void)
 {
-  if (info.depth) // No address at root
+  char name[64] = "";
+  igprof_disable();
+  IgProfThread *t = new IgProfThread;
+  igprof_enable();
+  t->frame = 0;
+  t->thread = pthread_self();
+#if __linux
+  t->tid = syscall(SYS_gettid);
+  pthread_getname_np(t->thread, name, sizeof(name));
+#else
+  t->tid = 0;
+#endif
+  setThreadFrame(t, name);
+
+  pthread_mutex_lock(&s_threadlock);
+  t->next = s_threads;
+  s_threads = t;
+  pthread_mutex_unlock(&s_threadlock);
+  pthread_setspecific(s_threadkey, t);
+  s_igprof_thread = t;
+}
+
+/** Forget a thread's synthetic root frame state on thread exit.  */
+static void
+unregisterThread(void *arg)
+{
+  IgProfThread *t = (IgProfThread *) arg;
+  s_igprof_thread = 0;
+  pthread_mutex_lock(&s_threadlock);
+  for (IgProfThread **p = &s_threads; *p; p = &(*p)->next)
+    if (*p == t)
+    {
+      *p = t->next;
+      break;
+    }
+  pthread_mutex_unlock(&s_threadlock);
+  delete t;
+}
+
+/** Dump out the stack node prefix and symbol for @a address.  */
+static void
+dumpSymbol(IgProfDumpInfo &info, void *address)
+{
+  IgProfSymCache::Symbol *sym = info.symcache->get(address);
+
+  if (LIKELY(sym->id >= 0))
+    info.io.put("C").put(info.depth)
+	   .put(" FN").put(sym->id)
+	   .put("+").put(sym->symoffset);
+  else
   {
-    IgProfSymCache::Symbol *sym = info.symcache->get(frame->address);
+    const char *symname = sym->name;
+    char       symgen[32];
+    size_t     symlen = 0;
+
+    sym->id = info.nsyms++;
 
-    if (LIKELY(sym->id >= 0))
+    if (UNLIKELY(! symname || ! *symname))
+    {
+      symlen = sprintf(symgen, "@?%p", sym->address);
+      symname = symgen;
+      ASSERT(symlen <= sizeof(symgen));
+    }
+    else
+      symlen = strlen(symname);
+
+    if (LIKELY(sym->binary->id >= 0))
       info.io.put("C").put(info.depth)
 	     .put(" FN").put(sym->id)
-	     .put("+").put(sym->symoffset);
+	     .put("=(F").put(sym->binary->id)
+	     .put("+").put(sym->binoffset)
+	     .put(" N=(").put(symname, symlen)
+	     .put("))+").put(sym->symoffset);
     else
     {
-      const char *symname = sym->name;
-      char       symgen[32];
-      size_t     symlen = 0;
-
-      sym->id = info.nsyms++;
-
-      if (UNLIKELY(! symname || ! *symname))
-      {
-        symlen = sprintf(symgen, "@?%p", sym->address);
-        symname = symgen;
-	ASSERT(symlen <= sizeof(symgen));
-      }
-      else
-	symlen = strlen(symname);
-
-      if (LIKELY(sym->binary->id >= 0))
-	info.io.put("C").put(info.depth)
-	       .put(" FN").put(sym->id)
-	       .put("=(F").put(sym->binary->id)
-	       .put("+").put(sym->binoffset)
-	       .put(" N=(").put(symname, symlen)
-	       .put("))+").put(sym->symoffset);
-      else
-      {
-	const char *binname = sym->binary->name ? sym->binary->name : "";
-	size_t binlen = strlen(binname);
-	info.io.put("C").put(info.depth)
-	       .put(" FN").put(sym->id)
-	       .put("=(F").put(sym->binary->id = info.nlibs++)
-	       .put("=(").put(binname, binlen)
-	       .put(")+").put(sym->binoffset)
-	       .put(" N=(").put(symname, symlen)
-	       .put("))+").put(sym->symoffset);
-      }
+      const char *binname = sym->binary->name ? sym->binary->name : "";
+      size_t binlen = strlen(binname);
+      info.io.put("C").put(info.depth)
+	     .put(" FN").put(sym->id)
+	     .put("=(F").put(sym->binary->id = info.nlibs++)
+	     .put("=(").put(binname, binlen)
+	     .put(")+").put(sym->binoffset)
+	     .put(" N=(").put(symname, symlen)
+	     .put("))+").put(sym->symoffset);
     }
+  }
+}
 
-    IgProfTrace::Counter **ctr = &frame->counters[0];
-    for (int i = 0; i < IgProfTrace::MAX_COUNTERS && *ctr; ++i, ++ctr)
+/** Dump out the profile data.  In raw mode there is no symbol cache
+    and call addresses are written out as such, to be symbolised
+    offline against the module map at the top of the dump.  */
+static void
+dumpOneProfile(IgProfDumpInfo &info, IgProfTrace *buf,
+	       IgProfTrace::Stack *frame)
+{
+  if (info.depth) // No address at root
+  {
+    if (! info.symcache)
+      info.io.put("C").put(info.depth)
+	     .put(" A").put((unsigned long) frame->address);
+    else
+      dumpSymbol(info, frame->address);
+
+    for (IgProfTrace::Counter *c = buf->firstCounter(frame); c;
+	 c = buf->nextCounter(c))
     {
-      IgProfTrace::Counter *c = *ctr;
       if (c->ticks || c->peak)
       {
+        IgProfTrace::Value ticks = c->ticks;
+        IgProfTrace::Value value = c->value;
+        IgProfTrace::Value peak = c->peak;
+        if (c->def->scaleValues)
+          c->def->scaleValues(ticks, value, peak);
+
         if (LIKELY(c->def->id >= 0))
 	  info.io.put(" V").put(c->def->id)
-		 .put(":(").put(c->ticks)
-		 .put(",").put(c->value)
-		 .put(",").put(c->peak)
+		 .put(":(").put(ticks)
+		 .put(",").put(value)
+		 .put(",").put(peak)
 		 .put(")");
         else
 	  info.io.put(" V").put(c->def->id = info.nctrs++)
 		 .put("=(").put(c->def->name, strlen(c->def->name))
-		 .put("):(").put(c->ticks)
-		 .put(",").put(c->value)
-                 .put(",").put(c->peak)
+		 .put("):(").put(ticks)
+		 .put(",").put(value)
+                 .put(",").put(peak)
 	         .put(")");
 
         if (c->def->derivedLeakSize)
         {  // Leak size is computed from the live resource
-          for (IgProfTrace::Resource *res = c->resources; res; res = res->nextlive)
+          for (IgProfTrace::Resource *res = buf->firstResource(c); res; res = res->nextlive)
           {
             IgProfTrace::Value derived_size;
             derived_size = c->def->derivedLeakSize(res->hashslot->resource, res->size);
@@ -234,7 +442,7 @@ dumpOneProfile(IgProfDumpInfo &info, IgProfTrace::Stack *frame)
         }
         else
         {  // Resource size is the leak size
-          for (IgProfTrace::Resource *res = c->resources; res; res = res->nextlive)
+          for (IgProfTrace::Resource *res = buf->firstResource(c); res; res = res->nextlive)
             info.io.put(";LK=(").put((void *) res->hashslot->resource)
             .put(",").put(res->size)
             .put(")");
@@ -245,21 +453,447 @@ dumpOneProfile(IgProfDumpInfo &info, IgProfTrace::Stack *frame)
   }
 
   info.depth++;
-  for (frame = frame->children; frame; frame = frame->sibling)
-    dumpOneProfile(info, frame);
+  for (frame = buf->firstChild(frame); frame; frame = buf->nextSibling(frame))
+    dumpOneProfile(info, buf, frame);
   info.depth--;
 }
 
+// Record tags of the binary dump format.  A binary dump starts with
+// the magic "\x7fIGPROF", the format version, the process id, the
+// program name and the tick period, followed by a stream of records,
+// each a tag byte and its fields.  Integers are base-128 varints,
+// signed ones zigzag encoded, and strings are length-prefixed.  Files,
+// symbols, counters and strings are numbered in order of definition.
+//
+// A delta dump file is a sequence of such dumps, one per dump made,
+// each starting with a DELTA record.  Definitions are numbered across
+// the whole file and are written only once.  Stack nodes have stable
+// ids and are written only when new or changed, so the state as of
+// any dump is the combination of the dumps up to that one.
+enum
+{
+  BINARY_TAG_END,       //< End of the dump.
+  BINARY_TAG_STRING,    //< String: bytes.
+  BINARY_TAG_FILE,      //< File: name string id.
+  BINARY_TAG_SYMBOL,    //< Symbol: file id, signed file offset, name string id.
+  BINARY_TAG_COUNTER,   //< Counter: name string id.
+  BINARY_TAG_NODE,      //< Node: signed depth delta, symbol id, counters.
+  BINARY_TAG_MODULE,    //< Raw dump object: id, name, bias, start, end, build-id.
+  BINARY_TAG_NAME,      //< Raw dump synthetic frame: address, name.
+  BINARY_TAG_RAWNODE,   //< Node in raw dump: signed depth delta, address, counters.
+  BINARY_TAG_DELTA,     //< Delta dump: sequence number of the dump.
+  BINARY_TAG_DELTAROOT, //< Delta dump buffer root: node id.
+  BINARY_TAG_DELTANODE, //< New delta dump node: id, parent id, symbol id, counters.
+  BINARY_TAG_DELTAUPDATE //< Changed delta dump node: id, counters.
+};
+
+/** Write out a string definition for @a name to a binary dump and
+    return its id.  */
+static int
+dumpBinaryString(IgProfDumpInfo &info, const char *name, size_t len)
+{
+  info.io.putVarint(BINARY_TAG_STRING).putString(name, len);
+  return info.nstrs++;
+}
+
+/** Write out the definitions needed for the symbol at @a address to a
+    binary dump and return the symbol id.  */
+static int
+dumpBinarySymbol(IgProfDumpInfo &info, void *address)
+{
+  IgProfSymCache::Symbol *sym = info.symcache->get(address);
+  if (LIKELY(sym->id >= 0))
+    return sym->id;
+
+  if (sym->binary->id < 0)
+  {
+    const char *binname = sym->binary->name ? sym->binary->name : "";
+    int strid = dumpBinaryString(info, binname, strlen(binname));
+    info.io.putVarint(BINARY_TAG_FILE).putVarint(strid);
+    sym->binary->id = info.nlibs++;
+  }
+
+  int strid;
+  if (UNLIKELY(! sym->name || ! *sym->name))
+  {
+    char symgen[32];
+    size_t symlen = sprintf(symgen, "@?%p", sym->address);
+    ASSERT(symlen <= sizeof(symgen));
+    strid = dumpBinaryString(info, symgen, symlen);
+  }
+  else
+  {
+    IgProfSymCache::Name *name = info.symcache->name(sym->name);
+    if (name->id < 0)
+      name->id = dumpBinaryString(info, sym->name, strlen(sym->name));
+    strid = name->id;
+  }
+
+  info.io.putVarint(BINARY_TAG_SYMBOL).putVarint(sym->binary->id)
+	 .putSignedVarint(sym->binoffset)
+	 .putVarint(strid);
+  return sym->id = info.nsyms++;
+}
+
+/** Write out definitions for the counters of @a frame not yet
+    defined in a binary dump, and return the number of counters with
+    values to dump.  */
+static int
+dumpBinaryCounterDefs(IgProfDumpInfo &info, IgProfTrace *buf,
+		      IgProfTrace::Stack *frame)
+{
+  int nctrs = 0;
+  for (IgProfTrace::Counter *c = buf->firstCounter(frame); c;
+       c = buf->nextCounter(c))
+    if (c->ticks || c->peak)
+    {
+      IgProfTrace::CounterDef *def = c->def;
+      if (def->id < 0)
+      {
+        int strid = dumpBinaryString(info, def->name, strlen(def->name));
+        info.io.putVarint(BINARY_TAG_COUNTER).putVarint(strid);
+        def->id = info.nctrs++;
+      }
+      ++nctrs;
+    }
+
+  return nctrs;
+}
+
+/** Write out the number of counters of @a frame, @a nctrs, and the
+    counter values, each followed by the number of its leaks and the
+    leaks as size and address pairs.  As in text dumps, leaks whose
+    derived size is zero are left out, but zero size resources are
+    not.  */
+static void
+dumpBinaryCounters(IgProfDumpInfo &info, IgProfTrace *buf,
+		   IgProfTrace::Stack *frame, int nctrs)
+{
+  info.io.putVarint(nctrs);
+
+  for (IgProfTrace::Counter *c = buf->firstCounter(frame); c;
+       c = buf->nextCounter(c))
+  {
+    if (c->ticks || c->peak)
+    {
+      IgProfTrace::Value ticks = c->ticks;
+      IgProfTrace::Value value = c->value;
+      IgProfTrace::Value peak = c->peak;
+      if (c->def->scaleValues)
+        c->def->scaleValues(ticks, value, peak);
+
+      info.io.putVarint(c->def->id)
+	     .putVarint(ticks)
+	     .putVarint(value)
+	     .putVarint(peak);
+
+      uint64_t nleaks = 0;
+      IgProfTrace::Resource *res;
+      for (res = buf->firstResource(c); res; res = res->nextlive)
+        if (! c->def->derivedLeakSize
+            || c->def->derivedLeakSize(res->hashslot->resource, res->size))
+          ++nleaks;
+
+      info.io.putVarint(nleaks);
+      for (res = buf->firstResource(c); res; res = res->nextlive)
+      {
+        IgProfTrace::Value size = res->size;
+        if (c->def->derivedLeakSize
+            && ! (size = c->def->derivedLeakSize(res->hashslot->resource, res->size)))
+          continue;
+        info.io.putVarint(size)
+	       .putVarint(res->hashslot->resource);
+      }
+    }
+  }
+}
+
+/** Dump out the profile data in the binary format.  The structure
+    mirrors dumpOneProfile().  */
+static void
+dumpOneBinaryProfile(IgProfDumpInfo &info, IgProfTrace *buf,
+		     IgProfTrace::Stack *frame)
+{
+  if (info.depth) // No address at root
+  {
+    // Define new counters and the symbol before the node itself.
+    int nctrs = dumpBinaryCounterDefs(info, buf, frame);
+    if (! info.symcache)
+      info.io.putVarint(BINARY_TAG_RAWNODE).putSignedVarint(info.depth - info.lastdepth)
+	     .putVarint((unsigned long) frame->address);
+    else
+    {
+      int symid = dumpBinarySymbol(info, frame->address);
+      info.io.putVarint(BINARY_TAG_NODE).putSignedVarint(info.depth - info.lastdepth)
+	     .putVarint(symid);
+    }
+
+    info.lastdepth = info.depth;
+    dumpBinaryCounters(info, buf, frame, nctrs);
+  }
+
+  info.depth++;
+  for (frame = buf->firstChild(frame); frame; frame = buf->nextSibling(frame))
+    dumpOneBinaryProfile(info, buf, frame);
+  info.depth--;
+}
+
+/** Dump out the changes to the profile data since the previous delta
+    dump.  Nodes not dumped before are given the next stable id and
+    written out in full, with the id of their parent; the nodes whose
+    counters changed in the current @a epoch are written out as their
+    id and all their counter values, which replace the earlier ones.
+    Unchanged nodes are not written out at all.  */
+static void
+dumpOneDeltaProfile(IgProfDumpInfo &info, IgProfTrace *buf,
+		    IgProfTrace::Stack *frame, unsigned parent, unsigned epoch)
+{
+  bool changed = false;
+  for (IgProfTrace::Counter *c = buf->firstCounter(frame); c;
+       c = buf->nextCounter(c))
+    changed = changed || c->epoch == epoch;
+
+  if (! frame->id)
+  {
+    int nctrs = dumpBinaryCounterDefs(info, buf, frame);
+    int symid = dumpBinarySymbol(info, frame->address);
+    frame->id = ++s_delta.nnodes;
+    info.io.putVarint(BINARY_TAG_DELTANODE).putVarint(frame->id)
+	   .putVarint(parent)
+	   .putVarint(symid);
+    dumpBinaryCounters(info, buf, frame, nctrs);
+  }
+  else if (changed)
+  {
+    int nctrs = dumpBinaryCounterDefs(info, buf, frame);
+    info.io.putVarint(BINARY_TAG_DELTAUPDATE).putVarint(frame->id);
+    dumpBinaryCounters(info, buf, frame, nctrs);
+  }
+
+  for (IgProfTrace::Stack *kid = buf->firstChild(frame); kid;
+       kid = buf->nextSibling(kid))
+    dumpOneDeltaProfile(info, buf, kid, frame->id, epoch);
+}
+
+/** Dump out the changes to the profile tree of buffer @a buf since the
+    previous delta dump, starting a new change epoch for the buffer.
+    The root is listed in every dump, so the analyser can tell which
+    buffers have been merged away or reset since: a reset buffer has a
+    new root without an id, and its nodes are all dumped anew.  */
+static void
+dumpDeltaBuffer(IgProfDumpInfo &info, IgProfTrace *buf)
+{
+  IgProfTrace::Stack *root = buf->stackRoot();
+  if (! root->id)
+    root->id = ++s_delta.nnodes;
+  info.io.putVarint(BINARY_TAG_DELTAROOT).putVarint(root->id);
+
+  for (IgProfTrace::Stack *kid = buf->firstChild(root); kid;
+       kid = buf->nextSibling(kid))
+    dumpOneDeltaProfile(info, buf, kid, root->id, buf->epoch());
+  buf->nextEpoch();
+}
+
 /** Reset IDs used in dumping out profile data.  */
 static void
-dumpResetIDs(IgProfTrace::Stack *frame)
+dumpResetIDs(IgProfTrace *buf, IgProfTrace::Stack *frame)
 {
-  IgProfTrace::Counter **ctr = &frame->counters[0];
-  for (int i = 0; i < IgProfTrace::MAX_COUNTERS && *ctr; ++i, ++ctr)
-    (*ctr)->def->id = -1;
+  for (IgProfTrace::Counter *c = buf->firstCounter(frame); c;
+       c = buf->nextCounter(c))
+    c->def->id = -1;
 
-  for (frame = frame->children; frame; frame = frame->sibling)
-    dumpResetIDs(frame);
+  for (frame = buf->firstChild(frame); frame; frame = buf->nextSibling(frame))
+    dumpResetIDs(buf, frame);
+}
+
+/** Dump out the map of loaded objects and the synthetic frame names
+    for a raw dump.  Each object line gives the load bias, the mapped
+    address range and the GNU build-id so the analyser can check it
+    symbolises against the same files.  */
+static void
+dumpModules(IgProfDumpInfo &info)
+{
+  IgProfSymIndex::Module mod;
+  IgProfSymIndex::refresh();
+  for (unsigned int i = 0; IgProfSymIndex::module(i, mod); ++i)
+  {
+    if (s_binarydump)
+    {
+      info.io.putVarint(BINARY_TAG_MODULE).putVarint(i)
+	     .putString(mod.name, strlen(mod.name))
+	     .putVarint(mod.bias)
+	     .putVarint(mod.start)
+	     .putVarint(mod.end)
+	     .putVarint(2 * mod.buildidlen);
+    }
+    else
+      info.io.put("M").put(i)
+	     .put("=(").put(mod.name, strlen(mod.name))
+	     .put(") B=").put(mod.bias)
+	     .put(" S=").put(mod.start)
+	     .put(" E=").put(mod.end)
+	     .put(" I=(");
+
+    for (unsigned int j = 0; j < mod.buildidlen; ++j)
+    {
+      static const char hex[] = "0123456789abcdef";
+      char byte[2] = { hex[mod.buildid[j] >> 4], hex[mod.buildid[j] & 0xf] };
+      info.io.put(byte, 2);
+    }
+
+    if (! s_binarydump)
+      info.io.put(")\n");
+  }
+
+  pthread_mutex_lock(&s_synthlock);
+  for (int i = 0; i < s_nsynth; ++i)
+    if (s_binarydump)
+      info.io.putVarint(BINARY_TAG_NAME).putVarint((unsigned long) (s_synthbase + i))
+	     .putString(s_synthnames[i], strlen(s_synthnames[i]));
+    else
+      info.io.put("N").put((unsigned long) (s_synthbase + i))
+	     .put("=(").put(s_synthnames[i], strlen(s_synthnames[i]))
+	     .put(")\n");
+  pthread_mutex_unlock(&s_synthlock);
+}
+
+/** Dump out the profile trees of all current profile buffers.  */
+static void
+dumpAllBuffers(IgProfDumpInfo &info)
+{
+  std::set<IgProfTrace *> &bufs = allTraceBuffers();
+  std::set<IgProfTrace *>::iterator i, e;
+  for (i = bufs.begin(), e = bufs.end(); i != e; ++i)
+  {
+    IgProfTrace *buf = *i;
+    buf->lock();
+    if (s_deltadump)
+      dumpDeltaBuffer(info, buf);
+    else if (s_binarydump)
+      dumpOneBinaryProfile(info, buf, buf->stackRoot());
+    else
+      dumpOneProfile(info, buf, buf->stackRoot());
+    if (! s_deltadump)
+      dumpResetIDs(buf, buf->stackRoot());
+    info.perf += buf->perfStats();
+    if (info.reset)
+      buf->reset();
+    buf->unlock();
+  }
+
+  s_masterbuf->lock();
+  if (s_deltadump)
+    dumpDeltaBuffer(info, s_masterbuf);
+  else if (s_binarydump)
+    dumpOneBinaryProfile(info, s_masterbuf, s_masterbuf->stackRoot());
+  else
+    dumpOneProfile(info, s_masterbuf, s_masterbuf->stackRoot());
+  if (! s_deltadump)
+    dumpResetIDs(s_masterbuf, s_masterbuf->stackRoot());
+  info.perf += s_masterbuf->perfStats();
+  if (info.reset)
+    s_masterbuf->reset();
+  s_masterbuf->unlock();
+}
+
+/** Return the program name without directory for output file names. */
+static const char *
+programName(void)
+{
+  const char *progname = program_invocation_name;
+  const char *slash = strrchr(progname, '/');
+  if (slash && slash[1])
+    progname = slash+1;
+  else if (slash)
+    progname = "unnamed";
+  return progname;
+}
+
+/** Reset all profile buffers.  The caller must hold s_buflock.  */
+static void
+resetAllBuffers(void)
+{
+  std::set<IgProfTrace *>::iterator i, e;
+  std::set<IgProfTrace *> &bufs = allTraceBuffers();
+  for (i = bufs.begin(), e = bufs.end(); i != e; ++i)
+  {
+    IgProfTrace *buf = *i;
+    buf->lock();
+    buf->reset();
+    buf->unlock();
+  }
+
+  s_masterbuf->lock();
+  s_masterbuf->reset();
+  s_masterbuf->unlock();
+}
+
+/** Wait for the process writing the previous snapshot dump to exit,
+    or if @a block is false, only check whether it already has.  */
+static void
+reapSnapshot(bool block)
+{
+  pid_t pid;
+  if (s_snapshotpid <= 0)
+    return;
+
+  while ((pid = waitpid(s_snapshotpid, 0, block ? 0 : WNOHANG)) < 0
+         && errno == EINTR)
+    ;
+
+  if (pid != 0)
+    s_snapshotpid = 0;
+}
+
+/** Fork a child process to write out a dump from a copy-on-write
+    image of the profile buffers, so the application only stalls for
+    the duration of the fork.  All the buffers are locked across the
+    fork so the child sees them in a consistent state; the caller must
+    hold s_buflock.
+
+    The raw system call is used so neither the application nor the
+    profiler modules run their fork() handlers.  As a result the child
+    inherits the malloc and loader locks of other threads in whatever
+    state they were in, so it must not call malloc() or take loader
+    locks.  The dump code only uses memory it maps itself, and the
+    object list is refreshed here and frozen in the child.
+
+    Returns the child pid in the parent, zero in the child, or -1 if
+    the fork failed and the caller should write the dump itself.  */
+static pid_t
+forkSnapshot(void)
+{
+#if __linux
+  std::set<IgProfTrace *> &bufs = allTraceBuffers();
+  std::set<IgProfTrace *>::iterator i, e;
+  IgProfSymIndex::refresh();
+  for (i = bufs.begin(), e = bufs.end(); i != e; ++i)
+    (*i)->lock();
+  s_masterbuf->lock();
+
+# ifdef SYS_fork
+  pid_t pid = syscall(SYS_fork);
+# else
+  pid_t pid = syscall(SYS_clone, SIGCHLD, 0, 0, 0, 0);
+# endif
+
+  s_masterbuf->unlock();
+  for (i = bufs.begin(), e = bufs.end(); i != e; ++i)
+    (*i)->unlock();
+
+  if (pid == 0)
+  {
+    igprof_disable_globally();
+    IgProfSymIndex::freeze();
+  }
+  else if (pid < 0)
+    igprof_debug("snapshot fork failed: %s (error %d), dumping in-process\n",
+                 strerror(errno), errno);
+
+  return pid;
+#else
+  return -1;
+#endif
 }
 
 /** Utility function to dump out the profiler data from all current
@@ -285,28 +919,51 @@ dumpAllProfiles(void *arg)
     pthread_sigmask(SIG_BLOCK, &everything, &sigmask);
   }
 
+  // Pick up objects loaded since the last dump for the stack walker.
+  IgHookTrace::refreshModules();
+
   char outname[MAX_FNAME];
   const char *tofile = info->tofile;
   if (! tofile || ! tofile[0])
   {
-    const char *progname = program_invocation_name;
-    const char *slash = strrchr(progname, '/');
-    if (slash && slash[1])
-      progname = slash+1;
-    else if (slash)
-      progname = "unnamed";
-
     timeval tv;
     gettimeofday(&tv, 0);
-    sprintf(outname, "|gzip -c>igprof.%.100s.%ld.%f.gz",
-            progname, (long) getpid(), tv.tv_sec + 1e-6*tv.tv_usec);
+    sprintf(outname, "igprof.%.100s.%ld.%f.gz",
+            programName(), (long) getpid(), tv.tv_sec + 1e-6*tv.tv_usec);
     tofile = outname;
   }
 
+  // All delta dumps go to the file of the first one, each appended
+  // to the previous ones; names given to later dumps are ignored.
+  if (s_deltadump)
+  {
+    if (! s_deltaname[0])
+      snprintf(s_deltaname, sizeof(s_deltaname), "%s", tofile);
+    else if (strcmp(tofile, s_deltaname))
+      igprof_debug("delta dump to '%s' appended to '%s' instead\n",
+                   tofile, s_deltaname);
+    tofile = s_deltaname;
+  }
+
+  // Compress in-process rather than via a gzip pipe if requested, or
+  // the output name asks for it.  Explicit pipe outputs are honoured.
+  size_t tofilelen = strlen(tofile);
+  bool compress = (tofile[0] != '|'
+                   && (s_compress
+                       || (tofilelen > 3
+                           && ! strcmp(tofile + tofilelen - 3, ".gz"))));
+
+  // Write in-flight dumps to files from a snapshot process if asked
+  // to.  A pipe could not be closed before the snapshot process is
+  // done, and delta dumps must update the state of this process.
+  bool snapshot = (s_snapshot && info->blocksig && ! s_deltadump
+                   && tofile[0] != '|');
+  reapSnapshot(true);
+
   igprof_debug("dumping state to %s\n", tofile);
   info->output = (tofile[0] == '|'
                   ? (igprof_unsetenv("LD_PRELOAD"), popen(tofile+1, "w"))
-                  : fopen(tofile, "w+"));
+                  : fopen(tofile, s_deltadump && s_delta.ndumps ? "a" : "w+"));
   if (! info->output)
     igprof_debug("can't write to output %s: %s (error %d)\n",
                  tofile, strerror(errno), errno);
@@ -316,33 +973,78 @@ dumpAllProfiles(void *arg)
     size_t clockreslen = sprintf(clockres, "%f", s_clockres);
     size_t prognamelen = strlen(program_invocation_name);
     info->io.attach(fileno(info->output));
-    info->io.put("P=(HEX ID=").put(getpid())
-	    .put(" N=(").put(program_invocation_name, prognamelen)
-	    .put(") T=").put(clockres, clockreslen)
-	    .put(")\n");
+    if (s_binarydump)
+      info->io.put("\x7fIGPROF").putVarint(1)
+	      .putVarint(getpid())
+	      .putString(program_invocation_name, prognamelen)
+	      .putString(clockres, clockreslen);
+    else
+      info->io.put("P=(HEX ID=").put(getpid())
+	      .put(" N=(").put(program_invocation_name, prognamelen)
+	      .put(") T=").put(clockres, clockreslen)
+	      .put(")\n");
 
     pthread_mutex_lock(&s_buflock);
-    IgProfSymCache symcache;
-    info->symcache = &symcache;
-    std::set<IgProfTrace *> &bufs = allTraceBuffers();
-    std::set<IgProfTrace *>::iterator i, e;
-    for (i = bufs.begin(), e = bufs.end(); i != e; ++i)
+    pid_t child = (snapshot ? forkSnapshot() : -1);
+    if (child > 0)
     {
-      IgProfTrace *buf = *i;
-      buf->lock();
-      dumpOneProfile(*info, buf->stackRoot());
-      dumpResetIDs(buf->stackRoot());
-      perf += buf->perfStats();
-      buf->unlock();
+      // The snapshot process writes the dump, header included.
+      s_snapshotpid = child;
+      info->io.discard();
+      if (info->reset)
+        resetAllBuffers();
     }
+    else
+    {
+      if (child == 0)
+        info->reset = 0;
+
+      if (compress && ! info->io.compress())
+        igprof_debug("can't compress output %s, writing it uncompressed\n",
+                     tofile);
+
+      if (s_deltadump)
+      {
+        // Keep the symbol cache and all definition ids for the lifetime
+        // of the process, so each definition is written out only once.
+        if (! s_delta.symcache)
+          s_delta.symcache = new (s_deltasymdata) IgProfSymCache;
+        else
+          IgProfSymIndex::refresh();
+
+        info->symcache = s_delta.symcache;
+        info->nsyms = s_delta.nsyms;
+        info->nlibs = s_delta.nlibs;
+        info->nctrs = s_delta.nctrs;
+        info->nstrs = s_delta.nstrs;
+        info->io.putVarint(BINARY_TAG_DELTA).putVarint(s_delta.ndumps++);
+        dumpAllBuffers(*info);
+        s_delta.nsyms = info->nsyms;
+        s_delta.nlibs = info->nlibs;
+        s_delta.nctrs = info->nctrs;
+        s_delta.nstrs = info->nstrs;
+      }
+      else if (s_rawdump)
+      {
+        info->symcache = 0;
+        dumpModules(*info);
+        dumpAllBuffers(*info);
+      }
+      else
+      {
+        IgProfSymCache symcache;
+        info->symcache = &symcache;
+        dumpAllBuffers(*info);
+      }
 
-    s_masterbuf->lock();
-    dumpOneProfile(*info, s_masterbuf->stackRoot());
-    dumpResetIDs(s_masterbuf->stackRoot());
-    perf += s_masterbuf->perfStats();
-    s_masterbuf->unlock();
+      if (s_binarydump)
+        info->io.putVarint(BINARY_TAG_END);
+
+      info->io.finish();
+      if (child == 0)
+        _exit(0);
+    }
 
-    info->io.flush();
     if (tofile[0] == '|')
       pclose(info->output);
     else
@@ -358,6 +1060,15 @@ dumpAllProfiles(void *arg)
     pthread_sigmask(SIG_SETMASK, &sigmask, 0);
   }
 
+  if (perf.noverflow || perf.nuntracked)
+    igprof_debug("over the memory limit: %llu stack traces recorded under"
+		 " <overflow>, %llu resources not tracked\n",
+		 (unsigned long long) perf.noverflow,
+		 (unsigned long long) perf.nuntracked);
+
+  if (! perf.ntraces)
+    return 0;
+
   double depthAvg = (1. * perf.sumDepth) / perf.ntraces;
   double ticksAvg = (1. * perf.sumTicks) / perf.ntraces;
   double tperdAvg = (1./16 * perf.sumTPerD) / perf.ntraces;
@@ -372,6 +1083,283 @@ dumpAllProfiles(void *arg)
   return 0;
 }
 
+/** Pause profiling if @a pause is set, otherwise resume it.  Pausing
+    or resuming more than once has no further effect.  */
+static void
+setPaused(bool pause)
+{
+  pthread_mutex_lock(&s_pauselock);
+  if (pause && ! s_paused)
+    igprof_disable_globally();
+  else if (! pause && s_paused)
+    igprof_enable_globally();
+  s_paused = pause;
+  pthread_mutex_unlock(&s_pauselock);
+}
+
+/** Return the current monotonic time in seconds.  */
+static double
+monotonicTime(void)
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/** Format the control reply for the "stats" command into @a buf:
+    the trace performance statistics and memory use of all buffers.  */
+static int
+controlStats(char *buf, size_t len)
+{
+  IgProfTrace::PerfStat perf = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+  size_t memory = 0;
+  int nbufs = 0;
+
+  pthread_mutex_lock(&s_buflock);
+  std::set<IgProfTrace *> &bufs = allTraceBuffers();
+  std::set<IgProfTrace *>::iterator i, e;
+  for (i = bufs.begin(), e = bufs.end(); i != e; ++i, ++nbufs)
+  {
+    (*i)->lock();
+    perf += (*i)->perfStats();
+    memory += (*i)->memory();
+    (*i)->unlock();
+  }
+
+  s_masterbuf->lock();
+  perf += s_masterbuf->perfStats();
+  memory += s_masterbuf->memory();
+  s_masterbuf->unlock();
+  pthread_mutex_unlock(&s_buflock);
+
+  double n = perf.ntraces ? 1. * perf.ntraces : 1.;
+  return snprintf(buf, len, "ok ntraces=%llu depth=%.1f ticks=%.1f"
+                  " ticks-per-depth=%.1f buffers=%d memory=%lu used=%lu"
+                  " paused=%d overflow=%llu untracked=%llu\n",
+                  (unsigned long long) perf.ntraces,
+                  perf.sumDepth / n, perf.sumTicks / n,
+                  perf.sumTPerD / 16. / n,
+                  nbufs + 1, (unsigned long) memory,
+                  (unsigned long) IgProfBuffer::memoryUsed(), s_paused ? 1 : 0,
+                  (unsigned long long) perf.noverflow,
+                  (unsigned long long) perf.nuntracked);
+}
+
+/** Execute control command @a cmd and format the reply into @a buf.
+    Returns the length of the reply.  */
+static int
+controlCommand(char *cmd, char *buf, size_t len)
+{
+  char *arg = cmd + strcspn(cmd, " \t");
+  if (*arg)
+  {
+    *arg++ = 0;
+    arg += strspn(arg, " \t");
+  }
+
+  igprof_debug("control command '%s%s%s'\n", cmd, *arg ? " " : "", arg);
+  if (! strcmp(cmd, "dump"))
+  {
+    // Anyone able to connect could otherwise run commands as us.
+    if (*arg == '|')
+      return snprintf(buf, len, "error dump to a pipe not allowed\n");
+    IgProfDumpInfo info = { 0, 0, 0, 0, 0, 0, *arg ? arg : s_outname, 0, -1,
+                            0, 1, 0, { 0, 0, 0, 0, 0, 0, 0, 0, 0 } };
+    dumpAllProfiles(&info);
+  }
+  else if (! strcmp(cmd, "reset"))
+    igprof_reset_profiles();
+  else if (! strcmp(cmd, "pause"))
+    setPaused(true);
+  else if (! strcmp(cmd, "resume"))
+    setPaused(false);
+  else if (! strcmp(cmd, "stats"))
+    return controlStats(buf, len);
+  else if (! strcmp(cmd, "set-rate"))
+  {
+    char *end = 0;
+    long hz = strtol(arg, &end, 10);
+    if (! s_ratehandler)
+      return snprintf(buf, len, "error no sampling profiler active\n");
+    if (end == arg || *end || hz <= 0 || ! (*s_ratehandler)(hz))
+      return snprintf(buf, len, "error unsupported rate '%s'\n", arg);
+  }
+  else
+    return snprintf(buf, len, "error unknown command '%s'\n", cmd);
+
+  return snprintf(buf, len, "ok\n");
+}
+
+/** Execute control command @a cmd and send the reply to @a fd.  The
+    time taken by the command is added to @a deadline, leaving the
+    client the time it had left to send more commands.  Returns false
+    if the reply could not be sent.  */
+static bool
+replyControl(int fd, char *cmd, double &deadline)
+{
+  char reply[256];
+  double start = monotonicTime();
+  int rlen = controlCommand(cmd, reply, sizeof(reply));
+  deadline += monotonicTime() - start;
+
+  // Do not wait for a client which does not read its replies.
+  if (send(fd, reply, std::min(rlen, int(sizeof(reply)-1)),
+           MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+  {
+    igprof_debug("control reply failed: %s\n", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+/** Serve one connection to the control socket.  Reads commands one
+    per line until the client closes the connection, and writes one
+    reply line for each command.  The connection is served on the dump
+    thread, so the client gets one second in all to send its commands,
+    not counting the time taken to execute them, before it is cut off.  */
+static void
+serveControl(void)
+{
+  int fd = accept(s_controlfd, 0, 0);
+  if (fd < 0)
+    return;
+
+  char cmd[MAX_FNAME+32];
+  size_t len = 0;
+  ssize_t n = -1;
+  bool ok = true;
+  double deadline = monotonicTime() + 1;
+  pollfd pfd = { fd, POLLIN, 0 };
+  int wait;
+  while (ok
+         && (wait = int((deadline - monotonicTime()) * 1000)) > 0
+         && poll(&pfd, 1, wait) > 0
+         && (n = read(fd, cmd + len, sizeof(cmd) - len - 1)) > 0)
+  {
+    len += n;
+    cmd[len] = 0;
+
+    char *line = cmd, *eol;
+    while (ok && (eol = strchr(line, '\n')))
+    {
+      *eol = 0;
+      if (eol > line && eol[-1] == '\r')
+        eol[-1] = 0;
+      if (*line)
+        ok = replyControl(fd, line, deadline);
+      line = eol + 1;
+    }
+
+    len -= line - cmd;
+    memmove(cmd, line, len);
+    if (len == sizeof(cmd) - 1)
+      len = 0;
+  }
+
+  // Accept a final command without a newline.
+  cmd[len] = 0;
+  if (ok && n == 0 && len)
+    replyControl(fd, cmd, deadline);
+
+  close(fd);
+}
+
+/** Create the control socket, by default igprof.<pid>.sock in the
+    temporary directory.  Only our own user can connect to it.  */
+static void
+openControlSocket(void)
+{
+  if (! s_controlname[0])
+  {
+    const char *tmpdir = igprof_getenv("IGPROF_TMPDIR");
+    if (! tmpdir || ! *tmpdir)
+      tmpdir = igprof_getenv("TMPDIR");
+    if (! tmpdir || ! *tmpdir)
+      tmpdir = "/tmp";
+    snprintf(s_controlname, MAX_FNAME, "%s/igprof.%ld.sock",
+             tmpdir, (long) getpid());
+  }
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(s_controlname) >= sizeof(addr.sun_path))
+  {
+    igprof_debug("control socket name %s is too long\n", s_controlname);
+    return;
+  }
+
+  // Create the socket accessible to our own user only, whatever the
+  // umask of the program, as commands can write files as us.
+  strcpy(addr.sun_path, s_controlname);
+  unlink(s_controlname);
+  mode_t mask = umask(077);
+  bool ok = ((s_controlfd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0
+             && fcntl(s_controlfd, F_SETFD, FD_CLOEXEC) >= 0
+             && bind(s_controlfd, (sockaddr *) &addr, sizeof(addr)) >= 0);
+  umask(mask);
+  if (! ok || listen(s_controlfd, 8) < 0)
+  {
+    igprof_debug("can't create control socket %s: %s (error %d)\n",
+                 s_controlname, strerror(errno), errno);
+    if (s_controlfd >= 0)
+      close(s_controlfd);
+    s_controlfd = -1;
+    return;
+  }
+
+  s_controlpid = getpid();
+  igprof_debug("listening for commands on %s\n", s_controlname);
+}
+
+/** Format into @a name the output file name of profile window @a n,
+    the output file name with the window number inserted before any
+    ".gz" suffix.  */
+static void
+windowName(char *name, unsigned long n)
+{
+  char base[MAX_FNAME];
+  if (s_outname[0])
+    strcpy(base, s_outname);
+  else
+    sprintf(base, "igprof.%.100s.%ld.gz", programName(), (long) getpid());
+
+  int len = strlen(base);
+  if (len > 3 && ! strcmp(base + len - 3, ".gz"))
+    snprintf(name, MAX_FNAME, "%.*s.%04lu.gz", len - 3, base, n);
+  else
+    snprintf(name, MAX_FNAME, "%s.%04lu", base, n);
+}
+
+/** Dump out the profile data of the current window and reset the
+    profile buffers to start the next one, unless this is the final
+    dump at exit.  The windows go to numbered
+    output files, of which only the last @a s_keep ones are kept if
+    it is set.  Pipe outputs get every window, and delta dumps are
+    always appended to one file and keep accumulating, to be reset
+    only on request.  */
+static void
+dumpWindow(int blocksig)
+{
+  char name[MAX_FNAME];
+  bool rotate = (s_outname[0] != '|' && ! s_deltadump);
+  if (rotate)
+    windowName(name, s_nwindows);
+
+  IgProfDumpInfo info = { 0, 0, 0, 0, 0, 0, rotate ? name : s_outname, 0, -1,
+                          0, blocksig, blocksig && ! s_deltadump,
+                          { 0, 0, 0, 0, 0, 0, 0, 0, 0 } };
+  dumpAllProfiles(&info);
+
+  if (rotate && s_keep && s_nwindows >= (unsigned long) s_keep)
+  {
+    windowName(name, s_nwindows - s_keep);
+    unlink(name);
+  }
+  ++s_nwindows;
+}
+
 /** Thread generating in-flight profile data dumps.  Handles both
     external asynchronous and in-program synchronous dump requests.
 
@@ -383,24 +1371,51 @@ asyncDumpThread(void *)
 {
   int dodump = 0;
   struct stat st;
+  double window = monotonicTime() + s_period;
   while (true)
   {
     // If we are done processing, quit.  Give threads max ~1s to quit.
     if (s_quitting && ++s_quitting > 100)
       break;
 
+    // Dump and start a new window when the period is up.  Windows are
+    // scheduled on absolute times so dump times do not add up to
+    // drift; windows missed while a dump took too long are skipped.
+    int wait = 10;
+    if (s_period > 0 && ! s_quitting)
+    {
+      double now = monotonicTime();
+      if (now >= window)
+      {
+        dumpWindow(1);
+        now = monotonicTime();
+        while (window <= now)
+          window += s_period;
+      }
+
+      if (window - now < 0.01)
+        wait = int((window - now) * 1000) + 1;
+    }
+
     // Check every once in a while if a dump has been requested.
-    if (! (++dodump % 32) && ! stat(s_dumpflag, &st))
+    if (s_dumpflag[0] && ! (++dodump % 32) && ! stat(s_dumpflag, &st))
     {
       unlink(s_dumpflag);
-      IgProfDumpInfo info = { 0, 0, 0, 0, s_outname, 0, -1, 0, 1,
-                              { 0, 0, 0, 0, 0, 0, 0 } };
+      IgProfDumpInfo info = { 0, 0, 0, 0, 0, 0, s_outname, 0, -1, 0, 1, 0,
+                              { 0, 0, 0, 0, 0, 0, 0, 0, 0 } };
       dumpAllProfiles(&info);
       dodump = 0;
     }
 
-    // Have a nap.
-    usleep(10000);
+    // Collect the process writing a snapshot dump once it is done.
+    reapSnapshot(false);
+
+    // Wait for control commands, or just have a nap.
+    pollfd pfd = { s_controlfd, POLLIN, 0 };
+    if (s_controlfd < 0)
+      usleep(wait * 1000);
+    else if (poll(&pfd, 1, wait) > 0)
+      serveControl();
   }
 
   return 0;
@@ -410,12 +1425,81 @@ extern "C" VISIBLE void
 igprof_dump_now(const char *tofile)
 {
   pthread_t tid;
-  IgProfDumpInfo info = { 0, 0, 0, 0, tofile, 0, -1, 0, 1,
-                          { 0, 0, 0, 0, 0, 0, 0 } };
+  IgProfDumpInfo info = { 0, 0, 0, 0, 0, 0, tofile, 0, -1, 0, 1, 0,
+                          { 0, 0, 0, 0, 0, 0, 0, 0, 0 } };
   pthread_create(&tid, 0, &dumpAllProfiles, &info);
   pthread_join(tid, 0);
 }
 
+/** Application interface to pause profiling, see igprof.h.  */
+extern "C" VISIBLE void
+igprof_api_pause(void)
+{
+  if (s_igprof_activated)
+    setPaused(true);
+}
+
+/** Application interface to resume profiling, see igprof.h.  */
+extern "C" VISIBLE void
+igprof_api_resume(void)
+{
+  if (s_igprof_activated)
+    setPaused(false);
+}
+
+/** Application interface to reset the profile, see igprof.h.  */
+extern "C" VISIBLE void
+igprof_api_reset(void)
+{
+  if (s_igprof_activated)
+    igprof_reset_profiles();
+}
+
+/** Application interface to start a profile phase, see igprof.h.
+    Each distinct phase name gets a synthetic frame the first time it
+    is used, which #IgProfTrace::push() then adds as the root of every
+    stack trace until the phase changes.  */
+extern "C" VISIBLE void
+igprof_api_phase(const char *name)
+{
+  if (! s_igprof_activated)
+    return;
+
+  if (! name || ! *name)
+  {
+    s_igprof_phase = 0;
+    return;
+  }
+
+  // Copy the name without characters the dump format cannot handle.
+  char phase[MAX_PHASENAME];
+  int n = 0;
+  for ( ; n < MAX_PHASENAME-1 && name[n]; ++n)
+    phase[n] = (strchr("()\n", name[n]) ? '_' : name[n]);
+  phase[n] = 0;
+
+  int i;
+  void *frame = 0;
+  pthread_mutex_lock(&s_phaselock);
+  for (i = 0; i < s_nphases; ++i)
+    if (! strcmp(s_phasenames[i], phase))
+      break;
+
+  if (i < s_nphases)
+    frame = s_phaseframes[i];
+  else if (s_nphases < MAX_PHASES)
+  {
+    strcpy(s_phasenames[i], phase);
+    if ((frame = igprof_synthetic_frame(s_phasenames[i])))
+      s_phaseframes[s_nphases++] = frame;
+  }
+
+  if (! frame)
+    igprof_debug("too many profile phases, ignoring phase '%s'\n", phase);
+  s_igprof_phase = frame;
+  pthread_mutex_unlock(&s_phaselock);
+}
+
 /** Dump out profile data when application is about to exit. */
 static void
 exitDump(void *)
@@ -434,10 +1518,19 @@ exitDump(void *)
   setitimer(ITIMER_VIRTUAL, &stopped, 0);
   setitimer(ITIMER_REAL, &stopped, 0);
 
-  // Dump all buffers.
-  IgProfDumpInfo info = { 0, 0, 0, 0, s_outname, 0, -1, 0, 0,
-                          { 0, 0, 0, 0, 0, 0, 0 } };
-  dumpAllProfiles(&info);
+  // Remove the control socket, unless it belongs to our parent.
+  if (s_controlfd >= 0 && s_controlpid == getpid())
+    unlink(s_controlname);
+
+  // Dump all buffers, as the last window if dumping periodically.
+  if (s_period > 0)
+    dumpWindow(0);
+  else
+  {
+    IgProfDumpInfo info = { 0, 0, 0, 0, 0, 0, s_outname, 0, -1, 0, 0, 0,
+                            { 0, 0, 0, 0, 0, 0, 0, 0, 0 } };
+    dumpAllProfiles(&info);
+  }
   igprof_debug("igprof quitting\n");
   s_initialized = 0; // signal local data is unsafe to use
 }
@@ -500,6 +1593,7 @@ igprof_init(const char *id, void (*threadinit)(void), bool perthread, double clo
     return s_igprof_activated = false;
   }
 
+  bool threadframes = false;
   for (const char *opts = options; *opts; )
   {
     while (*opts == ' ' || *opts == ',')
@@ -513,6 +1607,76 @@ igprof_init(const char *id, void (*threadinit)(void), bool perthread, double clo
         s_outname[i++] = *opts++;
       s_outname[i] = 0;
     }
+    else if (! strncmp(opts, "igprof:binary", 13))
+    {
+      s_binarydump = true;
+      opts += 13;
+    }
+    else if (! strncmp(opts, "igprof:compress", 15))
+    {
+      s_compress = true;
+      opts += 15;
+    }
+    else if (! strncmp(opts, "igprof:delta", 12))
+    {
+      s_deltadump = s_binarydump = true;
+      opts += 12;
+    }
+    else if (! strncmp(opts, "igprof:snapshot", 15))
+    {
+      s_snapshot = true;
+      opts += 15;
+    }
+    else if (! strncmp(opts, "igprof:control='", 16))
+    {
+      int i = 0;
+      opts += 16;
+      while (i < MAX_FNAME-1 && *opts && *opts != '\'')
+        s_controlname[i++] = *opts++;
+      s_controlname[i] = 0;
+      s_control = true;
+    }
+    else if (! strncmp(opts, "igprof:control", 14))
+    {
+      s_control = true;
+      opts += 14;
+    }
+    else if (! strncmp(opts, "igprof:period=", 14))
+    {
+      char *end = 0;
+      s_period = strtod(opts+14, &end);
+      if (*end == 'm')
+        s_period *= 60;
+      else if (*end == 'h')
+        s_period *= 3600;
+      opts = end;
+    }
+    else if (! strncmp(opts, "igprof:keep=", 12))
+    {
+      char *end = 0;
+      s_keep = strtol(opts+12, &end, 10);
+      opts = end;
+    }
+    else if (! strncmp(opts, "igprof:threads", 14))
+    {
+      threadframes = true;
+      opts += 14;
+    }
+    else if (! strncmp(opts, "igprof:hugepages", 16))
+    {
+      IgProfBuffer::setHugePages(IgProfBuffer::HUGE_PAGES_THP);
+      opts += 16;
+    }
+    else if (! strncmp(opts, "igprof:hugetlb", 14))
+    {
+      IgProfBuffer::setHugePages(IgProfBuffer::HUGE_PAGES_HUGETLB);
+      opts += 14;
+    }
+    else if (! strncmp(opts, "igprof:raw", 10))
+    {
+      s_rawdump = true;
+      opts += 10;
+    }
     else if (! strncmp(opts, "igprof:dump='", 13))
     {
       int i = 0;
@@ -528,6 +1692,12 @@ igprof_init(const char *id, void (*threadinit)(void), bool perthread, double clo
       opts++;
   }
 
+  if (s_deltadump && s_rawdump)
+  {
+    igprof_debug("raw addresses are not supported in delta dumps\n");
+    s_rawdump = false;
+  }
+
   // Install exit handler to generate actual dump.
   abi::__cxa_atexit(&exitDump, 0, 0);
 
@@ -566,15 +1736,65 @@ igprof_init(const char *id, void (*threadinit)(void), bool perthread, double clo
     s_clockres = clockres;
   }
 
+  // Select the stack walker.
+  if (const char *unwind = igprof_getenv("IGPROF_UNWIND"))
+  {
+    if (! strcmp(unwind, "fp"))
+      IgHookTrace::setUnwinder(IgHookTrace::UNWIND_FP);
+    else if (! strcmp(unwind, "auto"))
+      IgHookTrace::setUnwinder(IgHookTrace::UNWIND_AUTO);
+    else if (! strcmp(unwind, "dwarf"))
+      IgHookTrace::setUnwinder(IgHookTrace::UNWIND_DWARF);
+    else
+      igprof_debug("unrecognised IGPROF_UNWIND value '%s', ignored\n", unwind);
+  }
+
+  // Limit the memory of the profile buffers.  Over the limit, or once
+  // a buffer cannot get any more memory, new stack traces go under the
+  // overflow frame, see IgProfTrace::push().
+  s_igprof_overflow = igprof_synthetic_frame("<overflow>");
+  const char *limit = igprof_getenv("IGPROF_MAX_MEMORY");
+  if (limit && *limit)
+  {
+    char *end = 0;
+    double size = strtod(limit, &end);
+    if (*end == 'k' || *end == 'K')
+      size *= 1024, ++end;
+    else if (*end == 'm' || *end == 'M')
+      size *= 1024 * 1024, ++end;
+    else if (*end == 'g' || *end == 'G')
+      size *= 1024 * 1024 * 1024, ++end;
+
+    if (end == limit || *end || size < 1)
+      igprof_debug("unrecognised IGPROF_MAX_MEMORY value '%s', ignored\n", limit);
+    else if (s_igprof_overflow)
+    {
+      IgProfBuffer::setMemoryLimit((size_t) size);
+      igprof_debug("limiting profile buffers to %.0f MB, %lu MB used\n",
+                   size / 1024 / 1024,
+                   (unsigned long) (IgProfBuffer::memoryUsed() >> 20));
+    }
+  }
+
   // Initialise per thread stuff.
-  pthread_key_create(&s_igprof_flagkey, &freeThreadFlag);
-  pthread_setspecific(s_igprof_flagkey, new IgProfAtomic(0));
+  pthread_key_create(&s_bufkey, &freeTraceBuffer);
+  setThreadBuffer(s_tracebuf, false);
 
-  pthread_key_create(&s_igprof_bufkey, &freeTraceBuffer);
-  pthread_setspecific(s_igprof_bufkey, s_tracebuf);
+  if (threadframes)
+  {
+    pthread_key_create(&s_threadkey, &unregisterThread);
+    s_igprof_threadframes = true;
+    registerThread();
+  }
 
-  // Start dump thread if we watch for a file.
-  if (s_dumpflag[0])
+  // Start dump thread if we watch for a file, serve a control socket
+  // or dump periodically.
+  if (s_control)
+    openControlSocket();
+  if (s_period > 0)
+    igprof_debug("dumping profile windows every %g s%s\n", s_period,
+                 s_deltadump ? " without reset" : "");
+  if (s_dumpflag[0] || s_controlfd >= 0 || s_period > 0)
     pthread_create(&s_dumpthread, 0, &asyncDumpThread, 0);
 
   // Hook into functions we care about.
@@ -582,6 +1802,8 @@ igprof_init(const char *id, void (*threadinit)(void), bool perthread, double clo
   IgHook::hook(doexit_hook_main2.raw);
   IgHook::hook(dokill_hook_main.raw);
   IgHook::hook(dopthread_create_hook_main.raw);
+  if (s_igprof_threadframes)
+    IgHook::hook(dopthread_setname_np_hook_main.raw);
 #if __linux
   if (doexit_hook_main.raw.chain)  IgHook::hook(doexit_hook_libc.raw);
   if (doexit_hook_main2.raw.chain) IgHook::hook(doexit_hook_libc2.raw);
@@ -606,24 +1828,112 @@ igprof_options(void)
   return s_options;
 }
 
-/** Reset all current profile buffers. */
+/** Keep the per-thread profile buffers of exited threads until the end
+    of the program, and hand them to new threads, instead of merging
+    them to the master buffer and deleting them.  For profiler modules
+    which refer to the buffers of other threads.  */
 void
-igprof_reset_profiles(void)
+igprof_keep_thread_buffers(void)
 {
+  s_keepbufs = true;
+}
+
+/** Create an additional profile buffer shared by all threads.  For
+    profiler modules which spread their data over several buffers to
+    reduce lock contention.  The buffer is dumped and reset along with
+    all the other buffers, and lives until the end of the program.  */
+IgProfTrace *
+igprof_make_shared_buffer(void)
+{
+  IgProfTrace *buf = new IgProfTrace;
   pthread_mutex_lock(&s_buflock);
-  std::set<IgProfTrace *>::iterator i, e;
-  std::set<IgProfTrace *> &bufs = allTraceBuffers();
-  for (i = bufs.begin(), e = bufs.end(); i != e; ++i)
+  allTraceBuffers().insert(buf);
+  pthread_mutex_unlock(&s_buflock);
+  return buf;
+}
+
+/** A wrapper for starting internal helper threads.  */
+static void *
+helperThreadWrapper(void *arg)
+{
+  IgProfWrappedArg *wrapped = (IgProfWrappedArg *) arg;
+  void *(*start_routine)(void*) = wrapped->start_routine;
+  void *start_arg = wrapped->arg;
+  delete wrapped;
+  return (*start_routine)(start_arg);
+}
+
+/** Start an internal helper thread for a profiler module, for
+    example a sampler thread.  Unlike other threads the helper is not
+    captured for profiling: it gets no profile buffer, and the module
+    thread initialisation is not run in it.  */
+int
+igprof_create_helper_thread(pthread_t *thread, void *(*start_routine)(void *),
+                            void *arg)
+{
+  igprof_disable();
+  IgProfWrappedArg *wrapped = new IgProfWrappedArg;
+  wrapped->start_routine = start_routine;
+  wrapped->arg = arg;
+  igprof_enable();
+  return pthread_create(thread, 0, &helperThreadWrapper, wrapped);
+}
+
+/** Return a fake call address standing for a synthetic call frame
+    called @a name, for example to group samples by a property of the
+    sample instead of by code location.  The address is unique to the
+    call, never a real code address, and is reported by the symbol
+    cache as @a name in a pseudo binary "<igprof>".  The name must not
+    contain parentheses or newlines and must remain valid until the
+    end of the program.  Returns null if no more frames can be made. */
+void *
+igprof_synthetic_frame(const char *name)
+{
+  void *addr = 0;
+  pthread_mutex_lock(&s_synthlock);
+  if (! s_synthbase)
   {
-    IgProfTrace *buf = *i;
-    buf->lock();
-    buf->reset();
-    buf->unlock();
+    void *base = mmap(0, MAX_SYNTHETIC, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base != MAP_FAILED)
+      s_synthbase = (char *) base;
   }
 
-  s_masterbuf->lock();
-  s_masterbuf->reset();
-  s_masterbuf->unlock();
+  if (s_synthbase && s_nsynth < MAX_SYNTHETIC)
+  {
+    s_synthnames[s_nsynth] = name;
+    addr = s_synthbase + s_nsynth++;
+  }
+  pthread_mutex_unlock(&s_synthlock);
+  return addr;
+}
+
+/** Return the name of synthetic call frame @a address as created by
+    #igprof_synthetic_frame(), or null if the address is not one.  */
+const char *
+igprof_synthetic_name(void *address)
+{
+  char *addr = (char *) address;
+  if (s_synthbase && addr >= s_synthbase && addr < s_synthbase + s_nsynth)
+    return s_synthnames[addr - s_synthbase];
+  return 0;
+}
+
+/** Register the function the control socket "set-rate" command
+    calls to change the sampling rate of the active profiler module.
+    The handler returns @c false if it cannot sample at that rate.  */
+void
+igprof_set_rate_handler(bool (*handler)(long hz))
+{
+  s_ratehandler = handler;
+}
+
+/** Reset all current profile buffers. */
+void
+igprof_reset_profiles(void)
+{
+  pthread_mutex_lock(&s_buflock);
+  resetAllBuffers();
   pthread_mutex_unlock(&s_buflock);
 }
 
@@ -711,8 +2021,9 @@ threadWrapper(void *arg)
 		   (void *)(start_routine), start_arg);
 
     /* Setup thread for use in profiling. */
-    pthread_setspecific(s_igprof_bufkey, makeTraceBuffer());
-    pthread_setspecific(s_igprof_flagkey, new IgProfAtomic(1));
+    if (s_igprof_threadframes)
+      registerThread();
+    setThreadBuffer(makeTraceBuffer(), true);
   }
 
   // Make sure we've called stack trace code at least once in
@@ -758,7 +2069,7 @@ dopthread_create(IgHook::SafeData<igprof_dopthread_create_t> &hook,
     pthread_attr_setstacksize((pthread_attr_t *) attr, 64*1024);
   }
 
-  if (start_routine == dumpAllProfiles)
+  if (start_routine == dumpAllProfiles || start_routine == helperThreadWrapper)
     return hook.chain(thread, attr, start_routine, arg);
   else
   {
@@ -774,6 +2085,27 @@ dopthread_create(IgHook::SafeData<igprof_dopthread_create_t> &hook,
   }
 }
 
+/** Trapped calls to pthread_setname_np().  Update the synthetic root
+    frame of the thread to the new name.  */
+static int
+dopthread_setname_np(IgHook::SafeData<igprof_dopthread_setname_np_t> &hook,
+                     pthread_t thread, const char *name)
+{
+  int ret = hook.chain(thread, name);
+  if (ret == 0 && s_igprof_threadframes && name)
+  {
+    pthread_mutex_lock(&s_threadlock);
+    for (IgProfThread *t = s_threads; t; t = t->next)
+      if (pthread_equal(t->thread, thread))
+      {
+        setThreadFrame(t, name);
+        break;
+      }
+    pthread_mutex_unlock(&s_threadlock);
+  }
+  return ret;
+}
+
 /** Trapped calls to exit() and _exit().  */
 static void
 doexit(IgHook::SafeData<igprof_doexit_t> &hook, int code)
@@ -802,8 +2134,8 @@ dokill(IgHook::SafeData<igprof_dokill_t> &hook, pid_t pid, int sig)
     {
       igprof_disable_globally();
       igprof_debug("kill(%d,%d) called, dumping state\n", (int) pid, sig);
-      IgProfDumpInfo info = { 0, 0, 0, 0, s_outname, 0, -1, 0, 0,
-                              { 0, 0, 0, 0, 0, 0, 0 } };
+      IgProfDumpInfo info = { 0, 0, 0, 0, 0, 0, s_outname, 0, -1, 0, 0, 0,
+                              { 0, 0, 0, 0, 0, 0, 0, 0, 0 } };
       dumpAllProfiles(&info);
       igprof_enable_globally();
     }
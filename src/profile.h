@@ -8,16 +8,40 @@
 
 class IgProfTrace;
 
+/** Per-thread state for the synthetic thread root frames.  */
+struct HIDDEN IgProfThread
+{
+  void * volatile       frame;  //< Root frame for the thread, or null.
+  pthread_t             thread; //< The thread.
+  long                  tid;    //< Kernel thread id.
+  IgProfThread          *next;  //< Next thread in the list of all threads.
+};
+
+/// Value of the thread profiling flag in threads not set up for profiling.
+static const int        IGPROF_NO_THREAD = -0x40000000;
+
 extern bool             s_igprof_activated;
 extern IgProfAtomic     s_igprof_enabled;
-extern pthread_key_t    s_igprof_bufkey;
-extern pthread_key_t    s_igprof_flagkey;
+extern THREAD_LOCAL IgProfTrace *s_igprof_buffer INITIAL_EXEC;
+extern THREAD_LOCAL volatile int s_igprof_flag INITIAL_EXEC;
+extern THREAD_LOCAL IgProfThread *s_igprof_thread INITIAL_EXEC;
+extern void             *s_igprof_phase;
+extern bool             s_igprof_threadframes;
+extern void             *s_igprof_overflow;
 extern void             (*igprof_abort) (void) __attribute__((noreturn));
 extern char *           (*igprof_getenv) (const char *);
 extern int              (*igprof_unsetenv) (const char *);
 
 HIDDEN const char *igprof_options(void);
 HIDDEN void igprof_reset_profiles(void);
+HIDDEN void igprof_set_rate_handler(bool (*handler)(long hz));
+HIDDEN IgProfTrace *igprof_make_shared_buffer(void);
+HIDDEN void igprof_keep_thread_buffers(void);
+HIDDEN void *igprof_synthetic_frame(const char *name);
+HIDDEN const char *igprof_synthetic_name(void *address);
+HIDDEN int igprof_create_helper_thread(pthread_t *thread,
+                                       void *(*start_routine)(void *),
+                                       void *arg);
 HIDDEN void igprof_debug(const char *format, ...);
 HIDDEN int igprof_panic(const char *file, int line, const char *func, const char *expr);
 HIDDEN bool igprof_init(const char *id, void (*threadinit)(void),
@@ -31,8 +55,20 @@ HIDDEN bool igprof_init(const char *id, void (*threadinit)(void),
 HIDDEN inline IgProfTrace *
 igprof_buffer(void)
 {
-  return LIKELY(s_igprof_activated)
-    ? (IgProfTrace *) pthread_getspecific(s_igprof_bufkey) : 0;
+  return LIKELY(s_igprof_activated) ? s_igprof_buffer : 0;
+}
+
+/** Return the synthetic root frame of the calling thread if stacks
+    are rooted at per-thread frames, otherwise null.  Safe to call
+    from asynchronous signal handlers.  */
+HIDDEN inline void *
+igprof_thread_frame(void)
+{
+  if (LIKELY(! s_igprof_threadframes))
+    return 0;
+
+  IgProfThread *t = s_igprof_thread;
+  return t ? t->frame : 0;
 }
 
 /** Enable the profiling system globally. Safe to call from anywhere. */
@@ -50,12 +86,16 @@ igprof_disable_globally(void)
 }
 
 /** Enable the profiler in this thread. Safe to call from anywhere.
-    Returns @c true if the profiler is enabled after the call. */
+    Returns @c true if the profiler is enabled after the call.
+
+    The flag is only ever changed by its own thread, including signal
+    handlers running on it, and those always restore it before they
+    return, so a plain increment suffices.  Threads not set up for
+    profiling have a flag so far below zero it never turns positive. */
 HIDDEN inline bool
 igprof_enable(void)
 {
-  IgProfAtomic *flag = (IgProfAtomic *) pthread_getspecific(s_igprof_flagkey);
-  return LIKELY(flag) && IgProfAtomicInc(flag) > 0 && s_igprof_enabled > 0;
+  return ++s_igprof_flag > 0 && s_igprof_enabled > 0;
 }
 
 /** Disable the profiler in this thread. Safe to call from anywhere.
@@ -63,8 +103,7 @@ igprof_enable(void)
 HIDDEN inline bool
 igprof_disable(void)
 {
-  IgProfAtomic *flag = (IgProfAtomic *) pthread_getspecific(s_igprof_flagkey);
-  return LIKELY(flag) && IgProfAtomicDec(flag) >= 0 && s_igprof_enabled > 0;
+  return --s_igprof_flag >= 0 && s_igprof_enabled > 0;
 }
 
 #endif // PROFILE_H
@@ -1,5 +1,5 @@
 #include "sym-cache.h"
-#include "walk-syms.h"
+#include "sym-index.h"
 #include <memory.h>
 
 /** Initialise a symbol translation buffer.  */
@@ -8,6 +8,8 @@ IgProfSymCache::IgProfSymCache(void)
   memset(bintable_, 0, sizeof(bintable_));
   memset(symtable_, 0, sizeof(symtable_));
   memset(symcache_, 0, sizeof(symcache_));
+  memset(nametable_, 0, sizeof(nametable_));
+  IgProfSymIndex::refresh();
 }
 
 /** Destroy the symbol translation buffer.  */
@@ -53,7 +55,10 @@ IgProfSymCache::roundAddressToSymbol(void *address)
   Symbol     *s;
   const char *binary;
   Symbol     sym = { 0, address, 0, 0, 0, 0, -1 };
-  IgHookTrace::symbol(address, sym.name, binary, sym.symoffset, sym.binoffset);
+  if ((sym.name = igprof_synthetic_name(address)))
+    binary = "<igprof>";
+  else
+    IgProfSymIndex::symbol(address, sym.name, binary, sym.symoffset, sym.binoffset);
 
   // Hook up the cache entry to sort order in the hash list.
   SymCache *next = *sclink;
@@ -117,3 +122,24 @@ IgProfSymCache::get(void *address)
 {
   return symbolForAddress(roundAddressToSymbol(address));
 }
+
+/** Return the name entry for symbol name @a name.  Names are the
+    strings returned by the symbol lookup and are compared by address,
+    which is enough to share the name of all call sites in a function.  */
+IgProfSymCache::Name *
+IgProfSymCache::name(const char *name)
+{
+  Name **nlink = &nametable_[hash((uintptr_t) name, 32) & (NAME_HASH-1)];
+  while (Name *n = *nlink)
+  {
+    if (n->name == name)
+      return n;
+    nlink = &n->next;
+  }
+
+  Name *n = *nlink = allocate<Name>();
+  n->next = 0;
+  n->name = name;
+  n->id = -1;
+  return n;
+}
@@ -12,8 +12,10 @@ class HIDDEN IgProfSymCache : protected IgProfBuffer
 {
   static const unsigned int BINARY_HASH = 128;
   static const unsigned int SYMBOL_HASH = 128*1024;
+  static const unsigned int NAME_HASH = 16*1024;
 public:
   struct Binary;
+  struct Name;
   struct Symbol;
   struct SymCache;
 
@@ -37,6 +39,14 @@ public:
     int         id;             //< Reference ID in final output, -1 if unset.
   };
 
+  /// A symbol name, so binary dumps can write each name only once.
+  struct Name
+  {
+    Name        *next;          //< The next name in the hash bin chain.
+    const char  *name;          //< The name, compared by address.
+    int         id;             //< Reference ID in final output, -1 if unset.
+  };
+
   /// Hash table cache entry for call address to symbol address mappings.
   struct SymCache
   {
@@ -49,6 +59,7 @@ public:
   ~IgProfSymCache(void);
 
   Symbol *      get(void *address);
+  Name *        name(const char *name);
 
 private:
   void *        roundAddressToSymbol(void *address);
@@ -57,6 +68,7 @@ private:
   Binary        *bintable_[BINARY_HASH]; //< The binaries hash.
   Symbol        *symtable_[SYMBOL_HASH]; //< The symbol hash.
   SymCache      *symcache_[SYMBOL_HASH]; //< The symbol cache hash.
+  Name          *nametable_[NAME_HASH];  //< The symbol name hash.
 
   // Unavailable copy constructor, assignment operator
   IgProfSymCache(IgProfSymCache &);
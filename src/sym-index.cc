@@ -0,0 +1,520 @@
+#include "sym-index.h"
+#include "walk-syms.h"
+#include "profile.h"
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#if __linux
+# include <link.h>
+# include <elf.h>
+# if __ELF_NATIVE_CLASS == 64
+#  define ELF_NATIVE_CLASS ELFCLASS64
+#  define ELF_ST_TYPE ELF64_ST_TYPE
+#  define ELF_ST_BIND ELF64_ST_BIND
+# else
+#  define ELF_NATIVE_CLASS ELFCLASS32
+#  define ELF_ST_TYPE ELF32_ST_TYPE
+#  define ELF_ST_BIND ELF32_ST_BIND
+# endif
+#endif
+
+#if !defined MAP_ANONYMOUS && defined MAP_ANON
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#if __linux
+/// One symbol in the sorted per-object symbol array.
+struct HIDDEN SymEntry
+{
+  uintptr_t     address;        //< Run-time address of the symbol.
+  size_t        size;           //< Size of the symbol, zero if unknown.
+  const char    *name;          //< Name, points into the object image.
+  unsigned int  rank;           //< Preference among symbols at same address.
+};
+
+/// A loaded object and its symbol table.
+struct HIDDEN SymModule
+{
+  const char    *name;          //< Object name as reported by dladdr().
+  const char    *path;          //< File to read the symbol table from.
+  uintptr_t     bias;           //< Load bias, added to symbol values.
+  uintptr_t     start;          //< First mapped address (dli_fbase).
+  uintptr_t     end;            //< End of the last mapped segment.
+  const unsigned char *buildid; //< GNU build-id in the loaded image.
+  unsigned int  buildidlen;     //< Length of @a buildid in bytes.
+  void          *image;         //< Object file mapped into memory.
+  size_t        imagesize;      //< Size of the @a image mapping.
+  SymEntry      *syms;          //< Symbols sorted by address.
+  size_t        nsyms;          //< Number of entries in @a syms.
+  size_t        symsize;        //< Size of the @a syms mapping.
+  int           state;          //< 0 = not loaded, 1 = loaded, -1 = failed.
+  bool          seen;           //< Seen in the latest object scan.
+  bool          ismain;         //< The main program, renamed below.
+};
+
+// Rank bases: dladdr() prefers the first matching dynamic symbol, so
+// dynamic symbols keep their table order and win over .symtab ones.
+static const unsigned int RANK_GLOBAL = 1u << 30;
+static const unsigned int RANK_LOCAL  = 1u << 31;
+
+static SymModule        *s_modules      = 0;
+static size_t           s_nmodules      = 0;
+static size_t           s_maxmodules    = 0;
+static unsigned long long s_adds        = 0;
+static unsigned long long s_subs        = 0;
+static bool             s_scanned       = false;
+static bool             s_frozen        = false;
+
+/** Allocate @a size bytes of zeroed memory directly from the system.
+    The index must not use malloc() as the memory profiler may be
+    tracking it while the dump runs.  */
+static void *
+allocateMemory(size_t size)
+{
+  void *p = mmap(0, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return p == MAP_FAILED ? 0 : p;
+}
+
+/** Release the symbol table of module @a m.  */
+static void
+releaseModule(SymModule &m)
+{
+  if (m.syms)
+    munmap(m.syms, m.symsize);
+  if (m.image)
+    munmap(m.image, m.imagesize);
+  m.syms = 0;
+  m.image = 0;
+  m.nsyms = m.symsize = m.imagesize = 0;
+  m.state = 0;
+}
+
+/** Order symbols by address, then by preference: sized symbols before
+    unsized ones, then by rank.  */
+static bool
+symbolLess(const SymEntry &a, const SymEntry &b)
+{
+  if (a.address != b.address)
+    return a.address < b.address;
+  if ((a.size != 0) != (b.size != 0))
+    return a.size != 0;
+  return a.rank < b.rank;
+}
+
+/** Order symbols by address alone, for lookups.  */
+static bool
+addressLess(const SymEntry &a, const SymEntry &b)
+{
+  return a.address < b.address;
+}
+
+static bool
+moduleLess(const SymModule &a, const SymModule &b)
+{
+  return a.start < b.start;
+}
+
+/** Append the code symbols of symbol table section @a sh to @a out.
+    Local symbols are taken only from .symtab; .dynsym contributes the
+    global and weak symbols dladdr() would consider.  Returns the
+    number of symbols added.  */
+static size_t
+readSymbols(SymEntry *out, const char *image, size_t imagesize,
+	    const ElfW(Shdr) *shdrs, size_t shnum,
+	    const ElfW(Shdr) &sh, uintptr_t bias, bool dynamic)
+{
+  if (sh.sh_link >= shnum
+      || sh.sh_entsize != sizeof(ElfW(Sym))
+      || sh.sh_offset + sh.sh_size > imagesize)
+    return 0;
+
+  const ElfW(Shdr) &strsh = shdrs[sh.sh_link];
+  if (strsh.sh_offset + strsh.sh_size > imagesize)
+    return 0;
+
+  const ElfW(Sym) *syms = (const ElfW(Sym) *) (image + sh.sh_offset);
+  const char      *strtab = image + strsh.sh_offset;
+  size_t          nsyms = sh.sh_size / sizeof(ElfW(Sym));
+  size_t          n = 0;
+
+  for (size_t i = 0; i < nsyms; ++i)
+  {
+    const ElfW(Sym) &s = syms[i];
+    int type = ELF_ST_TYPE(s.st_info);
+    int bind = ELF_ST_BIND(s.st_info);
+
+    if (s.st_shndx == SHN_UNDEF || s.st_shndx == SHN_ABS
+	|| ! s.st_name || s.st_name >= strsh.sh_size
+	|| ! strtab[s.st_name])
+      continue;
+
+    if (type != STT_FUNC && type != STT_GNU_IFUNC
+	&& (type != STT_NOTYPE || bind == STB_LOCAL))
+      continue;
+
+    if (dynamic && bind == STB_LOCAL)
+      continue;
+
+    out[n].address = bias + s.st_value;
+    out[n].size = s.st_size;
+    out[n].name = strtab + s.st_name;
+    out[n].rank = (dynamic ? 0 : bind == STB_LOCAL ? RANK_LOCAL : RANK_GLOBAL)
+		  + (i < RANK_GLOBAL ? i : RANK_GLOBAL-1);
+    ++n;
+  }
+
+  return n;
+}
+
+/** Read and sort the symbol tables of module @a m.  Returns false if
+    the object file cannot be read, in which case lookups for it fall
+    back to dladdr().  */
+static bool
+loadModule(SymModule &m)
+{
+  m.state = -1;
+
+  int fd = open(m.path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(ElfW(Ehdr)))
+  {
+    close(fd);
+    return false;
+  }
+
+  m.imagesize = st.st_size;
+  m.image = mmap(0, m.imagesize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m.image == MAP_FAILED)
+  {
+    m.image = 0;
+    m.imagesize = 0;
+    return false;
+  }
+
+  // Validate the headers before trusting any offsets in them.
+  const char *image = (const char *) m.image;
+  const ElfW(Ehdr) *eh = (const ElfW(Ehdr) *) image;
+  if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0
+      || eh->e_ident[EI_CLASS] != ELF_NATIVE_CLASS
+      || eh->e_shentsize != sizeof(ElfW(Shdr))
+      || eh->e_shoff + eh->e_shnum * sizeof(ElfW(Shdr)) > m.imagesize)
+  {
+    releaseModule(m);
+    m.state = -1;
+    return false;
+  }
+
+  const ElfW(Shdr) *shdrs = (const ElfW(Shdr) *) (image + eh->e_shoff);
+  size_t shnum = eh->e_shnum;
+  size_t maxsyms = 0;
+  for (size_t i = 0; i < shnum; ++i)
+    if (shdrs[i].sh_type == SHT_SYMTAB || shdrs[i].sh_type == SHT_DYNSYM)
+      maxsyms += shdrs[i].sh_size / sizeof(ElfW(Sym));
+
+  if (! maxsyms)
+  {
+    releaseModule(m);
+    m.state = -1;
+    return false;
+  }
+
+  m.symsize = maxsyms * sizeof(SymEntry);
+  if (! (m.syms = (SymEntry *) allocateMemory(m.symsize)))
+  {
+    releaseModule(m);
+    m.state = -1;
+    return false;
+  }
+
+  for (size_t i = 0; i < shnum; ++i)
+    if (shdrs[i].sh_type == SHT_SYMTAB || shdrs[i].sh_type == SHT_DYNSYM)
+      m.nsyms += readSymbols(m.syms + m.nsyms, image, m.imagesize,
+			     shdrs, shnum, shdrs[i], m.bias,
+			     shdrs[i].sh_type == SHT_DYNSYM);
+
+  // Sort by address and keep only the preferred symbol per address.
+  std::sort(m.syms, m.syms + m.nsyms, symbolLess);
+  size_t n = 0;
+  for (size_t i = 0; i < m.nsyms; ++i)
+    if (! n || m.syms[n-1].address != m.syms[i].address)
+      m.syms[n++] = m.syms[i];
+  m.nsyms = n;
+
+  // Return the unused tail of the symbol array to the system.
+  size_t pagesize = getpagesize();
+  size_t used = (n * sizeof(SymEntry) + pagesize - 1) & ~(pagesize - 1);
+  if (used < m.symsize)
+  {
+    munmap((char *) m.syms + used, m.symsize - used);
+    m.symsize = used;
+  }
+
+  igprof_debug("indexed %lu symbols from %s\n",
+	       (unsigned long) n, m.path);
+  m.state = 1;
+  return true;
+}
+
+/** Find the GNU build-id note among the loaded segments of an object.  */
+static void
+findBuildId(struct dl_phdr_info *info, SymModule &m)
+{
+  for (int i = 0; i < info->dlpi_phnum; ++i)
+  {
+    if (info->dlpi_phdr[i].p_type != PT_NOTE)
+      continue;
+
+    const char *p = (const char *) (info->dlpi_addr + info->dlpi_phdr[i].p_vaddr);
+    const char *end = p + info->dlpi_phdr[i].p_memsz;
+    while (p + sizeof(ElfW(Nhdr)) <= end)
+    {
+      const ElfW(Nhdr) *note = (const ElfW(Nhdr) *) p;
+      const char *name = p + sizeof(ElfW(Nhdr));
+      const char *desc = name + ((note->n_namesz + 3) & ~3);
+      p = desc + ((note->n_descsz + 3) & ~3);
+      if (p > end)
+	break;
+
+      if (note->n_type == NT_GNU_BUILD_ID
+	  && note->n_namesz == 4
+	  && ! memcmp(name, "GNU", 4))
+      {
+	m.buildid = (const unsigned char *) desc;
+	m.buildidlen = note->n_descsz;
+	return;
+      }
+    }
+  }
+}
+
+/** Add or mark one loaded object reported by dl_iterate_phdr().  */
+static int
+scanObject(struct dl_phdr_info *info, size_t size, void *data)
+{
+  bool &first = *(bool *) data;
+  bool ismain = first;
+  first = false;
+
+  // Stop at once if the set of loaded objects has not changed.
+  if (ismain && size >= offsetof(dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+  {
+    if (s_scanned && info->dlpi_adds == s_adds && info->dlpi_subs == s_subs)
+      return 1;
+    s_adds = info->dlpi_adds;
+    s_subs = info->dlpi_subs;
+  }
+
+  uintptr_t start = ~uintptr_t(0), end = 0;
+  for (int i = 0; i < info->dlpi_phnum; ++i)
+    if (info->dlpi_phdr[i].p_type == PT_LOAD)
+    {
+      uintptr_t lo = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+      uintptr_t hi = lo + info->dlpi_phdr[i].p_memsz;
+      start = std::min(start, lo);
+      end = std::max(end, hi);
+    }
+
+  if (start >= end)
+    return 0;
+
+  start &= ~uintptr_t(getpagesize() - 1);
+
+  // The main program was given another name, so match it by its
+  // position as the first object reported instead.
+  for (size_t i = 0; i < s_nmodules; ++i)
+    if ((s_modules[i].ismain ? ismain : s_modules[i].name == info->dlpi_name)
+	&& s_modules[i].bias == info->dlpi_addr
+	&& s_modules[i].start == start)
+    {
+      s_modules[i].seen = true;
+      return 0;
+    }
+
+  if (s_nmodules == s_maxmodules)
+  {
+    size_t newmax = s_maxmodules ? 2 * s_maxmodules : 256;
+    SymModule *mods = (SymModule *) allocateMemory(newmax * sizeof(SymModule));
+    if (! mods)
+      return 1;
+    if (s_modules)
+    {
+      memcpy(mods, s_modules, s_nmodules * sizeof(SymModule));
+      munmap(s_modules, s_maxmodules * sizeof(SymModule));
+    }
+    s_modules = mods;
+    s_maxmodules = newmax;
+  }
+
+  // dladdr() reports the main program under its invocation name.
+  SymModule &m = s_modules[s_nmodules++];
+  memset(&m, 0, sizeof(m));
+  m.name = info->dlpi_name;
+  m.path = info->dlpi_name;
+  m.bias = info->dlpi_addr;
+  m.start = start;
+  m.end = end;
+  m.seen = true;
+  findBuildId(info, m);
+  if (! m.name[0])
+  {
+    if (ismain)
+    {
+      m.name = program_invocation_name;
+      m.path = "/proc/self/exe";
+      m.ismain = true;
+    }
+    else
+      m.state = -1;
+  }
+  return 0;
+}
+
+/** Find the module containing @a address.  */
+static SymModule *
+findModule(uintptr_t address)
+{
+  SymModule key;
+  key.start = address;
+  SymModule *m = std::upper_bound(s_modules, s_modules + s_nmodules,
+				  key, moduleLess);
+  if (m == s_modules || address >= (--m)->end)
+    return 0;
+  return m;
+}
+
+/** Find the symbol containing @a address in module @a m, using the
+    same rules as dladdr(): sized symbols must contain the address,
+    unsized ones must match it exactly.  */
+static SymEntry *
+findSymbol(SymModule &m, uintptr_t address)
+{
+  SymEntry key;
+  key.address = address;
+  SymEntry *s = std::upper_bound(m.syms, m.syms + m.nsyms, key, addressLess);
+  if (s == m.syms)
+    return 0;
+
+  --s;
+  if (s->size ? address < s->address + s->size : address == s->address)
+    return s;
+  return 0;
+}
+#endif // __linux
+
+/** Bring the list of loaded objects up to date.  Objects loaded since
+    the last call are added to the index, unloaded ones dropped.  Cheap
+    if nothing has changed.  */
+void
+IgProfSymIndex::refresh(void)
+{
+#if __linux
+  if (s_frozen)
+    return;
+
+  for (size_t i = 0; i < s_nmodules; ++i)
+    s_modules[i].seen = false;
+
+  bool first = true;
+  size_t before = s_nmodules;
+  if (dl_iterate_phdr(scanObject, &first) && s_scanned && before == s_nmodules)
+  {
+    // Nothing changed; the scan stopped at the first object.
+    for (size_t i = 0; i < s_nmodules; ++i)
+      s_modules[i].seen = true;
+    return;
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i < s_nmodules; ++i)
+    if (s_modules[i].seen)
+      s_modules[n++] = s_modules[i];
+    else
+      releaseModule(s_modules[i]);
+
+  s_nmodules = n;
+  s_scanned = true;
+  std::sort(s_modules, s_modules + s_nmodules, moduleLess);
+#endif
+}
+
+/** Stop updating the object list and resolve addresses only from the
+    objects already known.  For snapshot dump processes, which inherit
+    the loader locks of other threads in an unknown state and must not
+    call dl_iterate_phdr() or dladdr().  */
+void
+IgProfSymIndex::freeze(void)
+{
+  s_frozen = true;
+}
+
+/** Describe the loaded object number @a index in @a info.  Returns
+    false once @a index runs past the last object.  Call refresh()
+    first to make sure the list is current.  */
+bool
+IgProfSymIndex::module(unsigned int index, Module &info)
+{
+#if __linux
+  if (index < s_nmodules)
+  {
+    SymModule &m = s_modules[index];
+    info.name = m.name;
+    info.bias = m.bias;
+    info.start = m.start;
+    info.end = m.end;
+    info.buildid = m.buildid;
+    info.buildidlen = m.buildidlen;
+    return true;
+  }
+#endif
+  return false;
+}
+
+/** Resolve @a address to a symbol.  Sets @a sym to the symbol name,
+    @a lib to the name of the object, @a offset to the offset from the
+    start of the symbol and @a liboffset to the offset from the start
+    of the object, all with the same meaning as IgHookTrace::symbol().
+    Returns true if the address belongs to a known object.  */
+bool
+IgProfSymIndex::symbol(void *address,
+		       const char *&sym,
+		       const char *&lib,
+		       long &offset,
+		       long &liboffset)
+{
+#if __linux
+  if (! s_scanned)
+    refresh();
+
+  uintptr_t addr = (uintptr_t) address;
+  SymModule *m = findModule(addr);
+  if (m && (m->state > 0 || (m->state == 0 && loadModule(*m))))
+  {
+    SymEntry *s = findSymbol(*m, addr);
+    sym = s ? s->name : 0;
+    lib = m->name[0] ? m->name : 0;
+    offset = s ? addr - s->address : 0;
+    liboffset = addr - m->start;
+    return true;
+  }
+
+  if (s_frozen)
+  {
+    sym = lib = 0;
+    offset = liboffset = 0;
+    return false;
+  }
+#endif
+
+  return IgHookTrace::symbol(address, sym, lib, offset, liboffset);
+}
@@ -0,0 +1,40 @@
+#ifndef SYM_INDEX_H
+# define SYM_INDEX_H
+
+# include "macros.h"
+
+/** A process-wide index of the symbols of all loaded objects.
+
+    The index is built from the ELF symbol tables of the objects
+    mapped into the process, and resolves call addresses to symbols
+    with a binary search instead of the linear symbol table scan done
+    by dladdr().  Symbol tables are read on first use per object and
+    kept for the lifetime of the process, so the cost is paid only
+    once however many profile dumps are made.  Addresses the index
+    cannot resolve fall back to IgHookTrace::symbol().
+
+    The index is not thread safe; callers must serialise access, as
+    the profile dump code does under the buffer lock.  */
+class HIDDEN IgProfSymIndex
+{
+public:
+  /// Description of a loaded object.
+  struct Module
+  {
+    const char          *name;      //< Object name as reported by dladdr().
+    unsigned long       bias;       //< Load bias added to symbol values.
+    unsigned long       start;      //< First mapped address.
+    unsigned long       end;        //< End of the last mapped segment.
+    const unsigned char *buildid;   //< GNU build-id note contents, or null.
+    unsigned int        buildidlen; //< Length of @a buildid in bytes.
+  };
+
+  static void         refresh(void);
+  static void         freeze(void);
+  static bool         module(unsigned int index, Module &info);
+  static bool         symbol(void *address, const char *&sym,
+			     const char *&lib, long &offset,
+			     long &liboffset);
+};
+
+#endif // SYM_INDEX_H
@@ -118,9 +118,10 @@ public:
   typedef uint64_t Offset;
 private:
   struct CacheItem {
-    CacheItem(Offset offset, const std::string &name)
-      :OFFSET(offset), NAME(name) {};
+    CacheItem(Offset offset, Offset size, const std::string &name)
+      :OFFSET(offset), SIZE(size), NAME(name) {};
     Offset OFFSET;
+    Offset SIZE;
     std::string NAME;
   };
 
@@ -150,7 +151,9 @@ public:
     }
 
   /** Resolves a symbol by looking up the offset of
-      its code in the symbol map for this file.
+      its code in the symbol map for this file.  Returns
+      0 if the offset is past the end of the closest
+      symbol whose size is known.
     */
   const char *symbolByOffset(Offset offset)
     {
@@ -160,7 +163,7 @@ public:
       SymbolCache::iterator i = lower_bound(m_symbolCache.begin(),
                                             m_symbolCache.end(),
                                             offset, CacheItemComparator());
-      if (i->OFFSET == offset)
+      if (i != m_symbolCache.end() && i->OFFSET == offset)
         return i->NAME.c_str();
 
       if (i == m_symbolCache.begin())
@@ -168,6 +171,9 @@ public:
 
       --i;
 
+      if (i->SIZE && offset >= i->OFFSET + i->SIZE)
+        return 0;
+
       return i->NAME.c_str();
     }
 
@@ -181,6 +187,18 @@ public:
       return i->OFFSET;
     }
 
+  /** Read the symbol table of the file so that symbolByOffset() can
+      resolve offsets, if not done already.
+    */
+  void loadSymbols(void)
+    {
+      if (! m_useGdb)
+      {
+        m_useGdb = true;
+        this->createOffsetMap();
+      }
+    }
+
   /** Return true if gdb can be used to better determine symbols inside
       files.
     */
@@ -266,53 +284,79 @@ private:
         exit(1);
       }
 
-      asprintf(&commandLine, "nm -t d -n %s", NAME.c_str());
-      pipe = popen(commandLine, "r");
-      free(commandLine);
-      if (!pipe)
-        return;
-
-      if (ferror(pipe))
+      // Stripped objects have no symbol table, fall back to the
+      // dynamic symbols for them.
+      for (int dynamic = 0; dynamic < 2 && m_symbolCache.empty(); ++dynamic)
       {
-	pclose(pipe);
-	return;
-      }
-
-      setvbuf(pipe, 0, _IOFBF, 128*1024);
-      nextChar = iggetc(pipe);
-      while (nextChar != EOF)
-      {
-        skipchars(pipe, "\n\t ", &nextChar);
-        // If line does not match "^(\\d+)[ ]\\S[ ](\S+)$", exit.
-        fgettoken(pipe, &buffer, &bufferSize, "\n\t ", &nextChar);
-        char *endptr = 0;
-        Offset address = strtoll(buffer, &endptr, 10);
-        if (buffer == endptr)
-          continue;
-        skipchars(pipe, "\t\n ", &nextChar);
-
-        fgettoken(pipe, &buffer, &bufferSize, "\n\t ", &nextChar);
-        if (buffer[1] != 0)
+        asprintf(&commandLine, (dynamic ? "nm -D -S -t d -n %s 2>/dev/null"
+                                : "nm -S -t d -n %s"), NAME.c_str());
+        pipe = popen(commandLine, "r");
+        free(commandLine);
+        if (!pipe)
           continue;
-        skipchars(pipe, "\t\n ", &nextChar);
 
-        fgettoken(pipe, &buffer, &bufferSize, "\n\t ", &nextChar);
-        // If line starts with '.' forget about it.
-        if (buffer[0] == '.')
+        if (ferror(pipe))
+        {
+          pclose(pipe);
           continue;
-        skipchars(pipe, "\t\n ", &nextChar);
-
-        // Create a new symbol with the given fileoffset.
-        // The symbol is automatically saved in the FileInfo cache by offset.
-        // If a symbol with the same offset is already there, the new one
-        // replaces the old one.
-        Offset offset = address - vmbase;
-        if (m_symbolCache.size() && (m_symbolCache.back().OFFSET == offset))
-          m_symbolCache.back().NAME = buffer;
-        else
-          m_symbolCache.push_back(CacheItem(address-vmbase, buffer));
+        }
+
+        setvbuf(pipe, 0, _IOFBF, 128*1024);
+        nextChar = iggetc(pipe);
+        while (nextChar != EOF)
+        {
+          skipchars(pipe, "\n\t ", &nextChar);
+          // If line does not match "^(\\d+)[ ]((\\d+)[ ])?\\S[ ](\S+)$", exit.
+          fgettoken(pipe, &buffer, &bufferSize, "\n\t ", &nextChar);
+          char *endptr = 0;
+          Offset address = strtoll(buffer, &endptr, 10);
+          if (buffer == endptr)
+            continue;
+          skipchars(pipe, "\t\n ", &nextChar);
+
+          fgettoken(pipe, &buffer, &bufferSize, "\n\t ", &nextChar);
+          Offset size = 0;
+          if (buffer[0] && buffer[1] != 0)
+          {
+            size = strtoll(buffer, &endptr, 10);
+            if (buffer == endptr)
+              continue;
+            skipchars(pipe, "\t\n ", &nextChar);
+            fgettoken(pipe, &buffer, &bufferSize, "\n\t ", &nextChar);
+          }
+          if (buffer[1] != 0)
+            continue;
+          skipchars(pipe, "\t\n ", &nextChar);
+
+          fgettoken(pipe, &buffer, &bufferSize, "\n\t ", &nextChar);
+          // If line starts with '.' forget about it.
+          if (buffer[0] == '.')
+            continue;
+          skipchars(pipe, "\t\n ", &nextChar);
+
+          // Drop symbol versions from dynamic symbol names.
+          if (dynamic)
+            if (char *version = strchr(buffer, '@'))
+              *version = 0;
+
+          // Create a new symbol with the given fileoffset.
+          // The symbol is automatically saved in the FileInfo cache by offset.
+          // If a symbol with the same offset is already there, the new one
+          // replaces the old one, unless only the old one has a known size.
+          Offset offset = address - vmbase;
+          if (m_symbolCache.size() && (m_symbolCache.back().OFFSET == offset))
+          {
+            if (size || ! m_symbolCache.back().SIZE)
+            {
+              m_symbolCache.back().NAME = buffer;
+              m_symbolCache.back().SIZE = size;
+            }
+          }
+          else
+            m_symbolCache.push_back(CacheItem(address-vmbase, size, buffer));
+        }
+        pclose(pipe);
       }
-      pclose(pipe);
 #endif /* __APPLE__ */
     }
   bool        m_useGdb;
@@ -9,6 +9,8 @@
 #if __linux
 # include <execinfo.h>
 # include <ucontext.h>
+# include <pthread.h>
+# include <link.h>
 # include <sys/syscall.h>
 # if __x86_64__
 #  define UNW_LOCAL_ONLY
@@ -23,6 +25,388 @@ extern "C" void _sigtramp(void);
 # define MAP_ANONYMOUS MAP_ANON
 #endif
 
+#if __linux && __x86_64__
+extern "C" void *__libc_stack_end;
+
+/// Code address range of a loaded object, for the frame pointer walker.
+struct FPModule
+{
+  unsigned long       start;          //< First code address.
+  unsigned long       end;            //< End of the code.
+  bool                framepointers;  //< Code maintains frame pointers.
+  bool                libc;           //< The C library, which calls main().
+};
+
+/// Sorted table of the code ranges of all loaded objects.
+struct FPModuleTable
+{
+  size_t              n;              //< Number of ranges.
+  size_t              size;           //< Size of this allocation.
+  FPModule            modules[1];     //< The ranges, @c n of them.
+};
+
+/// Scan state for #IgHookTrace::refreshModules().
+struct FPModuleScan
+{
+  FPModuleTable       *table;         //< Table being filled, or null.
+  size_t              n;              //< Number of ranges found.
+};
+
+static int                              s_unwinder      = IgHookTrace::UNWIND_DWARF;
+static FPModuleTable * volatile         s_fpmodules     = 0;
+static unsigned long long               s_fpadds        = 0;
+static unsigned long long               s_fpsubs        = 0;
+static THREAD_LOCAL char                *s_stacklo INITIAL_EXEC = 0;
+static THREAD_LOCAL char                *s_stackhi INITIAL_EXEC = 0;
+static THREAD_LOCAL char                *s_stackroot INITIAL_EXEC = 0;
+
+/** Guess whether an object was compiled to maintain frame pointers.
+    Samples the functions listed in the unwind table search index of
+    the object and checks how many set up a frame pointer: start with
+    "push %rbp", optionally after "endbr64", followed shortly by "mov
+    %rsp,%rbp".  Code built without frame pointers hardly ever does
+    that, while in code built with them only functions which need no
+    stack frame, such as tail call stubs, do not.  Objects with at
+    least a quarter of the functions setting up a frame pointer are
+    taken to keep frame pointers.  Objects without a usable index are
+    assumed not to.  */
+static bool
+hasFramePointers(dl_phdr_info *info)
+{
+  const unsigned char *hdr = 0;
+  for (int i = 0; i < info->dlpi_phnum; ++i)
+    if (info->dlpi_phdr[i].p_type == PT_GNU_EH_FRAME)
+      hdr = (const unsigned char *) (info->dlpi_addr
+				     + info->dlpi_phdr[i].p_vaddr);
+
+  // Only handle the layout the linkers use: version 1, sdata4 pointer
+  // to the unwind tables, udata4 entry count and sdata4 table entries
+  // relative to the header.
+  if (! hdr || hdr[0] != 1 || (hdr[1] & 0x0f) != 0x0b
+      || hdr[2] != 0x03 || hdr[3] != 0x3b)
+    return false;
+
+  unsigned int count;
+  memcpy(&count, hdr + 8, sizeof(count));
+  if (! count)
+    return false;
+
+  const int MAX_SAMPLES = 256;
+  unsigned int step = count > MAX_SAMPLES ? count / MAX_SAMPLES : 1;
+  unsigned int nsampled = 0, nframed = 0;
+  for (unsigned int i = 0; i < count; i += step, ++nsampled)
+  {
+    int loc;
+    memcpy(&loc, hdr + 12 + 8*i, sizeof(loc));
+    const unsigned char *code = hdr + loc;
+
+    // Skip samples outside the executable segments.
+    bool inside = false;
+    for (int j = 0; j < info->dlpi_phnum && ! inside; ++j)
+    {
+      const ElfW(Phdr) &ph = info->dlpi_phdr[j];
+      const unsigned char *start
+	= (const unsigned char *) (info->dlpi_addr + ph.p_vaddr);
+      inside = (ph.p_type == PT_LOAD && (ph.p_flags & PF_X)
+		&& code >= start && code + 24 <= start + ph.p_memsz);
+    }
+    if (! inside)
+      continue;
+
+    if (code[0] == 0xf3 && code[1] == 0x0f && code[2] == 0x1e && code[3] == 0xfa)
+      code += 4;
+    if (code[0] != 0x55)
+      continue;
+    for (int j = 1; j < 16; ++j)
+      if (code[j] == 0x48 && code[j+1] == 0x89 && code[j+2] == 0xe5)
+      {
+	++nframed;
+	break;
+      }
+  }
+
+  return nframed * 4 >= nsampled;
+}
+
+/** Check if the object named @a name is the C library or the thread
+    library, whose code calls main() and thread functions.  */
+static bool
+isCLibrary(const char *name)
+{
+  const char *base = name ? strrchr(name, '/') : 0;
+  base = base ? base + 1 : name;
+  return base && (! strncmp(base, "libc.so", 7)
+		  || ! strncmp(base, "libpthread.so", 13));
+}
+
+/** Record the code ranges of one loaded object reported by
+    dl_iterate_phdr(), or just count them if there is no table yet.  */
+static int
+scanModule(dl_phdr_info *info, size_t, void *arg)
+{
+  FPModuleScan *scan = (FPModuleScan *) arg;
+  bool framepointers = scan->table && hasFramePointers(info);
+  bool libc = scan->table && isCLibrary(info->dlpi_name);
+  for (int i = 0; i < info->dlpi_phnum; ++i)
+  {
+    const ElfW(Phdr) &ph = info->dlpi_phdr[i];
+    if (ph.p_type != PT_LOAD || ! (ph.p_flags & PF_X))
+      continue;
+
+    if (scan->table && scan->n < scan->table->size)
+    {
+      FPModule &m = scan->table->modules[scan->n];
+      m.start = info->dlpi_addr + ph.p_vaddr;
+      m.end = m.start + ph.p_memsz;
+      m.framepointers = framepointers;
+      m.libc = libc;
+    }
+    ++scan->n;
+  }
+
+  s_fpadds = info->dlpi_adds;
+  s_fpsubs = info->dlpi_subs;
+  return 0;
+}
+
+/** Return the code range of the object code address @a ip belongs to,
+    or null if it is not in any.  */
+static inline const FPModule *
+findModule(FPModuleTable *table, void *ip)
+{
+  unsigned long addr = (unsigned long) ip;
+  size_t lo = 0, hi = table->n;
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+    if (table->modules[mid].end <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return (lo < table->n && table->modules[lo].start <= addr
+	  ? &table->modules[lo] : 0);
+}
+
+/** Return true if @a ip is the signal return trampoline the kernel
+    returns to from a signal handler, "mov $__NR_rt_sigreturn, %rax;
+    syscall".  */
+static inline bool
+isSignalTrampoline(const unsigned char *ip)
+{
+  return ip[0] == 0x48 && ip[1] == 0xc7 && ip[2] == 0xc0
+    && ip[3] == __NR_rt_sigreturn && ip[4] == 0 && ip[5] == 0
+    && ip[6] == 0 && ip[7] == 0x0f && ip[8] == 0x05;
+}
+
+/** Walk the call stack by following the frame pointer chain from the
+    frame @a start.  Each frame record holds the caller's frame pointer
+    and the return address.  Every frame record must lie within the
+    stack of the calling thread and above the previous one.  At the
+    signal trampoline the walk continues from the register context of
+    the interrupted code, which the kernel stored just above it.
+
+    In automatic mode the frame pointer left by code from an object
+    without frame pointers cannot be trusted.  The exception is the
+    C library code at the outer end of the stack which calls main() or
+    a thread function: a return address into it is taken as the
+    outermost frame if its frame record is at or above the root frame
+    record found by #IgHookTrace::threadInit() and the frame pointer
+    saved there is not a valid one.  Only the start up frames beyond
+    it are left out.
+
+    Returns the number of frames, or -1 if the stack should be walked
+    with libunwind instead: the stack bounds of the thread are not
+    known, or in automatic mode, the stack has other code from an
+    object without frame pointers or the chain breaks before the
+    outermost frame.  */
+static int
+fpStacktrace(void **start, void **addresses, int nmax)
+{
+  struct frame
+  {
+    frame             *fp;
+    void              *ip;
+  };
+
+  char                *lo = s_stacklo;
+  char                *hi = s_stackhi;
+  FPModuleTable       *modules = s_fpmodules;
+  bool                automatic = (s_unwinder == IgHookTrace::UNWIND_AUTO);
+  const FPModule      *m = 0;
+  frame               *fp = (frame *) start;
+  int                 depth = 0;
+
+  if (! hi || (automatic && ! modules))
+    return -1;
+
+  while (depth < nmax)
+  {
+    if ((char *) fp < lo || (char *) (fp + 1) > hi
+	|| ((unsigned long) fp & (sizeof(void *)-1)))
+      return automatic ? -1 : depth;
+
+    void *ip = fp->ip;
+    frame *next = fp->fp;
+    if (! ip)
+      break;
+
+    addresses[depth++] = ip;
+    if (isSignalTrampoline((const unsigned char *) ip))
+    {
+      ucontext_t *uc = (ucontext_t *) (fp + 1);
+      if ((char *) (uc + 1) > hi)
+	return automatic ? -1 : depth;
+
+      ip = (void *) uc->uc_mcontext.gregs[REG_RIP];
+      next = (frame *) uc->uc_mcontext.gregs[REG_RBP];
+      if (depth < nmax)
+	addresses[depth++] = ip;
+    }
+
+    // In automatic mode, stop at the C library code which called the
+    // outermost function, and give up on any other code without frame
+    // pointers.  Callers are mostly in the same object as the callee,
+    // so check that first.
+    if (automatic && ! (m && m->start <= (unsigned long) ip
+			&& (unsigned long) ip < m->end))
+      m = findModule(modules, ip);
+    if (automatic && ! (m && m->framepointers))
+    {
+      if (m && m->libc && s_stackroot && (char *) fp >= s_stackroot
+	  && (next <= fp || (char *) (next + 1) > hi
+	      || ((unsigned long) next & (sizeof(void *)-1))))
+	break;
+      return -1;
+    }
+
+    // The outermost frame has a null frame pointer.
+    if (! next)
+      break;
+    if (next <= fp)
+      return automatic ? -1 : depth;
+
+    fp = next;
+  }
+
+  return depth;
+}
+#endif
+
+/** Select the stack walker.  Only x86-64 has a choice: #UNWIND_DWARF,
+    the default, walks the stack with libunwind.  #UNWIND_FP follows
+    the frame pointer chain, which is much faster but gives wrong or
+    truncated stacks where code does not maintain frame pointers.
+    #UNWIND_AUTO follows frame pointers if all the code on the stack
+    comes from objects built with frame pointers, and otherwise walks
+    the stack with libunwind.  The frame pointer walkers only work in
+    threads set up with #threadInit().  */
+void
+IgHookTrace::setUnwinder(int kind)
+{
+#if __linux && __x86_64__
+  s_unwinder = kind;
+  refreshModules();
+#else
+  (void) kind;
+#endif
+}
+
+/** Prepare the calling thread for the frame pointer stack walkers by
+    recording the bounds of its stack and its root frame record, and
+    update the list of loaded objects.  Not safe to call in signal
+    handlers.
+
+    The root frame record is the lowest one in which the automatic
+    walker accepts a return address into the C library as the end of
+    the stack.  In the main thread main() has its frame record a few
+    hundred bytes below the stack pointer the process started with, so
+    the root is taken to be ROOT_SPAN bytes below that.  Other threads
+    are started by the profiler's own thread wrapper, which calls this
+    function, so the root is the outermost frame record on the chain
+    from here; those frames all have frame pointers.  */
+void
+IgHookTrace::threadInit(void)
+{
+#if __linux && __x86_64__
+  static const int ROOT_SPAN = 512;
+  pthread_attr_t attr;
+  void *addr = 0;
+  size_t size = 0;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0)
+  {
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0)
+    {
+      s_stacklo = (char *) addr;
+      s_stackhi = (char *) addr + size;
+    }
+    pthread_attr_destroy(&attr);
+  }
+
+  char *end = (char *) __libc_stack_end;
+  if (s_stackhi && end > s_stacklo && end <= s_stackhi)
+    s_stackroot = end - ROOT_SPAN;
+  else if (s_stackhi)
+  {
+    void **fp = (void **) __builtin_frame_address(0);
+    void **next;
+    while ((next = (void **) *fp) > fp && (char *) (next + 2) <= s_stackhi
+	   && ! ((unsigned long) next & (sizeof(void *)-1)))
+      fp = next;
+    s_stackroot = (char *) fp;
+  }
+
+  refreshModules();
+#endif
+}
+
+/** Update the table of loaded objects used by the automatic stack
+    walker to tell which code has frame pointers, if the automatic
+    walker is selected and objects have been loaded or unloaded since
+    the last update.  Not safe to call in
+    signal handlers.  Old tables are never freed as a stack walk in a
+    signal handler may still be using them.  */
+void
+IgHookTrace::refreshModules(void)
+{
+#if __linux && __x86_64__
+  if (s_unwinder != UNWIND_AUTO)
+    return;
+
+  unsigned long long adds = s_fpadds, subs = s_fpsubs;
+  FPModuleScan scan = { 0, 0 };
+  dl_iterate_phdr(scanModule, &scan);
+  if (s_fpmodules && adds == s_fpadds && subs == s_fpsubs)
+    return;
+
+  size_t size = sizeof(FPModuleTable) + (scan.n + 16) * sizeof(FPModule);
+  void *mem = mmap(0, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return;
+
+  FPModuleTable *table = (FPModuleTable *) mem;
+  table->n = 0;
+  table->size = scan.n + 16;
+  scan.table = table;
+  scan.n = 0;
+  dl_iterate_phdr(scanModule, &scan);
+  table->n = scan.n < table->size ? scan.n : table->size;
+
+  for (size_t i = 1; i < table->n; ++i)
+    for (size_t j = i; j > 0 && table->modules[j].start < table->modules[j-1].start; --j)
+    {
+      FPModule tmp = table->modules[j];
+      table->modules[j] = table->modules[j-1];
+      table->modules[j-1] = tmp;
+    }
+
+  __sync_synchronize();
+  s_fpmodules = table;
+#endif
+}
+
 bool
 IgHookTrace::symbol(void *address,
                     const char *&sym,
@@ -172,6 +556,13 @@ IgHookTrace::stacktrace(void **addresses, int nmax)
 
   return depth;
 #elif __linux && __x86_64__
+  if (s_unwinder != UNWIND_DWARF)
+  {
+    int depth = fpStacktrace((void **) __builtin_frame_address(0),
+			     addresses, nmax);
+    if (depth >= 0)
+      return depth;
+  }
   return unw_backtrace(addresses, nmax);
 #if 0 // Debug code for tracking unwind failures.
   if (addresses[depth-1] != (void *) 0x40cce9)
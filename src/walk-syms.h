@@ -6,6 +6,12 @@
 class HIDDEN IgHookTrace
 {
 public:
+  /// Stack walkers, see #setUnwinder().
+  enum { UNWIND_DWARF, UNWIND_FP, UNWIND_AUTO };
+
+  static void         setUnwinder(int kind);
+  static void         threadInit(void);
+  static void         refreshModules(void);
   static int          stacktrace(void **addresses, int nmax);
   static void *       tosymbol(void *address);
   static bool         symbol(void *address, const char *&sym,